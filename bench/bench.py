@@ -0,0 +1,297 @@
+#!/usr/bin/env python3
+"""Output throughput benchmark for termomix.
+
+Generates a fixed set of workloads, runs each one through `termomix -x`
+several times and prints the results as JSON. Run it with `make bench`,
+which starts a headless X server with xvfb-run, or by hand on any display:
+
+    python3 bench/bench.py [--runs N] [--size MB] [--pacing on|off|both]
+                           [--logging on|off|both] [--background IMAGE]
+                           [--prewarm on|off|both] [--termomix ./termomix]
+
+Every run ends with a cursor position request (DSR). The shell waits for the
+answer before it exits, so the timing covers the whole workload being parsed
+and drawn by the terminal, not just written to the PTY. The `startup`
+workload prints nothing; its median is subtracted from the wall time of the
+others before computing MB/s. Every workload runs with frame pacing on and
+off unless --pacing picks one, and with the session log off unless --logging
+asks for it. With --background every workload also runs with IMAGE as the
+background image, and --prewarm off turns glyph fallback prewarming off. The
+results are grouped by configuration, like "pacing=on logging=off
+background=off prewarm=on", and include the frames per second termomix drew
+and its longest frame (TERMOMIX_FRAME_STATS). The `fallback` workload shows
+box drawing, CJK, Hangul and emoji characters for the first time, so its
+longest frame is the stall of a font fallback lookup.
+"""
+
+import argparse
+import json
+import os
+import random
+import re
+import shutil
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+COLUMNS = 80
+ROWS = 24
+
+
+def ascii_flood(size):
+    rng = random.Random(1)
+    alphabet = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789 "
+    line = "".join(rng.choice(alphabet) for _ in range(COLUMNS - 1)) + "\n"
+    return (line * (size // len(line) + 1))[:size].encode()
+
+
+def sgr_colors(size):
+    rng = random.Random(2)
+    out = []
+    total = 0
+    while total < size:
+        chunk = "\033[%d;%d;%dm%s" % (rng.choice((0, 1, 4, 7)),
+                30 + rng.randrange(8), 40 + rng.randrange(8),
+                chr(ord("a") + rng.randrange(26)) * rng.randrange(1, 6))
+        if rng.randrange(16) == 0:
+            chunk += "\033[0m\n"
+        out.append(chunk)
+        total += len(chunk)
+    return "".join(out).encode()[:size]
+
+
+def scroll_region(size):
+    rng = random.Random(3)
+    out = ["\033[2J\033[5;20r"]
+    total = 0
+    while total < size:
+        chunk = "\033[20;1H%s\n" % ("%08x " % rng.getrandbits(32) * 8)
+        if rng.randrange(8) == 0:
+            chunk += "\033[5;1H\033M"       # reverse index at the top
+        out.append(chunk)
+        total += len(chunk)
+    out.append("\033[r")
+    return "".join(out).encode()[:size]
+
+
+def wrapped_lines(size):
+    rng = random.Random(4)
+    out = []
+    total = 0
+    while total < size:
+        length = rng.randrange(COLUMNS * 4, COLUMNS * 64)
+        chunk = "x" * length + "\n"
+        out.append(chunk)
+        total += len(chunk)
+    return "".join(out).encode()[:size]
+
+
+def wide_chars(size):
+    rng = random.Random(5)
+    # CJK ideographs, Hangul syllables and fullwidth forms
+    ranges = ((0x4e00, 0x9fff), (0xac00, 0xd7a3), (0xff01, 0xff5e))
+    out = []
+    total = 0
+    while total < size:
+        lo, hi = rng.choice(ranges)
+        line = "".join(chr(rng.randrange(lo, hi)) for _ in range(COLUMNS // 2 - 1))
+        chunk = (line + "\n").encode()
+        out.append(chunk)
+        total += len(chunk)
+    return b"".join(out)
+
+
+def full_redraw(size):
+    rng = random.Random(6)
+    out = []
+    total = 0
+    while total < size:
+        frame = ["\033[H"]
+        for row in range(1, ROWS + 1):
+            frame.append("\033[%d;1H\033[3%dm%s" % (row, rng.randrange(8),
+                    "%x" % rng.getrandbits(4) * (COLUMNS - 1)))
+        frame.append("\033[0m")
+        chunk = "".join(frame)
+        out.append(chunk)
+        total += len(chunk)
+    return "".join(out).encode()
+
+
+def fallback_glyphs(size):
+    rng = random.Random(7)
+    # Box drawing, kana, CJK ideographs, Hangul syllables and emoji
+    ranges = ((0x2500, 0x257f), (0x3041, 0x30ff), (0x4e00, 0x9fff),
+              (0xac00, 0xd7a3), (0x1f300, 0x1f64f))
+    out = []
+    total = 0
+    while total < size:
+        lo, hi = ranges[len(out) % len(ranges)]
+        line = "".join(chr(rng.randrange(lo, hi)) for _ in range(COLUMNS // 2 - 1))
+        chunk = (line + "\n").encode()
+        out.append(chunk)
+        total += len(chunk)
+    return b"".join(out)
+
+
+WORKLOADS = (
+    ("ascii", ascii_flood),
+    ("sgr", sgr_colors),
+    ("scroll_region", scroll_region),
+    ("wrapped", wrapped_lines),
+    ("wide", wide_chars),
+    ("redraw", full_redraw),
+    ("fallback", fallback_glyphs),
+)
+
+
+def write_config(confdir, pacing, logging, background, prewarm):
+    os.makedirs(os.path.join(confdir, "termomix"), exist_ok=True)
+    log_file = os.path.join(confdir, "session-%p.log") if logging else ""
+    with open(os.path.join(confdir, "termomix", "termomix.conf"), "w") as f:
+        f.write("[termomix]\nframe_pacing=%s\nlog_file=%s\nbackground=%s\n" %
+                (str(pacing).lower(), log_file, background or "none"))
+        # Without the key termomix uses its default ranges
+        if not prewarm:
+            f.write("prewarm_ranges=\n")
+
+
+def run(termomix, path, env):
+    # Unbuffered and without echo, so dd gets the DSR answer as soon as it
+    # arrives and it isn't drawn. Not raw: output processing has to stay on
+    # for every \n to return to column 0
+    script = ("stty -echo -icanon min 1; cat '%s'; printf '\\033[6n'; "
+              "dd bs=1 count=1 2>/dev/null >/dev/null" % path)
+    argv = [termomix, "--standalone", "-c", str(COLUMNS), "-r", str(ROWS),
+            "-x", "sh -c \"%s\"" % script]
+
+    # stderr goes to a file: a pipe nobody reads until wait4() returns
+    # blocks termomix once it holds 64 KiB of warnings
+    with tempfile.TemporaryFile() as errors:
+        start = time.monotonic()
+        proc = subprocess.Popen(argv, env=env, stdout=subprocess.DEVNULL,
+                stderr=errors)
+        _, status, usage = os.wait4(proc.pid, 0)
+        wall = time.monotonic() - start
+        proc.returncode = os.waitstatus_to_exitcode(status)
+        errors.seek(0)
+        stats = re.search(rb"([0-9.]+) fps, longest ([0-9.]+) ms",
+                errors.read())
+
+    if proc.returncode != 0:
+        raise RuntimeError("%s exited with status %d" % (termomix,
+                proc.returncode))
+    # ru_*time of a waited child include its own waited children (sh, cat)
+    fps, longest = (float(stats.group(1)), float(stats.group(2))) \
+            if stats else (0.0, 0.0)
+    return wall, usage.ru_utime, usage.ru_stime, fps, longest
+
+
+def summary(values):
+    return {
+        "median": statistics.median(values),
+        "mean": statistics.mean(values),
+        "stdev": statistics.stdev(values) if len(values) > 1 else 0.0,
+        "min": min(values),
+        "max": max(values),
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--termomix", default="./termomix")
+    parser.add_argument("--runs", type=int, default=5)
+    parser.add_argument("--size", type=int, default=16,
+            help="size of every workload in MB")
+    parser.add_argument("--only", action="append",
+            help="run only this workload (repeatable)")
+    parser.add_argument("--pacing", choices=("on", "off", "both"),
+            default="both")
+    parser.add_argument("--logging", choices=("on", "off", "both"),
+            default="off")
+    parser.add_argument("--background", metavar="IMAGE",
+            help="also run every workload with this background image")
+    parser.add_argument("--prewarm", choices=("on", "off", "both"),
+            default="on")
+    args = parser.parse_args()
+    modes = {"on": (True,), "off": (False,), "both": (True, False)}
+    backgrounds = (None, os.path.abspath(args.background)) \
+            if args.background else (None,)
+    configs = [(pacing, logging, background, prewarm)
+               for pacing in modes[args.pacing]
+               for logging in modes[args.logging]
+               for background in backgrounds
+               for prewarm in modes[args.prewarm]]
+
+    if not os.access(args.termomix, os.X_OK):
+        sys.exit("bench: %s is not executable, run make first" % args.termomix)
+
+    tmp = tempfile.mkdtemp(prefix="termomix-bench-")
+    # A private config dir, so the user's termomix.conf doesn't change the
+    # numbers, and a private cache dir for the scaled background
+    env = dict(os.environ, XDG_CONFIG_HOME=tmp, XDG_CACHE_HOME=tmp,
+            TERM="xterm", TERMOMIX_FRAME_STATS="1")
+
+    try:
+        empty = os.path.join(tmp, "startup")
+        open(empty, "wb").close()
+        startup = [run(args.termomix, empty, env)[0] for _ in range(args.runs)]
+        base = statistics.median(startup)
+
+        results = {
+            "termomix": os.path.abspath(args.termomix),
+            "runs": args.runs,
+            "columns": COLUMNS,
+            "rows": ROWS,
+            "startup_s": summary(startup),
+            "configs": {},
+        }
+
+        for name, generate in WORKLOADS:
+            if args.only and name not in args.only:
+                continue
+            path = os.path.join(tmp, name)
+            data = generate(args.size * 1024 * 1024)
+            with open(path, "wb") as f:
+                f.write(data)
+
+            for pacing, logging, background, prewarm in configs:
+                write_config(tmp, pacing, logging, background, prewarm)
+                walls, users, systems, rates, fps, longest = [], [], [], [], [], []
+                for _ in range(args.runs):
+                    wall, user, system, frames, frame = run(args.termomix,
+                            path, env)
+                    walls.append(wall)
+                    users.append(user)
+                    systems.append(system)
+                    rates.append(len(data) / 1e6 / max(wall - base, 1e-6))
+                    fps.append(frames)
+                    longest.append(frame)
+
+                label = "pacing=%s logging=%s background=%s prewarm=%s" % (
+                        "on" if pacing else "off", "on" if logging else "off",
+                        "on" if background else "off",
+                        "on" if prewarm else "off")
+                results["configs"].setdefault(label, {})[name] = {
+                    "bytes": len(data),
+                    "wall_s": summary(walls),
+                    "cpu_user_s": summary(users),
+                    "cpu_sys_s": summary(systems),
+                    "mb_per_s": summary(rates),
+                    "fps": summary(fps),
+                    "longest_frame_ms": summary(longest),
+                }
+                print("bench: %-14s %-50s %8.1f MB/s %6.1f fps %7.1f ms" % (
+                        name, label, statistics.median(rates),
+                        statistics.median(fps), statistics.median(longest)),
+                        file=sys.stderr)
+    finally:
+        shutil.rmtree(tmp)
+
+    json.dump(results, sys.stdout, indent=2, sort_keys=True)
+    print()
+
+
+if __name__ == "__main__":
+    main()
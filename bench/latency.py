@@ -0,0 +1,86 @@
+#!/usr/bin/env python3
+"""Synthetic typing driver for termomix --latency-trace.
+
+Starts termomix running `cat`, types a fixed text into it with xdotool, ends
+`cat` with Ctrl+D and prints the latency report termomix writes when it
+exits. Run it with `make latency`, which starts a headless X server with
+xvfb-run, or by hand on any display:
+
+    python3 bench/latency.py [--keys N] [--delay MS] [--pacing on|off|both]
+                             [--termomix ./termomix]
+"""
+
+import argparse
+import os
+import random
+import shutil
+import subprocess
+import sys
+import tempfile
+
+TEXT = "the quick brown fox jumps over the lazy dog "
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--termomix", default="./termomix")
+    parser.add_argument("--keys", type=int, default=500)
+    parser.add_argument("--delay", type=int, default=30,
+            help="ms between keys")
+    parser.add_argument("--log", help="keep the per key log in this file")
+    parser.add_argument("--pacing", choices=("on", "off", "both"),
+            default="both")
+    args = parser.parse_args()
+    pacings = {"on": (True,), "off": (False,), "both": (True, False)}[args.pacing]
+
+    if not os.access(args.termomix, os.X_OK):
+        sys.exit("latency: %s is not executable, run make first" % args.termomix)
+    if not shutil.which("xdotool"):
+        sys.exit("latency: xdotool is needed to type")
+
+    tmp = tempfile.mkdtemp(prefix="termomix-latency-")
+    env = dict(os.environ, XDG_CONFIG_HOME=tmp)
+    os.makedirs(os.path.join(tmp, "termomix"))
+
+    # Seeded, so every run types the same keys
+    rng = random.Random(1)
+    words = TEXT.split()
+    text = ""
+    while len(text) < args.keys:
+        text += rng.choice(words) + " "
+    text = text[:args.keys]
+
+    proc = None
+    try:
+        for pacing in pacings:
+            mode = "on" if pacing else "off"
+            log = os.path.join(tmp, "latency-%s.log" % mode)
+            if args.log:
+                log = "%s.%s" % (args.log, mode)
+            with open(os.path.join(tmp, "termomix", "termomix.conf"), "w") as f:
+                f.write("[termomix]\nframe_pacing=%s\n" % str(pacing).lower())
+
+            proc = subprocess.Popen([args.termomix, "--standalone",
+                    "--latency-trace", log, "-x", "cat"], env=env)
+            subprocess.run(["xdotool", "search", "--sync", "--pid",
+                    str(proc.pid), "windowfocus", "--sync", "%1",
+                    "type", "--delay", str(args.delay), text], check=True)
+            # Return and Ctrl+D end cat, and termomix with it
+            subprocess.run(["xdotool", "key", "--delay", str(args.delay),
+                    "Return", "ctrl+d"], check=True)
+            if proc.wait(timeout=30) != 0:
+                sys.exit("latency: termomix exited with status %d" %
+                        proc.returncode)
+
+            with open(log) as f:
+                report = f.read().split("\n\n", 1)
+            print("pacing %s" % mode)
+            print(report[1] if len(report) > 1 else report[0])
+    finally:
+        if proc and proc.poll() is None:
+            proc.kill()
+        shutil.rmtree(tmp)
+
+
+if __name__ == "__main__":
+    main()
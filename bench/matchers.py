@@ -0,0 +1,164 @@
+#!/usr/bin/env python3
+"""Click and hover match cost benchmark for termomix.
+
+Times the GLib regex work behind a click and a pointer motion event on a
+screen of compiler and git output, for the old single URL regex and for the
+[matchers] regex, through GLib's own GRegex (PyGObject). Run it with
+`make bench-matchers`, no display needed:
+
+    python3 bench/matchers.py [--runs N] [--events N]
+
+VTE matches the whole screen and keeps the match under the pointer; that is
+what a click cost before, and what every motion event still costs. A click
+now matches one row, or takes the row's matches from the per row cache after
+comparing its text. Motion events reach VTE at most every HOVER_INTERVAL, so
+the cost per event is scaled by the share of events let through while the
+pointer moves at --rate events per second. Results are printed as JSON, in
+microseconds per event.
+"""
+
+import argparse
+import json
+import random
+import statistics
+import sys
+import time
+
+from gi.repository import GLib
+
+COLUMNS = 80
+ROWS = 24
+HOVER_INTERVAL = 0.05
+
+HTTP_REGEXP = "(ftp|http)s?://[-a-zA-Z0-9.?$%&/=_~#.,:;+]*"
+MATCHERS = (
+    ("url", "(?i)(ftp|http)s?://[-a-zA-Z0-9.?$%&/=_~#.,:;+]*"),
+    ("file_line", "[-\\w./~]*\\w\\.\\w+:[0-9]+(:[0-9]+)?"),
+    ("git_hash", "\\b(?=[0-9]*[a-f])[0-9a-f]{7,40}\\b"),
+    ("ip", "\\b([0-9]{1,3}\\.){3}[0-9]{1,3}\\b"),
+    ("ticket", "\\b[A-Z][A-Z0-9]+-[0-9]+\\b"),
+)
+
+
+def screen():
+    rng = random.Random(1)
+    lines = []
+    for i in range(ROWS):
+        kind = i % 4
+        if kind == 0:
+            line = "src/module%d.c:%d:%d: warning: unused variable 'x%d'" % (
+                    i, rng.randrange(1, 999), rng.randrange(1, 80), i)
+        elif kind == 1:
+            line = "%07x Fix the build on PROJ-%d" % (rng.getrandbits(28),
+                    rng.randrange(1, 9999))
+        elif kind == 2:
+            line = "see https://example.org/issues/%d?from=10.0.%d.%d" % (
+                    rng.randrange(1, 99999), rng.randrange(256),
+                    rng.randrange(256))
+        else:
+            line = "make[%d]: Leaving directory '/home/user/build/%d'" % (
+                    rng.randrange(1, 4), i)
+        lines.append(line[:COLUMNS] + "\n")
+    return lines
+
+
+def compile_regex(pattern, caseless):
+    flags = GLib.RegexCompileFlags.OPTIMIZE
+    if caseless:
+        flags |= GLib.RegexCompileFlags.CASELESS
+    return GLib.Regex.new(pattern, flags, GLib.RegexMatchFlags.NOTEMPTY)
+
+
+def match_covering(regex, text, offset):
+    """The match of regex in text that covers offset, like VTE's match check"""
+    ok, info = regex.match(text, 0)
+    while ok and info.matches():
+        _, start, end = info.fetch_pos(0)
+        if start <= offset < end:
+            return info.fetch(0)
+        ok = info.next()
+    return None
+
+
+def row_matches(regex, text):
+    ok, info = regex.match(text, 0)
+    found = []
+    while ok and info.matches():
+        found.append(info.fetch_pos(0)[1:] + (info.fetch(0),))
+        ok = info.next()
+    return found
+
+
+def timed(func, points, runs):
+    samples = []
+    for _ in range(runs):
+        start = time.perf_counter()
+        for point in points:
+            func(point)
+        samples.append((time.perf_counter() - start) / len(points) * 1e6)
+    return statistics.median(samples)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--runs", type=int, default=5)
+    parser.add_argument("--events", type=int, default=2000)
+    parser.add_argument("--rate", type=int, default=1000,
+            help="motion events per second while the pointer moves")
+    args = parser.parse_args()
+
+    lines = screen()
+    text = "".join(lines)
+    offsets = [sum(len(l) for l in lines[:row]) for row in range(ROWS)]
+    rng = random.Random(2)
+    points = [(row, rng.randrange(len(lines[row]) - 1))
+              for row in (rng.randrange(ROWS) for _ in range(args.events))]
+
+    single = compile_regex(HTTP_REGEXP, True)
+    combined = compile_regex("|".join("(?<%s>%s)" % m for m in MATCHERS), False)
+    cache = {}
+
+    def screen_check(regex):
+        return lambda p: match_covering(regex, text, offsets[p[0]] + p[1])
+
+    def row_check(p):
+        return [m for m in row_matches(combined, lines[p[0]])
+                if m[0] <= p[1] < m[1]]
+
+    def cached_check(p):
+        entry = cache.get(p[0])
+        # The text is compared again when the contents changed
+        if entry is None or entry[0] != lines[p[0]]:
+            entry = cache[p[0]] = (lines[p[0]],
+                    row_matches(combined, lines[p[0]]))
+        return [m for m in entry[1] if m[0] <= p[1] < m[1]]
+
+    let_through = min(1.0, 1.0 / (HOVER_INTERVAL * args.rate))
+    results = {
+        "events": args.events,
+        "runs": args.runs,
+        "click_us": {
+            "single_screen": timed(screen_check(single), points, args.runs),
+            "combined_screen": timed(screen_check(combined), points,
+                    args.runs),
+            "combined_row": timed(row_check, points, args.runs),
+            "combined_row_cached": timed(cached_check, points, args.runs),
+        },
+        "motion_us": {},
+        "motion_let_through": let_through,
+    }
+    for name, regex in (("single", single), ("combined", combined)):
+        cost = timed(screen_check(regex), points, args.runs)
+        results["motion_us"][name] = cost
+        results["motion_us"][name + "_throttled"] = cost * let_through
+
+    for group in ("click_us", "motion_us"):
+        for name, value in sorted(results[group].items()):
+            print("bench: %-9s %-20s %8.2f us" % (group[:-3], name, value),
+                    file=sys.stderr)
+    json.dump(results, sys.stdout, indent=2, sort_keys=True)
+    print()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,131 @@
+#!/usr/bin/env python3
+"""Scrollback search query latency benchmark for termomix.
+
+Prints a large scrollback (1M lines by default) in a termomix window, waits
+for the search index to catch up, then times queries through
+`termomix @ search`, with the index and with --scan, which reads every
+block from the terminal like a search without the index. Run it with
+`make bench-search`, or by hand on any display:
+
+    python3 bench/search.py [--lines N] [--runs N] [--termomix ./termomix]
+
+Each query is timed inside termomix, from the query to the newest match, so
+the numbers don't include starting the `termomix @` client. The results are
+printed as JSON: the median microseconds and blocks read of every query.
+"""
+
+import argparse
+import json
+import os
+import random
+import shutil
+import statistics
+import subprocess
+import sys
+import tempfile
+
+COLUMNS = 80
+ROWS = 24
+
+# (name, extra arguments, text). The needle is printed once, near the top
+QUERIES = (
+    ("rare", (), "needle-4f2a"),
+    ("common", (), "warning"),
+    ("absent", (), "no-such-text"),
+    ("short", (), "ok"),
+    ("regex", ("--regex",), r"error: .*4f2a"),
+)
+
+
+def scrollback(lines):
+    rng = random.Random(1)
+    words = ("build", "step", "compile", "link", "warning", "ok", "src",
+             "include", "object", "test")
+    out = []
+    for i in range(lines):
+        line = "%07d %s" % (i, " ".join(rng.choice(words) for _ in range(8)))
+        if i == lines // 100:
+            line += " error: needle-4f2a"
+        out.append(line[:COLUMNS - 1] + "\n")
+    return "".join(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--termomix", default="./termomix")
+    parser.add_argument("--lines", type=int, default=1000000)
+    parser.add_argument("--runs", type=int, default=5)
+    args = parser.parse_args()
+
+    if not os.access(args.termomix, os.X_OK):
+        sys.exit("bench: %s is not executable, run make first" % args.termomix)
+    termomix = os.path.abspath(args.termomix)
+
+    tmp = tempfile.mkdtemp(prefix="termomix-bench-")
+    # Room for every line, VTE keeps 8 bytes per cell
+    budget = (args.lines + ROWS) * COLUMNS * 8 * 2
+    os.makedirs(os.path.join(tmp, "termomix"))
+    with open(os.path.join(tmp, "termomix", "termomix.conf"), "w") as f:
+        f.write("[termomix]\nremote_control=true\nscrollback_bytes=%d\n"
+                "scrollback_total_bytes=%d\n" % (budget, budget))
+    env = dict(os.environ, XDG_CONFIG_HOME=tmp, XDG_CACHE_HOME=tmp,
+            XDG_RUNTIME_DIR=tmp, TERM="xterm")
+
+    try:
+        text = os.path.join(tmp, "scrollback")
+        with open(text, "w") as f:
+            f.write(scrollback(args.lines))
+
+        # Runs in the window, where termomix @ finds it through the
+        # environment. The last column of a reply is the lines waiting for
+        # the index
+        script = ["cat '%s'" % text,
+                  "until [ \"$('%s' @ search zzz | cut -f6)\" = 0 ]; do "
+                  "sleep 0.2; done" % termomix]
+        for name, extra, query in QUERIES:
+            for scan in ("", "--scan"):
+                for _ in range(args.runs):
+                    script.append("printf '%%s\\t%%s\\t' %s '%s' >> '%s/out'; "
+                            "'%s' @ search %s %s '%s' >> '%s/out'" % (name,
+                            scan or "index", tmp, termomix, " ".join(extra),
+                            scan, query, tmp))
+        with open(os.path.join(tmp, "run.sh"), "w") as f:
+            f.write("\n".join(script) + "\n")
+
+        subprocess.run([termomix, "--standalone", "-c", str(COLUMNS), "-r",
+                str(ROWS), "-x", "sh %s/run.sh" % tmp], env=env, check=True,
+                stdout=subprocess.DEVNULL)
+
+        samples = {}
+        with open(os.path.join(tmp, "out")) as f:
+            for line in f:
+                name, mode, row, column, us, read, blocks, pending = \
+                        line.split("\t")
+                entry = samples.setdefault(name, {}).setdefault(mode,
+                        {"us": [], "read": [], "blocks": int(blocks),
+                         "found_line": int(row)})
+                entry["us"].append(int(us))
+                entry["read"].append(int(read))
+    finally:
+        shutil.rmtree(tmp)
+
+    results = {"lines": args.lines, "runs": args.runs, "queries": {}}
+    for name, modes in samples.items():
+        for mode, entry in modes.items():
+            results["queries"].setdefault(name, {})[mode] = {
+                "median_us": statistics.median(entry["us"]),
+                "blocks_read": statistics.median(entry["read"]),
+                "blocks": entry["blocks"],
+                "found_line": entry["found_line"],
+            }
+            print("bench: %-8s %-6s %10.0f us %7d of %d blocks" % (name, mode,
+                    statistics.median(entry["us"]),
+                    statistics.median(entry["read"]), entry["blocks"]),
+                    file=sys.stderr)
+
+    json.dump(results, sys.stdout, indent=2, sort_keys=True)
+    print()
+
+
+if __name__ == "__main__":
+    main()
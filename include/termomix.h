@@ -66,28 +66,359 @@ const GdkColor xterm_palette[PALETTE_SIZE] = {
         "-GtkDialog-button-spacing : 12;\n"\
         "}"
 
+/* Where a key traced by --latency-trace has been seen */
+enum latency_stage {
+    LATENCY_KEY,        /* termomix_key_press() */
+    LATENCY_WRITE,      /* Written to the PTY */
+    LATENCY_ECHO,       /* Read back from the PTY */
+    LATENCY_DRAW,       /* First frame drawn after it was fed to VTE */
+    LATENCY_STAGES
+};
+
+/* Where termomix_log_strip() is in an escape sequence */
+enum log_strip_state {
+    LOG_TEXT,
+    LOG_ESC,
+    LOG_CSI,
+    LOG_STRING,         /* OSC, DCS, APC or PM, up to BEL or ST */
+    LOG_STRING_ESC,
+    LOG_CHARSET
+};
+
+/* Session log of a terminal, shared by its PTY reader and writer threads */
+struct session_log {
+    gchar *path;
+    GByteArray *buffer;         /* Appended to by the PTY reader */
+    GMutex lock;
+    GCond cond;                 /* A batch to write, or room in buffer */
+    bool closing;
+    bool failed;                /* Couldn't open the file, drop everything */
+    bool strip;
+    bool compress;
+    bool replace;               /* Truncate the file instead of appending */
+    guint64 written;            /* Since the last rotation, uncompressed */
+    guint64 max_bytes;
+    guint rotate;
+    enum log_strip_state strip_state;
+};
+
+/* The PTY master of a terminal and the thread that reads it */
+struct pty_reader {
+    VtePty *pty;
+    int fd;
+    glong columns;              /* Last size given to the PTY */
+    glong rows;
+    guint resize_source;        /* Holds back further resizes */
+    gchar *ring;                /* PTY_RING_SIZE bytes */
+    volatile guint head;        /* Only moved by the reader thread */
+    volatile guint tail;        /* Only moved by the main thread */
+    volatile gint scheduled;    /* A feed is pending or VTE is parsing one */
+    volatile gint eof;
+    gint64 read_time;           /* Of the last read, lock */
+    guint64 read_bytes;         /* Only written by the reader thread */
+    volatile guint frame_interval; /* ms between frames in a flood, or 0 */
+    gint64 rate_start;          /* Output rate measure */
+    guint64 rate_bytes;
+    gsize parsing;              /* Bytes handed to VTE and not parsed yet */
+    gint64 fed_time;            /* When they were handed over */
+    guint64 drain_rate;         /* Bytes per second VTE parses, smoothed */
+    guint parse_source;         /* Gives up waiting for VTE */
+    GString *output;            /* Input the PTY had no room for yet */
+    guint output_watch;
+    GThread *thread;
+    GCancellable *cancel;
+    GMutex lock;                /* read_time, feed_source, and to sleep
+                                   while the ring is full */
+    GCond space;
+    guint feed_source;
+    guint child_watch;
+    struct session_log *log;
+    struct session_log *record; /* --record, asciicast lines */
+    gint64 record_start;
+    gchar record_partial[4];    /* UTF-8 character split between reads */
+    gsize record_partial_len;
+    bool bracketed_paste;       /* The program asked for it */
+    guint history_resets;       /* RIS or ED 3 went by, this many times */
+};
+
+#define PASTE_CHUNK 4096
+#define PASTE_PROGRESS_MIN 65536    /* Smaller pastes show no progress bar */
+#define PASTE_BEGIN "\033[200~"
+#define PASTE_END "\033[201~"
+
+/* Text of the rows of a terminal, for remote control. History rows don't
+ * change once they scroll off the screen, so each one is read from VTE once;
+ * the screen is read again only after contents_version moves */
+struct snapshot {
+    GPtrArray *rows;            /* History rows from first on */
+    glong first;
+    glong columns;              /* The rows were read at this width */
+    GPtrArray *screen;          /* Rows from screen_top on */
+    glong screen_top;
+    guint version;              /* contents_version of screen */
+    guint resets;               /* history_resets seen */
+};
+
+/* A clickable match in a row, found by match_regexp */
+struct row_match {
+    glong column;
+    glong end_column;           /* Last cell, inclusive */
+    bool last;                  /* Ends the text of the row */
+    const gchar *kind;          /* One of termomix.matchers */
+    gchar *text;
+};
+
+/* Matches of one row, kept until the text of the row changes. History rows
+ * don't change; a screen row is read and compared again only after
+ * contents_version moves */
+struct match_row {
+    gchar *text;
+    guint version;              /* contents_version it was checked at */
+    glong columns;              /* The row was read at this width */
+    guint resets;               /* history_resets seen */
+    bool wraps;                 /* The line goes on in the next row */
+    GArray *matches;            /* struct row_match */
+};
+
+/* A match of the scrollback search, from one cell to another */
+struct search_match {
+    glong row;
+    glong column;
+    glong end_row;              /* Last cell, inclusive */
+    glong end_column;
+};
+
+/* Scrollback search of a terminal. History rows don't change once they
+ * scroll off the screen, so they are indexed once: every SEARCH_BLOCK_ROWS
+ * rows are read from VTE on the main loop, and the indexer thread sets the
+ * bit of each of their trigrams in a bloom filter for the block. A query
+ * only reads back from VTE the blocks whose filter has the bits of every
+ * trigram of the text, and the rows not indexed yet */
+struct search {
+    gint refs;                  /* The terminal and the queued blocks */
+    GMutex lock;                /* blooms, first and generation */
+    GPtrArray *blooms;          /* SEARCH_BLOOM_BITS bits each */
+    glong first;                /* Row of the first block */
+    gint generation;            /* Blocks queued before a reset are dropped */
+    glong queued;               /* Rows handed to the indexer, main thread */
+    glong columns;              /* The rows were read at this width */
+    guint resets;               /* history_resets seen */
+    guint source;               /* Reads the next blocks */
+    GRegex *regex;              /* Of the entry, NULL if it has nothing */
+    GArray *bits;               /* Bloom bits of its trigrams */
+    guint query;                /* Bumped on every change of regex */
+    struct search_match match;  /* The current one, if found */
+    bool found;
+    GArray *visible;            /* Matches on screen, for the highlight */
+    guint visible_query;
+    guint visible_version;      /* contents_version */
+    glong visible_top;
+};
+
+/* SEARCH_BLOCK_ROWS rows of text for the indexer thread */
+struct search_job {
+    struct search *search;
+    gint generation;
+    glong row;
+    gchar *text;
+};
+
+/* A scrollback export in progress */
+struct export {
+    struct session_log *log;
+    glong row;                  /* Next row to read */
+    glong end;                  /* Rows after this came after the export began */
+    bool ansi;
+    bool started;               /* last is valid */
+    bool waiting;               /* For the writer, on a timeout */
+    VteCharAttributes last;     /* Attributes of the last SGR written */
+    guint source;
+};
+
+/* A background image to decode at a size, for termomix_bg_decode() */
+struct bg_request {
+    gchar *file;
+    gint width;
+    gint height;
+    double saturation;
+    GdkPixbuf *pixbuf;          /* The result */
+    GError *error;
+};
+
+/* A font held by termomix_font_cache(), so going back to a size doesn't
+ * go through fontconfig again */
+struct font_entry {
+    PangoFont *font;
+    guint used;                 /* font_clock at the last use */
+};
+
+/* Glyphs for termomix_prewarm() to render with a font */
+struct prewarm_job {
+    PangoFontDescription *font;
+    gchar *text;
+    cairo_font_options_t *options;  /* The screen's, so cairo caches match */
+    double resolution;
+    gint generation;
+};
+
+/* A file of the background cache, for termomix_bg_prune_cache() */
+struct bg_cache_file {
+    gchar *path;
+    time_t mtime;
+};
+
+/* A paste on its way to the PTY */
+struct paste {
+    struct terminal *term;      /* NULL once stopped during a read */
+    GInputStream *in;
+    GCancellable *cancel;
+    gchar raw[PASTE_CHUNK];     /* As read from in */
+    gchar buf[PASTE_CHUNK+16];  /* To be written, with the bracket markers */
+    gsize len;
+    gsize pos;
+    guint64 done;
+    guint64 total;              /* 0 if unknown */
+    guint watch;                /* G_IO_OUT watch on the PTY */
+    bool reading;
+    bool bracketed;
+    bool opened;                /* Something was written */
+    bool eof;
+    bool last_cr;
+};
+
+struct replay_event {
+    gint64 time;                /* us since the start of the recording */
+    gchar *data;
+    gsize len;
+};
+
+/* An asciicast file played by --replay */
+struct replay {
+    GArray *events;
+    guint next;
+    glong columns;
+    glong rows;
+    gsize bytes;
+    bool fast;
+    guint replies;              /* Cursor positions VTE still has to send */
+    gint64 start;
+    guint source;
+};
+
+struct terminal {
+    GtkWidget *window;
+    GtkWidget *vbox;
+    GtkWidget *hbox;
+    GtkWidget *vte;
+    GtkWidget *search_bar;      /* NULL until the first search */
+    GtkWidget *search_entry;
+    GtkWidget *search_regex;
+    struct search *search;      /* NULL until the first search */
+    guint id;                   /* CONTROL_WINDOW_ENV */
+    guint contents_version;
+    struct snapshot *snapshot;  /* NULL until the first remote read */
+    GHashTable *match_rows;     /* Row -> struct match_row, NULL until the
+                                   first click that needs a match */
+    GPid pid;
+    struct pty_reader *reader;
+    gchar *record;              /* --record file, until the shell starts */
+    struct paste *paste;
+    struct export *export;
+    GtkWidget *paste_bar;       /* NULL until the first long paste */
+    GtkWidget *paste_progress;
+    struct replay *replay;
+    gint64 last_motion;         /* Hover throttling */
+    GdkEvent *pending_motion;
+    guint motion_source;
+    bool replaying_motion;
+    guint bg_width;             /* Size of the background image it shows */
+    guint bg_height;
+    guint bg_source;            /* Rescale after a resize settles */
+    GtkBorder *border;
+    glong columns;
+    glong rows;
+    guint width;
+    guint height;
+    bool resized;
+    bool hold;
+    GSocketConnection *client;  /* Daemon client waiting for the first map */
+    gchar *pool_cwd;            /* Where its shell started, while pooled */
+};
+
+struct latency_sample {
+    struct terminal *term;
+    gint64 at[LATENCY_STAGES];
+};
+
+#define METRICS_BUCKETS 8
+
+struct histogram {
+    const double *bounds;       /* METRICS_BUCKETS upper bounds, ascending */
+    guint64 counts[METRICS_BUCKETS+1];  /* Not cumulative, the last is +Inf */
+    double sum;
+};
+
+/* Counters for the metrics socket. Every one is written by a single thread,
+ * with plain stores, and read as it is by termomix_metrics_text() */
+struct metrics {
+    guint64 pty_read_closed;    /* Read by the PTYs already closed */
+    guint64 pty_written;
+    guint64 config_writes;      /* By the config_writer thread */
+    gint64 key_time;            /* Of the key press VTE is handling, or 0 */
+    struct histogram feed_batch;
+    struct histogram frame_time;
+    struct histogram key_latency;
+};
+
 static struct {
-    GtkWidget *main_window;
     GtkWidget *menu;
     GtkWidget *im_menu;
-    struct terminal* term;
+    struct terminal* term;      /* Terminal that received the last event */
+    struct terminal* im_term;   /* Terminal the IM menu items belong to */
+    GList *terminals;
+    GList *pool;                /* Hidden terminals with a shell already running */
+    guint pool_size;
+    guint64 scrollback_bytes;
+    guint64 scrollback_total_bytes;
+    guint pool_source;
+    gchar *pool_cwd;            /* Where pooled shells are started */
+    bool frame_pacing;
+    guint flood_rate;           /* Bytes per second */
+    gint flood_fps;             /* 0 follows the display */
+    char *log_file;             /* Session log path, empty for none */
+    bool log_strip_ansi;
+    bool log_compress;
+    guint64 log_max_bytes;
+    guint log_rotate;
+    GMutex log_lock;
+    GCond log_idle;
+    guint log_writers;          /* Writer threads still running */
     PangoFontDescription *font;
+    gint font_size_pending;     /* Ctrl+/- size for termomix_font_apply(), 0 for none */
+    guint font_source;
+    GHashTable *fonts;          /* Description string -> struct font_entry */
+    guint font_clock;
     GdkColor forecolor;
     GdkColor backcolor;
     const GdkColor *palette;
     bool has_rgba;
     char *current_match;
-    guint width;
-    guint height;
-    glong columns;
-    glong rows;
+    const gchar *current_match_kind;
     gint char_width;
     gint char_height;
     guint opacity_level;
     VteTerminalCursorShape cursor_type;
     bool config_modified;
+    GHashTable *config_dirty;   /* Keys set since the last save */
+    char *config_saved;         /* Config file contents as last read or written */
+    guint save_source;          /* Pending write-behind save */
+    GThreadPool *config_writer;
+    GMutex config_lock;
+    gchar *config_written;      /* Last renamed over the file, config_lock */
     bool externally_modified;
-    bool resized;
+    guint reload_source;        /* Pending debounced reload */
+    bool reload_running;
+    bool reload_pending;
     GtkWidget *item_clear_background;
     GtkWidget *item_copy_link;
     GtkWidget *item_open_link;
@@ -102,28 +433,97 @@ static struct {
     gint font_size_accelerator;
     gint copy_key;
     gint paste_key;
+    gint new_window_key;
+    gint search_key;
     gint scrollbar_key;
-    GRegex *http_regexp;
-    char *argv[3];
+    GRegex *match_regexp;
+    gchar **matchers;           /* Group names in match_regexp */
+    GThread *config_thread;     /* Startup work running in the background */
+    GThread *command_thread;
+    GThread *font_thread;
+    GThread *icon_thread;
+    GThreadPool *bg_decoder;
+    GHashTable *bg_variants;    /* BG_KEY(w, h) -> bg_file at that size, NULL while decoding */
+    char *bg_file;
+    double bg_saturation;
+    bool bg_cover;              /* Scale to the window, or let VTE tile it */
+    guint frames;               /* FRAME_STATS_ENV */
+    gint64 first_frame;
+    gint64 last_frame;
+    gint64 frame_start;
+    gint64 frame_longest;
+    gchar *prewarm_text;        /* prewarm_ranges, NULL for none */
+    GThreadPool *prewarmer;
+    GThreadPool *indexer;       /* Scrollback search blocks */
+    gint prewarm_generation;    /* Of the newest job, atomic */
+    GSocketService *daemon_service;
+    char *daemon_socket;
+    FILE *latency_log;          /* --latency-trace */
+    GQueue *latency;            /* Keys on their way to the screen */
+    GArray *latency_took[LATENCY_STAGES];
+    guint latency_lost;
+    struct metrics metrics;
+    GSocketService *metrics_service;    /* NULL unless metrics=true */
+    gchar *metrics_socket;
+    GSocketService *control_service;    /* NULL unless remote_control=true */
+    gchar *control_socket;
+    guint next_id;
 } termomix;
 
-struct terminal {
-    GtkWidget *hbox;
-    GtkWidget *vte;
-    GPid pid;
-    GtkBorder *border;
-};
-                
-
 #define ICON_FILE "terminal-tango.svg"
-#define SCROLL_LINES 16384
-#define HTTP_REGEXP "(ftp|http)s?://[-a-zA-Z0-9.?$%&/=_~#.,:;+]*"
+#define DEFAULT_SCROLLBACK_BYTES 10485760          /* Per terminal */
+#define DEFAULT_SCROLLBACK_TOTAL_BYTES 268435456   /* For all of them */
+#define SCROLLBACK_CELL_BYTES 8     /* Estimate per cell, plain ASCII */
+#define SCROLLBACK_MIN_LINES 1024
+#define MATCHERS_GROUP "matchers"
+#define DEFAULT_URL_MATCHER "(?i)(ftp|http)s?://[-a-zA-Z0-9.?$%&/=_~#.,:;+]*"
+#define DEFAULT_FILE_LINE_MATCHER "[-\\w./~]*\\w\\.\\w+:[0-9]+(:[0-9]+)?"
+/* At least one letter, plain numbers are no hashes */
+#define DEFAULT_GIT_HASH_MATCHER "\\b(?=[0-9]*[a-f])[0-9a-f]{7,40}\\b"
+#define OLD_GIT_HASH_MATCHER "\\b[0-9a-f]{7,40}\\b"
+#define DEFAULT_IP_MATCHER "\\b([0-9]{1,3}\\.){3}[0-9]{1,3}\\b"
+#define DEFAULT_TICKET_MATCHER "\\b[A-Z][A-Z0-9]+-[0-9]+\\b"
+#define HOVER_INTERVAL 50000        /* us */
+#define MATCH_CACHE_ROWS 256        /* Rows of matches kept per terminal */
+#define PTY_RING_SIZE (1<<20)       /* Must be a power of two */
+#define PTY_FEED_BATCH 65536
+#define PTY_FEED_MAX (PTY_RING_SIZE/4) /* Per frame when pacing */
+#define PTY_PARSE_WAIT 20           /* ms for VTE to show a parsed batch, */
+#define PTY_PARSE_MAX 100           /* plus twice its expected parse time */
+#define PTY_RESIZE_DELAY 40         /* ms between SIGWINCHes while resizing */
+#define EXPORT_SLICE 256            /* Rows read from VTE per idle call */
+#define SEARCH_BLOCK_ROWS 64
+#define SEARCH_SLICE_BLOCKS 16      /* Read from VTE per idle call */
+#define SEARCH_BLOOM_SHIFT 14
+#define SEARCH_BLOOM_BITS (1<<SEARCH_BLOOM_SHIFT)
+#define EXPORT_BACKLOG 4194304      /* Bytes the writer may fall behind */
+#define EXPORT_WAIT 20              /* ms */
+#define BG_RESIZE_DELAY 150         /* ms */
+#define BG_CACHE_FILES 64           /* Scaled backgrounds kept on disk */
+#define BG_KEY(w, h) GUINT_TO_POINTER((guint)(w) << 16 | (guint)(h))
+#define FRAME_STATS_ENV "TERMOMIX_FRAME_STATS"
+#define FLOOD_WINDOW 100000         /* us over which the output rate is measured */
+#define FLOOD_QUIET 50000           /* us without output that ends a flood */
+#define DEFAULT_FLOOD_RATE 1048576
+#define DEFAULT_FLOOD_FPS 0
+#define LOG_BATCH 262144
+#define LOG_BUFFER_MAX 16777216     /* The PTY reader waits beyond this */
+#define LOG_FLUSH_DELAY 1000000     /* us */
+#define DEFAULT_LOG_ROTATE 5
 #define DEFAULT_CONFIGFILE "termomix.conf"
 #define DEFAULT_COLUMNS 80
 #define DEFAULT_ROWS 24
 #define DEFAULT_FONT "Monospace 8"
 #define FONT_MINIMAL_SIZE (PANGO_SCALE*6)
+#define FONT_MAXIMAL_SIZE (PANGO_SCALE*200)  /* For set-font-size */
+#define FONT_CACHE_SIZE 8
+#define FONT_APPLY_PRIORITY (GDK_PRIORITY_REDRAW - 10)  /* Before the frame is drawn */
+#define FONT_STEP_INTERVAL 50       /* ms between Ctrl+/- sizes applied */
 #define DEFAULT_WORD_CHARS  "-A-Za-z0-9,./?%&#_~"
+/* Box drawing and blocks, CJK, kana, Hangul and emoji */
+#define DEFAULT_PREWARM_RANGES "2500-259F,3040-30FF,4E00-4FFF,AC00-ACFF,1F300-1F64F"
+#define PREWARM_MAX_CHARS 4096
+#define PREWARM_LINE 64             /* Characters per line of the layout */
 #define DEFAULT_PALETTE "xterm"
 #define FORWARD 1
 #define BACKWARDS 2
@@ -133,32 +533,105 @@ struct terminal {
 #define DEFAULT_FONT_SIZE_ACCELERATOR (GDK_CONTROL_MASK)
 #define DEFAULT_COPY_KEY  GDK_KEY_C
 #define DEFAULT_PASTE_KEY  GDK_KEY_V
+#define DEFAULT_NEW_WINDOW_KEY  GDK_KEY_N
+#define DEFAULT_SEARCH_KEY  GDK_KEY_F
 #define DEFAULT_SCROLLBAR_KEY  GDK_KEY_S
 #define ERROR_BUFFER_LENGTH 256
+#define DAEMON_SOCKET "daemon.sock"
+#define DAEMON_REQUEST_MAX 65536
+#define METRICS_SOCKET "metrics.sock"
+#define CONTROL_SOCKET_ENV "TERMOMIX_CONTROL"
+#define CONTROL_WINDOW_ENV "TERMOMIX_WINDOW"
+#define CONTROL_REQUEST_MAX 1048576
+#define DEFAULT_POOL_SIZE 2
+#define CONFIG_RELOAD_DELAY 200
+#define CONFIG_SAVE_DELAY 1000
+#define PROFILE_CHILD_ENV "TERMOMIX_PROFILE_CHILD"
+#define LATENCY_TIMEOUT 1000000     /* us, keys that never showed up */
+#define LATENCY_BUCKETS 12          /* Histogram up to 2^11 ms */
 const char cfg_group[] = "termomix";
 
+/* Startup phases traced by --profile-startup, in the order they happen */
+enum profile_phase {
+    PROFILE_LOCALE,
+    PROFILE_OPTIONS,
+    PROFILE_GTK_INIT,
+    PROFILE_CONFIG,
+    PROFILE_ICON,
+    PROFILE_POPUP,
+    PROFILE_VTE,
+    PROFILE_FONT,
+    PROFILE_FIRST_DRAW,
+    PROFILE_FORK,
+    PROFILE_FIRST_OUTPUT,
+    PROFILE_PHASES
+};
+
+static const char *profile_names[PROFILE_PHASES] = {
+    "locale",
+    "options",
+    "gtk_init",
+    "config",
+    "icon",
+    "popup",
+    "vte",
+    "font",
+    "first_draw",
+    "fork",
+    "first_output"
+};
+
+static gint64 profile_begin[PROFILE_PHASES];
+static gint64 profile_end[PROFILE_PHASES];
+
+/* Time spent reaching every stage, LATENCY_KEY is the total */
+static const char *latency_names[LATENCY_STAGES] = {
+    "total",
+    "key-write",
+    "write-echo",
+    "echo-draw"
+};
+
+/* Bucket bounds of the metrics histograms */
+static const double feed_batch_bounds[METRICS_BUCKETS] = {
+    256, 1024, 4096, 16384, 65536, 262144, 1048576, 4194304
+};
+static const double frame_time_bounds[METRICS_BUCKETS] = {
+    0.001, 0.002, 0.004, 0.008, 0.016, 0.033, 0.066, 0.1
+};
+static const double key_latency_bounds[METRICS_BUCKETS] = {
+    0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01
+};
+
 static GQuark term_data_id = 0;
 
 #define  termomix_set_config_integer(key, value) do {\
         g_key_file_set_integer(termomix.cfg, cfg_group, key, value);\
-        termomix.config_modified=TRUE;\
+        termomix_config_dirty(key);\
         } while(0);
             
 #define  termomix_set_config_string(key, value) do {\
         g_key_file_set_value(termomix.cfg, cfg_group, key, value);\
-        termomix.config_modified=TRUE;\
+        termomix_config_dirty(key);\
         } while(0);
                         
 #define  termomix_set_config_boolean(key, value) do {\
         g_key_file_set_boolean(termomix.cfg, cfg_group, key, value);\
-        termomix.config_modified=TRUE;\
+        termomix_config_dirty(key);\
         } while(0);
                                     
 
 /* Callbacks */
 static gboolean termomix_key_press (GtkWidget *, GdkEventKey *, gpointer);
+static gboolean termomix_motion_notify (GtkWidget *, GdkEventMotion *, gpointer);
+static gboolean termomix_motion_replay (gpointer);
+static gboolean termomix_map_event (GtkWidget *, GdkEvent *, void *);
 static void     termomix_increase_font (GtkWidget *, void *);
 static void     termomix_decrease_font (GtkWidget *, void *);
+static void     termomix_font_step(gint);
+static gboolean termomix_font_apply(gpointer);
+static void     termomix_font_cache(const PangoFontDescription *);
+static void     termomix_font_forget(gpointer);
 static void     termomix_child_exited (GtkWidget *, void *);
 static void     termomix_eof (GtkWidget *, void *);
 static gboolean termomix_delete_event (GtkWidget *, void *);
@@ -174,22 +647,186 @@ static gboolean termomix_resized_window(GtkWidget *, GdkEventConfigure *, void *
 static void     termomix_setname_entry_changed(GtkWidget *, void *);
 static void     termomix_copy(GtkWidget *, void *);
 static void     termomix_paste(GtkWidget *, void *);
-static void     termomix_conf_changed(GtkWidget *, void *);
+static void     termomix_paste_received(GtkClipboard *, const gchar *,
+        gpointer);
+static void     termomix_paste_file_dialog(GtkWidget *, void *);
+static void     termomix_init_paste_bar(struct terminal *);
+static void     termomix_paste_start(struct terminal *, GInputStream *,
+        guint64);
+static void     termomix_paste_read(struct paste *);
+static void     termomix_paste_read_done(GObject *, GAsyncResult *, gpointer);
+static gboolean termomix_paste_write(gint, GIOCondition, gpointer);
+static void     termomix_paste_cancel(GtkWidget *, void *);
+static void     termomix_paste_stop(struct terminal *);
+static void     termomix_paste_free(struct paste *);
+static void     termomix_export_dialog(GtkWidget *, void *);
+static void     termomix_export_start(struct terminal *, const gchar *, bool);
+static gboolean termomix_export_all(VteTerminal *, glong, glong, gpointer);
+static void     termomix_export_ansi(struct export *, GString *, const gchar *,
+        GArray *);
+static gboolean termomix_export_step(gpointer);
+static void     termomix_export_stop(struct terminal *);
+static void     termomix_new_window(GtkWidget *, void *);
+static void     termomix_search(GtkWidget *, void *);
+static struct search *termomix_search_new(struct terminal *);
+static void     termomix_search_unref(struct search *);
+static void     termomix_search_free(struct terminal *);
+static GRegex  *termomix_search_compile(const gchar *, bool, GArray **);
+static guint    termomix_search_hash(const guchar *);
+static bool     termomix_search_before(const struct search_match *,
+        const struct search_match *);
+static bool     termomix_search_find(struct terminal *, GRegex *, GArray *,
+        bool, const struct search_match *, struct search_match *, guint *);
+static GArray  *termomix_search_rows(struct terminal *, GRegex *, glong,
+        glong);
+static void     termomix_search_sync(struct terminal *);
+static glong    termomix_search_block_end(struct terminal *, glong, glong);
+static gboolean termomix_search_index_step(gpointer);
+static void     termomix_search_index_block(gpointer, gpointer);
+static void     termomix_search_contents_changed(VteTerminal *, gpointer);
+static gboolean termomix_search_draw(GtkWidget *, cairo_t *, void *);
+static void     termomix_conf_changed(GFileMonitor *, GFile *, GFile *,
+        GFileMonitorEvent, void *);
+static gboolean termomix_config_reload(gpointer);
+static gboolean termomix_config_reloaded(gpointer);
 
 /* Misc */
 static void     termomix_error(const char *, ...);
 
 /* Functions */
 static void     termomix_init();
+static void     termomix_prefetch_config();
+static void     termomix_prefetch_command();
 static void     termomix_init_popup();
+static void     termomix_init_matchers();
+static const gchar *termomix_match_kind(const gchar *);
+static struct match_row *termomix_match_row(struct terminal *, glong);
+static void     termomix_match_row_free(gpointer);
+static gchar   *termomix_match_at(struct terminal *, glong, glong, const gchar **);
+static gboolean termomix_init_idle(gpointer);
+static gboolean termomix_first_draw(GtkWidget *, cairo_t *, void *);
+static void     termomix_set_dialog_style(GtkWidget *);
 static void     termomix_destroy();
-static void     termomix_init_terminal();
+static bool     termomix_init_terminal(const gchar *);
+static struct terminal *termomix_create_terminal();
+static void     termomix_spawn_shell(struct terminal *, const gchar *, bool);
+static bool     termomix_spawn(struct terminal *, const gchar *, gchar **,
+        GSpawnFlags);
+static gboolean termomix_pty_feed(gpointer);
+static void     termomix_pty_add_feed(struct terminal *, guint);
+static void     termomix_pty_schedule_feed(struct terminal *, gint64);
+static guint    termomix_pty_frame_interval(struct terminal *);
+static void     termomix_pty_flood(struct terminal *, gsize);
+static struct session_log *termomix_log_open(const gchar *, GPid, bool);
+static void     termomix_log_append(struct session_log *, const gchar *, gsize);
+static gsize    termomix_log_pending(struct session_log *);
+static void     termomix_log_close(struct session_log *);
+static gsize    termomix_log_strip(struct session_log *, guint8 *, gsize);
+static GOutputStream *termomix_log_create(struct session_log *, GError **);
+static void     termomix_log_rotate(struct session_log *);
+static gpointer termomix_log_thread(gpointer);
+static void     termomix_log_done();
+static void     termomix_record_open(struct terminal *, const gchar *);
+static void     termomix_json_escape(GString *, const gchar *, gsize);
+static void     termomix_record_append(struct pty_reader *, const gchar *,
+        gsize);
+static gunichar termomix_json_hex4(const gchar *);
+static GString *termomix_json_string(const gchar **);
+static struct replay *termomix_replay_load(const gchar *);
+static void     termomix_replay_free(struct replay *);
+static gboolean termomix_replay_step(gpointer);
+static void     termomix_replay_reply(VteTerminal *, gchar *, guint, gpointer);
+static guint    termomix_replay_queries(const gchar *, gsize);
+static gboolean termomix_replay_finish(gpointer);
+static void     termomix_replay_start(struct terminal *, struct replay *);
+static void     termomix_replay_close(struct terminal *);
+static void     termomix_pty_write(struct terminal *, const gchar *, gsize);
+static gboolean termomix_pty_flush(gint, GIOCondition, gpointer);
+static void     termomix_pty_parsed(VteTerminal *, gpointer);
+static gboolean termomix_pty_parse_timeout(gpointer);
+static void     termomix_pty_next(struct terminal *);
+static void     termomix_pty_commit(VteTerminal *, gchar *, guint, gpointer);
+static void     termomix_pty_modes(struct pty_reader *, const gchar *, gsize);
+static void     termomix_pty_resize(GtkWidget *, GtkAllocation *, gpointer);
+static bool     termomix_pty_set_size(struct terminal *);
+static gboolean termomix_pty_resized(gpointer);
+static void     termomix_pty_close(struct terminal *);
+static void     termomix_pty_reap(GPid, gint, gpointer);
+static void     termomix_pool_schedule_refill();
+static struct terminal *termomix_pool_take(const gchar *);
+static void     termomix_destroy_terminal(struct terminal *);
+static void     termomix_set_colors();
 static void     termomix_set_font();
 static void     termomix_set_size(gint, gint);
+static void     termomix_set_scrollback();
 static void     termomix_set_bgimage();
+static void     termomix_bg_request(struct terminal *, gint, gint);
+static void     termomix_bg_decode(gpointer, gpointer);
+static gint     termomix_bg_compare_mtime(gconstpointer, gconstpointer);
+static void     termomix_bg_prune_cache(const gchar *);
+static gboolean termomix_bg_decoded(gpointer);
+static void     termomix_bg_forget(gpointer);
+static void     termomix_bg_resize(GtkWidget *, GtkAllocation *, void *);
+static gboolean termomix_bg_resized(gpointer);
+static gboolean termomix_frame_begin(GtkWidget *, cairo_t *, void *);
+static gboolean termomix_frame_draw(GtkWidget *, cairo_t *, void *);
+static void     termomix_frame_report();
+static gchar   *termomix_prewarm_text(const gchar *);
+static void     termomix_histogram_add(struct histogram *, double);
+static void     termomix_metrics_init();
+static void     termomix_metrics_start();
+static void     termomix_metrics_stop();
+static gboolean termomix_metrics_incoming(GSocketService *, GSocketConnection *,
+        GObject *, gpointer);
+static gchar   *termomix_metrics_text();
+static void     termomix_metrics_value(GString *, const gchar *, const gchar *,
+        const gchar *, double);
+static void     termomix_metrics_histogram(GString *, const gchar *,
+        const gchar *, const struct histogram *);
+static void     termomix_control_start();
+static void     termomix_control_stop();
+static gboolean termomix_control_incoming(GSocketService *, GSocketConnection *,
+        GObject *, gpointer);
+static gchar   *termomix_control_run(struct terminal *, const gchar *,
+        gchar **, GString *);
+static gchar   *termomix_control_search(struct terminal *, gchar **, GString *);
+static struct terminal *termomix_control_find(const gchar *);
+static int      termomix_control_client(int, char **);
+static void     termomix_snapshot_changed(VteTerminal *, gpointer);
+static gchar   *termomix_snapshot_row(VteTerminal *, glong);
+static gchar   *termomix_snapshot_text(struct terminal *, glong, glong);
+static void     termomix_snapshot_free(struct terminal *);
+static void     termomix_prewarm_start();
+static void     termomix_prewarm(gpointer, gpointer);
+static void     termomix_warm_fonts(const PangoFontDescription *, const gchar *,
+        const cairo_font_options_t *, double);
 static void     termomix_set_config_key(const gchar *, guint);
 static guint    termomix_get_config_key(const gchar *);
 static void     termomix_config_done();
+static void     termomix_config_schedule_save();
+static void     termomix_config_dirty(const gchar *);
+static void     termomix_config_merge(GKeyFile *);
+static bool     termomix_daemon_init();
+static bool     termomix_daemon_client(int, char **);
+static void     termomix_daemon_reply(struct terminal *, const gchar *);
+static gchar ** termomix_rewrite_args(int, char **, int *);
+static void     termomix_reset_options();
+static void     termomix_profile_begin(enum profile_phase);
+static void     termomix_profile_end(enum profile_phase);
+static gboolean termomix_profile_draw(GtkWidget *, cairo_t *, void *);
+static void     termomix_profile_contents_changed(GtkWidget *, void *);
+static int      termomix_profile_repeat(int, char **);
+static void     termomix_latency_init();
+static void     termomix_latency_key(struct terminal *);
+static void     termomix_latency_advance(struct terminal *,
+        enum latency_stage, gint64);
+static void     termomix_latency_write(struct terminal *);
+static void     termomix_latency_echo(struct terminal *, gint64);
+static gboolean termomix_latency_draw(GtkWidget *, cairo_t *, void *);
+static void     termomix_latency_forget(struct terminal *);
+static void     termomix_latency_report();
+static gboolean termomix_profile_option(const gchar *, const gchar *,
+        gpointer, GError **);
 
 static const char *option_font;
 static const char *option_execute;
@@ -202,6 +839,14 @@ static int option_rows, option_columns;
 static gboolean option_hold=FALSE;
 static const char *option_geometry;
 static char *option_config_file;
+static gboolean option_daemon=FALSE;
+static gboolean option_standalone=FALSE;
+static gint option_profile_startup=0;
+static gchar *option_latency_trace=NULL;
+static gchar *option_log=NULL;
+static gchar *option_record=NULL;
+static gchar *option_replay=NULL;
+static gboolean option_replay_fast=FALSE;
 
 static GOptionEntry entries[] = {
     { 
@@ -312,6 +957,78 @@ static GOptionEntry entries[] = {
         "Use alternate configuration file",
         NULL
     },
+    {
+        "daemon",
+        0,
+        0,
+        G_OPTION_ARG_NONE,
+        &option_daemon,
+        "Run as a daemon that opens windows for termomix clients",
+        NULL
+    },
+    {
+        "standalone",
+        0,
+        0,
+        G_OPTION_ARG_NONE,
+        &option_standalone,
+        "Don't hand the window over to a running termomix daemon",
+        NULL
+    },
+    {
+        "profile-startup",
+        0,
+        G_OPTION_FLAG_OPTIONAL_ARG,
+        G_OPTION_ARG_CALLBACK,
+        (gpointer)termomix_profile_option,
+        "Print startup phase timings, or their median and p95 over N runs",
+        "N"
+    },
+    {
+        "latency-trace",
+        0,
+        0,
+        G_OPTION_ARG_FILENAME,
+        &option_latency_trace,
+        "Log the keypress to screen latency of every key to FILE",
+        "FILE"
+    },
+    {
+        "log",
+        0,
+        0,
+        G_OPTION_ARG_FILENAME,
+        &option_log,
+        "Log the output of every terminal to PATH, %p is the shell pid",
+        "PATH"
+    },
+    {
+        "record",
+        0,
+        0,
+        G_OPTION_ARG_FILENAME,
+        &option_record,
+        "Record the session to an asciicast v2 FILE",
+        "FILE"
+    },
+    {
+        "replay",
+        0,
+        0,
+        G_OPTION_ARG_FILENAME,
+        &option_replay,
+        "Play an asciicast v2 FILE instead of running a shell",
+        "FILE"
+    },
+    {
+        "replay-fast",
+        0,
+        0,
+        G_OPTION_ARG_NONE,
+        &option_replay_fast,
+        "Replay as fast as possible, print the time taken and exit",
+        NULL
+    },
     {
         NULL
     }
@@ -26,12 +26,19 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/wait.h>
+#include <signal.h>
 #include <locale.h>
 #include <libintl.h>
 #include <glib.h>
 #include <glib/gstdio.h>
 #include <gtk/gtk.h>
+#include <gio/gunixsocketaddress.h>
+#include <glib-unix.h>
+#include <pango/pangocairo.h>
 #include <vte/vte.h>
 
 #include "../include/termomix.h"
@@ -41,6 +48,8 @@ static gboolean termomix_key_press(GtkWidget *widget, GdkEventKey *event,
         gpointer user_data) {
     if (event->type!=GDK_KEY_PRESS) return FALSE;
 
+    termomix.term = (struct terminal *)user_data;
+
     /* Check is Caps lock is enabled. If it is, change keyval to make
      * keybindings work with both lowercase and uppercase letters
      */
@@ -57,6 +66,12 @@ static gboolean termomix_key_press(GtkWidget *widget, GdkEventKey *event,
         } else if (event->keyval==termomix.paste_key) {
             termomix_paste(NULL, NULL);
             return TRUE;
+        } else if (event->keyval==termomix.new_window_key) {
+            termomix_new_window(NULL, NULL);
+            return TRUE;
+        } else if (event->keyval==termomix.search_key) {
+            termomix_search(NULL, NULL);
+            return TRUE;
         }
     }
 
@@ -71,6 +86,14 @@ static gboolean termomix_key_press(GtkWidget *widget, GdkEventKey *event,
             return TRUE;
         }
     }
+
+    if (termomix.latency_log && !event->is_modifier) {
+        termomix_latency_key(termomix.term);
+    }
+    /* termomix_pty_commit() ends it, if VTE turns the key into input */
+    if (termomix.metrics_service) {
+        termomix.metrics.key_time = g_get_monotonic_time();
+    }
     return FALSE;
 }
 
@@ -78,24 +101,32 @@ static gboolean termomix_key_press(GtkWidget *widget, GdkEventKey *event,
 static gboolean termomix_button_press(GtkWidget *widget,
         GdkEventButton *button_event, gpointer user_data) {
     glong column, row;
-    gint tag;
+    bool open_link;
 
     if (button_event->type != GDK_BUTTON_PRESS)
         return FALSE;
 
+    termomix.term = (struct terminal *)user_data;
+
+    /* Only opening a link and the popup menu need the match, plain selection
+     * clicks go straight to VTE */
+    open_link = button_event->button == 1 &&
+            ((button_event->state & termomix.open_url_accelerator) ==
+            termomix.open_url_accelerator);
+    if (!open_link && button_event->button != 3)
+        return FALSE;
 
     /* Get the column and row relative to pointer position */
     column = ((glong) (button_event->x) / vte_terminal_get_char_width(
             VTE_TERMINAL(termomix.term->vte)));
     row = ((glong) (button_event->y) / vte_terminal_get_char_height(
             VTE_TERMINAL(termomix.term->vte)));
-    termomix.current_match = vte_terminal_match_check(
-            VTE_TERMINAL(termomix.term->vte), column, row, &tag);
+    g_free(termomix.current_match);
+    termomix.current_match = termomix_match_at(termomix.term, column, row,
+            &termomix.current_match_kind);
 
     /* Left button: open the URL if any */
-    if (button_event->button == 1 &&
-            ((button_event->state & termomix.open_url_accelerator) ==
-            termomix.open_url_accelerator) && termomix.current_match) {
+    if (open_link && termomix.current_match) {
         termomix_open_url(NULL, NULL);
         return TRUE;
     }
@@ -103,11 +134,31 @@ static gboolean termomix_button_press(GtkWidget *widget,
     /* Right button: show the popup menu */
     if (button_event->button == 3) {
         GtkMenu *menu;
-        menu = GTK_MENU (widget);
+
+        termomix_init_popup();
+        menu = GTK_MENU (termomix.menu);
+
+        /* Input method items are bound to one VTE, rebuild them when the
+         * menu pops up on another terminal */
+        if (termomix.im_term != termomix.term) {
+            GList *items, *l;
+
+            items = gtk_container_get_children(GTK_CONTAINER(termomix.im_menu));
+            for (l = items; l != NULL; l = l->next) {
+                gtk_widget_destroy(GTK_WIDGET(l->data));
+            }
+            g_list_free(items);
+
+            vte_terminal_im_append_menuitems(VTE_TERMINAL(termomix.term->vte),
+                    GTK_MENU_SHELL(termomix.im_menu));
+            gtk_widget_show_all(termomix.im_menu);
+            termomix.im_term = termomix.term;
+        }
 
         if (termomix.current_match) {
-            /* Show the extra options in the menu */
-            gtk_widget_show(termomix.item_open_link);
+            /* Show the extra options in the menu. Only links can be opened */
+            gtk_widget_set_visible(termomix.item_open_link,
+                    g_strcmp0(termomix.current_match_kind, "url") == 0);
             gtk_widget_show(termomix.item_copy_link);
             gtk_widget_show(termomix.open_link_separator);
         } else {
@@ -126,110 +177,367 @@ static gboolean termomix_button_press(GtkWidget *widget,
 }
 
 
-static void termomix_increase_font(GtkWidget *widget, void *data) {
-    gint new_size;
+/* VTE looks for matches under the pointer on every motion event. Motion
+ * without buttons held is let through at most once per HOVER_INTERVAL, the
+ * last event of a burst is replayed when the interval is over */
+static gboolean termomix_motion_notify(GtkWidget *widget, GdkEventMotion *event,
+        gpointer user_data) {
+    struct terminal *term = (struct terminal *)user_data;
+    gint64 now;
+
+    /* Selections are never throttled */
+    if (event->state & (GDK_BUTTON1_MASK|GDK_BUTTON2_MASK|GDK_BUTTON3_MASK))
+        return FALSE;
+
+    now = g_get_monotonic_time();
+    if (term->replaying_motion || now - term->last_motion >= HOVER_INTERVAL) {
+        term->last_motion = now;
+        return FALSE;
+    }
+
+    if (term->pending_motion) {
+        gdk_event_free(term->pending_motion);
+    }
+    term->pending_motion = gdk_event_copy((GdkEvent *)event);
+    if (!term->motion_source) {
+        term->motion_source = g_timeout_add(HOVER_INTERVAL/1000,
+                termomix_motion_replay, term);
+    }
+    return TRUE;
+}
+
+
+static gboolean termomix_motion_replay(gpointer data) {
+    struct terminal *term = (struct terminal *)data;
+
+    term->motion_source = 0;
+    if (term->pending_motion) {
+        term->replaying_motion = true;
+        gtk_widget_event(term->vte, term->pending_motion);
+        term->replaying_motion = false;
+        gdk_event_free(term->pending_motion);
+        term->pending_motion = NULL;
+    }
+    return FALSE;
+}
 
+
+static void termomix_increase_font(GtkWidget *widget, void *data) {
     /* Increment font size one unit */
-    new_size = pango_font_description_get_size(termomix.font) + PANGO_SCALE;
+    termomix_font_step(PANGO_SCALE);
+}
+
+
+static void termomix_decrease_font(GtkWidget *widget, void *data) {
+    /* Decrement font size one unit */
+    termomix_font_step(-PANGO_SCALE);
+}
+
+
+/* Holding Ctrl+plus sends a key per autorepeat. The steps add up here and
+ * termomix_font_apply() sets the result at most once per FONT_STEP_INTERVAL
+ * while the key is held, so most of the sizes in between are never loaded */
+static void termomix_font_step(gint step) {
+    gint new_size = termomix.font_size_pending;
+
+    if (!new_size) {
+        new_size = pango_font_description_get_size(termomix.font);
+    }
+    new_size += step;
+
+    /* Set a minimal size */
+    if (new_size < FONT_MINIMAL_SIZE) {
+        return;
+    }
+
+    termomix.font_size_pending = new_size;
+    if (!termomix.font_source) {
+        termomix.font_source = g_timeout_add_full(FONT_APPLY_PRIORITY,
+                FONT_STEP_INTERVAL, termomix_font_apply, NULL, NULL);
+    }
+}
+
+
+static gboolean termomix_font_apply(gpointer data) {
+    gint new_size = termomix.font_size_pending;
+    gchar *name;
+
+    termomix.font_source = 0;
+    termomix.font_size_pending = 0;
+    if (new_size == pango_font_description_get_size(termomix.font)) {
+        return FALSE;
+    }
 
+    /* Keep the size we leave too, zooming tends to come back */
+    termomix_font_cache(termomix.font);
     pango_font_description_set_size(termomix.font, new_size);
     termomix_set_font();
-    termomix_set_size(termomix.columns, termomix.rows);
-    termomix_set_config_string("font",
-            pango_font_description_to_string(termomix.font));
+    name = pango_font_description_to_string(termomix.font);
+    termomix_set_config_string("font", name);
+    g_free(name);
+
+    return FALSE;
 }
 
 
-static void termomix_decrease_font(GtkWidget *widget, void *data) {
-    gint new_size;
+/* Keep the last FONT_CACHE_SIZE fonts loaded. VTE drops its own copy of a
+ * font some time after it stops using it, and loading it again means a
+ * fontconfig match; with the font alive here Pango answers from its cache */
+static void termomix_font_cache(const PangoFontDescription *font) {
+    struct font_entry *entry, *oldest = NULL;
+    GHashTableIter iter;
+    gpointer key, value, oldest_key = NULL;
+    PangoContext *context;
+    gchar *name;
 
-    /* Decrement font size one unit */
-    new_size=pango_font_description_get_size(termomix.font)-PANGO_SCALE;
-    
-    /* Set a minimal size */
-    if (new_size >= FONT_MINIMAL_SIZE ) {
-        pango_font_description_set_size(termomix.font, new_size);
-        termomix_set_font();
-        termomix_set_size(termomix.columns, termomix.rows);    
-        termomix_set_config_string("font", pango_font_description_to_string(termomix.font));
+    if (!termomix.terminals) {
+        return;
+    }
+    if (!termomix.fonts) {
+        termomix.fonts = g_hash_table_new_full(g_str_hash, g_str_equal,
+                g_free, termomix_font_forget);
+    }
+
+    name = pango_font_description_to_string(font);
+    entry = g_hash_table_lookup(termomix.fonts, name);
+    if (entry) {
+        entry->used = ++termomix.font_clock;
+        g_free(name);
+        return;
+    }
+
+    if (g_hash_table_size(termomix.fonts) >= FONT_CACHE_SIZE) {
+        g_hash_table_iter_init(&iter, termomix.fonts);
+        while (g_hash_table_iter_next(&iter, &key, &value)) {
+            if (!oldest || ((struct font_entry *)value)->used < oldest->used) {
+                oldest = value;
+                oldest_key = key;
+            }
+        }
+        g_hash_table_remove(termomix.fonts, oldest_key);
+    }
+
+    /* The context of a terminal, so it's the font map VTE loads from */
+    context = gtk_widget_get_pango_context(
+            ((struct terminal *)termomix.terminals->data)->vte);
+    entry = g_new0(struct font_entry, 1);
+    entry->font = pango_context_load_font(context, font);
+    entry->used = ++termomix.font_clock;
+    g_hash_table_insert(termomix.fonts, name, entry);
+}
+
+
+/* termomix.fonts value destroy function */
+static void termomix_font_forget(gpointer data) {
+    struct font_entry *entry = (struct font_entry *)data;
+
+    if (entry->font) {
+        g_object_unref(entry->font);
     }
+    g_free(entry);
 }
 
 
 static void termomix_child_exited(GtkWidget *widget, void *data) {
+    struct terminal *term = (struct terminal *)data;
     gint status;
 
-    termomix_config_done();
-
-    if (option_hold==TRUE) {
+    if (term->hold) {
         return;
     }
 
-    waitpid(termomix.term->pid, &status, WNOHANG);
-    termomix_destroy();
+    waitpid(term->pid, &status, WNOHANG);
+    termomix_destroy_terminal(term);
 }
 
 
 static void termomix_eof(GtkWidget *widget, void *data) {
+    struct terminal *term = (struct terminal *)data;
     gint status;
 
-    termomix_config_done();
+    if (term->hold) {
+        return;
+    }
+
+    waitpid(term->pid, &status, WNOHANG);
+
+    termomix_destroy_terminal(term);
+}
 
-    if (option_hold==TRUE) {
+/* Write a serialized config to a temporary file and rename it over the real
+ * one, so a crash never leaves a truncated config behind. Runs on the config
+ * writer thread */
+static void termomix_config_write(gpointer data, gpointer user_data) {
+    gchar *cfgdata = (gchar *)data;
+    gchar *tmpfile;
+    gsize len, written = 0;
+    ssize_t n;
+    int fd;
+
+    tmpfile = g_strdup_printf("%s.XXXXXX", termomix.configfile);
+    fd = g_mkstemp_full(tmpfile, O_WRONLY, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot save %s: %s\n", termomix.configfile,
+                g_strerror(errno));
+        g_free(tmpfile);
+        g_free(cfgdata);
         return;
     }
 
-    waitpid(termomix.term->pid, &status, WNOHANG);
+    len = strlen(cfgdata);
+    while (written < len) {
+        n = write(fd, cfgdata+written, len-written);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        written += n;
+    }
+
+    if (written < len || fsync(fd) != 0) {
+        fprintf(stderr, "Cannot save %s: %s\n", termomix.configfile,
+                g_strerror(errno));
+        close(fd);
+        g_unlink(tmpfile);
+    } else if (close(fd) != 0 || g_rename(tmpfile, termomix.configfile) != 0) {
+        fprintf(stderr, "Cannot save %s: %s\n", termomix.configfile,
+                g_strerror(errno));
+        g_unlink(tmpfile);
+    } else {
+        termomix.metrics.config_writes++;
+        /* The file monitor sees this write too, the reload must skip it */
+        g_mutex_lock(&termomix.config_lock);
+        g_free(termomix.config_written);
+        termomix.config_written = cfgdata;
+        cfgdata = NULL;
+        g_mutex_unlock(&termomix.config_lock);
+    }
 
-    termomix_destroy();
+    g_free(tmpfile);
+    g_free(cfgdata);
 }
 
-/* Save configuration */
-static void termomix_config_done() {
-    GError *gerror = NULL;
-    gsize len = 0;
 
-    gchar *cfgdata = g_key_file_to_data(termomix.cfg, &len, &gerror);
-    if (!cfgdata) {
-        fprintf(stderr, "%s\n", gerror->message);
-        exit(EXIT_FAILURE);
+/* Hand the configuration to the writer thread, unless it's what we wrote
+ * (or read) last time */
+static gboolean termomix_config_save(gpointer data) {
+    gchar *cfgdata;
+
+    termomix.save_source = 0;
+
+    if (!termomix.config_modified)
+        return FALSE;
+    termomix.config_modified=false;
+    g_hash_table_remove_all(termomix.config_dirty);
+
+    cfgdata = g_key_file_to_data(termomix.cfg, NULL, NULL);
+    if (g_strcmp0(cfgdata, termomix.config_saved) == 0) {
+        g_free(cfgdata);
+        return FALSE;
     }
-    /* Write to file IF there's been changes */
-    if (termomix.config_modified) {
+    g_free(termomix.config_saved);
+    termomix.config_saved = g_strdup(cfgdata);
 
-        GIOChannel *cfgfile = g_io_channel_new_file(termomix.configfile, "w",
-                &gerror);
-        
-        if (!cfgfile) {
-            fprintf(stderr, "%s\n", gerror->message);
-            exit(EXIT_FAILURE);
-        }
+    /* A single thread, so writes land in order */
+    if (!termomix.config_writer) {
+        termomix.config_writer = g_thread_pool_new(termomix_config_write,
+                NULL, 1, FALSE, NULL);
+    }
+    g_thread_pool_push(termomix.config_writer, cfgdata, NULL);
 
-        /* FIXME: if the number of chars written is not "len", something
-         * happened. Check for errors appropriately...
-         */
-        GIOStatus status = g_io_channel_write_chars(cfgfile, cfgdata, len,
-                NULL, &gerror);
-        
-        if (status != G_IO_STATUS_NORMAL) {
-            // FIXME: we should deal with temporary failures (G_IO_STATUS_AGAIN)
-            fprintf(stderr, "%s\n", gerror->message);
-            exit(EXIT_FAILURE);
-        }
-        g_io_channel_shutdown(cfgfile, TRUE, &gerror);
-        g_io_channel_unref(cfgfile);
+    return FALSE;
+}
+
+
+/* Called by the termomix_set_config_* macros. Changes are written at most
+ * once per CONFIG_SAVE_DELAY */
+static void termomix_config_schedule_save() {
+    if (!termomix.save_source) {
+        termomix.save_source = g_timeout_add(CONFIG_SAVE_DELAY,
+                termomix_config_save, NULL);
+    }
+}
+
+
+/* Called by the termomix_set_config_* macros. A reload keeps the value of
+ * key until it is saved */
+static void termomix_config_dirty(const gchar *key) {
+    g_hash_table_add(termomix.config_dirty, g_strdup(key));
+    termomix.config_modified=TRUE;
+    termomix_config_schedule_save();
+}
+
+
+/* Save configuration, and wait for it to hit the disk. Only for shutdown */
+static void termomix_config_done() {
+    if (termomix.save_source) {
+        g_source_remove(termomix.save_source);
+        termomix.save_source = 0;
+    }
+    termomix_config_save(NULL);
+
+    if (termomix.config_writer) {
+        g_thread_pool_free(termomix.config_writer, FALSE, TRUE);
+        termomix.config_writer = NULL;
     }
 }
 
 
 static gboolean termomix_delete_event (GtkWidget *widget, void *data) {
-    termomix_config_done();
     return FALSE;
 }
 
 
 static void termomix_destroy_window (GtkWidget *widget, void *data) {
-    termomix_destroy();
+    struct terminal *term = (struct terminal *)data;
+
+    termomix_daemon_reply(term, "error: window destroyed before it was shown");
+
+    termomix.terminals = g_list_remove(termomix.terminals, term);
+    termomix.pool = g_list_remove(termomix.pool, term);
+    g_free(term->pool_cwd);
+    if (term->motion_source) {
+        g_source_remove(term->motion_source);
+    }
+    if (term->pending_motion) {
+        gdk_event_free(term->pending_motion);
+    }
+    termomix_paste_stop(term);
+    termomix_export_stop(term);
+    termomix_pty_close(term);
+    termomix_latency_forget(term);
+    termomix_replay_close(term);
+    g_free(term->record);
+    termomix_snapshot_free(term);
+    termomix_search_free(term);
+    if (term->match_rows) {
+        g_hash_table_destroy(term->match_rows);
+    }
+    if (term->bg_source) {
+        g_source_remove(term->bg_source);
+    }
+    if (termomix.im_term == term) {
+        termomix.im_term = NULL;
+    }
+    if (termomix.term == term) {
+        termomix.term = termomix.terminals ? termomix.terminals->data : NULL;
+    }
+    g_free(term);
+
+    termomix_set_scrollback();
+
+    /* The daemon outlives its windows, a standalone termomix doesn't */
+    if (!termomix.terminals && !termomix.daemon_service) {
+        termomix_destroy();
+    }
+}
+
+
+static gboolean termomix_map_event (GtkWidget *widget, GdkEvent *event,
+        void *data) {
+    termomix_daemon_reply((struct terminal *)data, "ok");
+    return FALSE;
 }
 
 
@@ -238,7 +546,7 @@ static void termomix_font_dialog (GtkWidget *widget, void *data) {
     gint response;
 
     font_dialog=gtk_font_chooser_dialog_new(gettext("Select font"),
-            GTK_WINDOW(termomix.main_window));
+            GTK_WINDOW(termomix.term->window));
     gtk_font_chooser_set_font_desc(GTK_FONT_CHOOSER(font_dialog), termomix.font);
 
     response=gtk_dialog_run(GTK_DIALOG(font_dialog));
@@ -247,7 +555,6 @@ static void termomix_font_dialog (GtkWidget *widget, void *data) {
         pango_font_description_free(termomix.font);
         termomix.font=gtk_font_chooser_get_font_desc(GTK_FONT_CHOOSER(font_dialog));
         termomix_set_font();
-        termomix_set_size(termomix.columns, termomix.rows);
         termomix_set_config_string("font",
                 pango_font_description_to_string(termomix.font));
     }
@@ -265,19 +572,13 @@ static void termomix_color_dialog (GtkWidget *widget, void *data) {
     guint16 backalpha;
 
     color_dialog=gtk_dialog_new_with_buttons(gettext("Select color"),
-            GTK_WINDOW(termomix.main_window), GTK_DIALOG_MODAL, GTK_STOCK_CANCEL,
+            GTK_WINDOW(termomix.term->window), GTK_DIALOG_MODAL, GTK_STOCK_CANCEL,
             GTK_RESPONSE_REJECT, GTK_STOCK_APPLY, GTK_RESPONSE_ACCEPT, NULL);
 
     gtk_dialog_set_default_response(GTK_DIALOG(color_dialog), GTK_RESPONSE_ACCEPT);
     gtk_window_set_modal(GTK_WINDOW(color_dialog), TRUE);
     /* Set style */
-    gchar *css = g_strdup_printf (HIG_DIALOG_CSS);
-    gtk_css_provider_load_from_data(termomix.provider, css, -1, NULL);
-    GtkStyleContext *context = gtk_widget_get_style_context (color_dialog);
-    gtk_style_context_add_provider (context, 
-            GTK_STYLE_PROVIDER(termomix.provider),
-            GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);
-    g_free(css);
+    termomix_set_dialog_style(color_dialog);
 
     hbox_fore=gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 12);
     hbox_back=gtk_box_new(FALSE, 12);
@@ -317,12 +618,8 @@ static void termomix_color_dialog (GtkWidget *widget, void *data) {
         if (termomix.has_rgba) {
             backalpha = gtk_color_button_get_alpha(GTK_COLOR_BUTTON(buttonback));
         }
-
-        if (termomix.has_rgba) {
-            vte_terminal_set_opacity(VTE_TERMINAL (termomix.term->vte), backalpha);
-        }
-        vte_terminal_set_colors(VTE_TERMINAL(termomix.term->vte), &termomix.forecolor,
-                &termomix.backcolor, termomix.palette, PALETTE_SIZE);
+        termomix.opacity_level= roundf((backalpha*99)/65535);     /* Opacity value is between 0 and 99 */
+        termomix_set_colors();
 
         gchar *cfgtmp;
         cfgtmp = g_strdup_printf("#%02x%02x%02x", termomix.forecolor.red >>8,
@@ -335,7 +632,6 @@ static void termomix_color_dialog (GtkWidget *widget, void *data) {
         termomix_set_config_string("backcolor", cfgtmp);
         g_free(cfgtmp);
 
-        termomix.opacity_level= roundf((backalpha*99)/65535);     /* Opacity value is between 0 and 99 */
         termomix_set_config_integer("opacity_level", termomix.opacity_level);  
 
     }
@@ -349,22 +645,15 @@ static void termomix_opacity_dialog (GtkWidget *widget, void *data) {
     GtkAdjustment *spinner_adj;
     GtkWidget *dialog_hbox, *dialog_vbox, *dialog_spin_hbox;
     gint response;
-    guint16 backalpha;
 
     opacity_dialog=gtk_dialog_new_with_buttons(gettext("Opacity"),
-            GTK_WINDOW(termomix.main_window), GTK_DIALOG_MODAL, GTK_STOCK_CANCEL,
+            GTK_WINDOW(termomix.term->window), GTK_DIALOG_MODAL, GTK_STOCK_CANCEL,
             GTK_RESPONSE_REJECT, GTK_STOCK_APPLY, GTK_RESPONSE_ACCEPT, NULL);
     gtk_dialog_set_default_response(GTK_DIALOG(opacity_dialog), GTK_RESPONSE_ACCEPT);
     gtk_window_set_modal(GTK_WINDOW(opacity_dialog), TRUE);
 
     /* Set style */
-    gchar *css = g_strdup_printf (HIG_DIALOG_CSS);
-    gtk_css_provider_load_from_data(termomix.provider, css, -1, NULL);
-    GtkStyleContext *context = gtk_widget_get_style_context (opacity_dialog);
-    gtk_style_context_add_provider (context,
-            GTK_STYLE_PROVIDER(termomix.provider),
-            GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);
-    g_free(css);
+    termomix_set_dialog_style(opacity_dialog);
 
     spinner_adj = gtk_adjustment_new ((termomix.opacity_level), 0.0, 99.0, 1.0, 5.0, 0);
     spin_control = gtk_spin_button_new(GTK_ADJUSTMENT(spinner_adj), 1.0, 0);
@@ -388,23 +677,7 @@ static void termomix_opacity_dialog (GtkWidget *widget, void *data) {
     if (response==GTK_RESPONSE_ACCEPT) {
 
         termomix.opacity_level = gtk_spin_button_get_value_as_int((GtkSpinButton *) spin_control);
-        
-        /* Map opacity level to alpha */
-        backalpha = (termomix.opacity_level*65535)/100;
-
-        /* Set transparency for all tabs */
-        GdkColor white={0, 255, 255, 255};
-        if (termomix.has_rgba) {
-            /* This is needed for set_opacity to have effect */
-            vte_terminal_set_color_background(VTE_TERMINAL (termomix.term->vte), &white);
-            vte_terminal_set_opacity(VTE_TERMINAL (termomix.term->vte), backalpha);
-            /* Reset colors again because we had set a white background.
-             * TODO: Check if it's still needed with set_colors_rgba
-             */
-             vte_terminal_set_colors(VTE_TERMINAL(termomix.term->vte),
-                    &termomix.forecolor, &termomix.backcolor, termomix.palette,
-                    PALETTE_SIZE);
-        }
+        termomix_set_colors();
 
         termomix_set_config_integer("opacity_level", termomix.opacity_level);
     }
@@ -420,7 +693,7 @@ static void termomix_set_title_dialog (GtkWidget *widget, void *data) {
     gint response;
 
     title_dialog=gtk_dialog_new_with_buttons(gettext("Set window title"),
-            GTK_WINDOW(termomix.main_window), GTK_DIALOG_MODAL,
+            GTK_WINDOW(termomix.term->window), GTK_DIALOG_MODAL,
             GTK_STOCK_CANCEL, GTK_RESPONSE_REJECT, GTK_STOCK_APPLY,
             GTK_RESPONSE_ACCEPT, NULL);
 
@@ -428,20 +701,14 @@ static void termomix_set_title_dialog (GtkWidget *widget, void *data) {
             GTK_RESPONSE_ACCEPT);
     gtk_window_set_modal(GTK_WINDOW(title_dialog), TRUE);
     /* Set style */
-    gchar *css = g_strdup_printf (HIG_DIALOG_CSS);
-    gtk_css_provider_load_from_data(termomix.provider, css, -1, NULL);
-    GtkStyleContext *context = gtk_widget_get_style_context (title_dialog);
-    gtk_style_context_add_provider (context,
-            GTK_STYLE_PROVIDER(termomix.provider),
-            GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);
-    g_free(css);
+    termomix_set_dialog_style(title_dialog);
 
     entry=gtk_entry_new();
     label=gtk_label_new(gettext("New window title"));
     title_hbox=gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
     /* Set window label as entry default text */
     gtk_entry_set_text(GTK_ENTRY(entry),
-            gtk_window_get_title(GTK_WINDOW(termomix.main_window)));
+            gtk_window_get_title(GTK_WINDOW(termomix.term->window)));
     gtk_entry_set_activates_default(GTK_ENTRY(entry), TRUE);
     gtk_box_pack_start(GTK_BOX(title_hbox), label, TRUE, TRUE, 12);
     gtk_box_pack_start(GTK_BOX(title_hbox), entry, TRUE, TRUE, 12);
@@ -458,7 +725,7 @@ static void termomix_set_title_dialog (GtkWidget *widget, void *data) {
     response=gtk_dialog_run(GTK_DIALOG(title_dialog));
     if (response==GTK_RESPONSE_ACCEPT) {
         /* Bug #257391 shadow reachs here too... */
-        gtk_window_set_title(GTK_WINDOW(termomix.main_window),
+        gtk_window_set_title(GTK_WINDOW(termomix.term->window),
                 gtk_entry_get_text(GTK_ENTRY(entry)));
     }
     gtk_widget_destroy(title_dialog);
@@ -467,20 +734,28 @@ static void termomix_set_title_dialog (GtkWidget *widget, void *data) {
 
 
 static void termomix_select_background_dialog(GtkWidget *widget, void *data) {
+    struct terminal *current = termomix.term;
     GtkWidget *dialog;
     gint response;
     gchar *filename;
+    GList *l;
 
     dialog = gtk_file_chooser_dialog_new (gettext("Select a background file"),
-            GTK_WINDOW(termomix.main_window), GTK_FILE_CHOOSER_ACTION_OPEN,
+            GTK_WINDOW(termomix.term->window), GTK_FILE_CHOOSER_ACTION_OPEN,
             GTK_STOCK_CANCEL, GTK_RESPONSE_CANCEL, GTK_STOCK_OPEN,
             GTK_RESPONSE_ACCEPT, NULL);
 
     response=gtk_dialog_run(GTK_DIALOG(dialog));
     if (response == GTK_RESPONSE_ACCEPT) {
         filename = gtk_file_chooser_get_filename (GTK_FILE_CHOOSER (dialog));
+        g_free(termomix.background);
         termomix.background=g_strdup(filename);
-        termomix_set_bgimage(termomix.background);
+        termomix_set_config_string("background", termomix.background);
+        for (l = termomix.terminals; l != NULL; l = l->next) {
+            termomix.term = (struct terminal *)l->data;
+            termomix_set_bgimage(termomix.background);
+        }
+        termomix.term = current;
         gtk_widget_show(termomix.item_clear_background);
         g_free(filename);
     }
@@ -505,6 +780,10 @@ static void termomix_open_url(GtkWidget *widget, void *data) {
     gchar *cmd;
     gchar *browser=NULL;
 
+    /* A git hash or an IP address is no business of the browser */
+    if (g_strcmp0(termomix.current_match_kind, "url") != 0)
+        return;
+
     browser=(gchar *)g_getenv("BROWSER");
 
     if (browser) {
@@ -526,20 +805,26 @@ static void termomix_open_url(GtkWidget *widget, void *data) {
 
 
 static void termomix_clear(GtkWidget *widget, void *data) {
+    GList *l;
+
     gtk_widget_hide(termomix.item_clear_background);
 
-    vte_terminal_set_background_image(VTE_TERMINAL(termomix.term->vte), NULL);
+    for (l = termomix.terminals; l != NULL; l = l->next) {
+        struct terminal *term = (struct terminal *)l->data;
+        vte_terminal_set_background_image(VTE_TERMINAL(term->vte), NULL);
+    }
 
     termomix_set_config_string("background", "none");
 
     g_free(termomix.background);
     termomix.background=NULL;
+    g_hash_table_remove_all(termomix.bg_variants);
 }
 
 
 static void termomix_set_cursor(GtkWidget *widget, void *data) {
-
     char *cursor_string = (char *)data;
+    GList *l;
 
     if (gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget))) {
 
@@ -551,16 +836,21 @@ static void termomix_set_cursor(GtkWidget *widget, void *data) {
             termomix.cursor_type=VTE_CURSOR_SHAPE_IBEAM;
         } 
 
-        vte_terminal_set_cursor_shape(VTE_TERMINAL(termomix.term->vte),
-                termomix.cursor_type);
+        for (l = termomix.terminals; l != NULL; l = l->next) {
+            struct terminal *term = (struct terminal *)l->data;
+            vte_terminal_set_cursor_shape(VTE_TERMINAL(term->vte),
+                    termomix.cursor_type);
+        }
         termomix_set_config_integer("cursor_type", termomix.cursor_type);
     }
 }
 
 static gboolean termomix_resized_window (GtkWidget *widget,
         GdkEventConfigure *event, void *data) {
-    if (event->width!=termomix.width || event->height!=termomix.height) {
-        termomix.resized=TRUE;
+    struct terminal *term = (struct terminal *)data;
+
+    if (event->width!=term->width || event->height!=term->height) {
+        term->resized=TRUE;
     }
         
     return FALSE;
@@ -586,346 +876,2214 @@ static void termomix_copy (GtkWidget *widget, void *data) {
 
 
 /* Parameters are never used */
+/* Pastes are streamed to the PTY a chunk at a time, whenever it can take
+ * more, so a big one neither freezes the window nor floods a slow reader on
+ * the other side. The clipboard text and "Paste file..." are both read from a
+ * GInputStream */
 static void termomix_paste (GtkWidget *widget, void *data) {
-    vte_terminal_paste_clipboard(VTE_TERMINAL(termomix.term->vte));
+    gtk_clipboard_request_text(gtk_clipboard_get(GDK_SELECTION_CLIPBOARD),
+            termomix_paste_received, termomix.term);
 }
 
 
-/* Callback called when termomix configuration file is modified by an external process */
-static void termomix_conf_changed (GtkWidget *widget, void *data) {
-    termomix.externally_modified=true;
-}
-
-/******* Functions ********/
+static void termomix_paste_received(GtkClipboard *clipboard, const gchar *text,
+        gpointer data) {
+    struct terminal *term = (struct terminal *)data;
+    gsize len;
 
-static void termomix_init() {
-    GError *gerror=NULL;
-    char* configdir = NULL;
+    /* The window may have been closed meanwhile */
+    if (!text || !g_list_find(termomix.terminals, term))
+        return;
 
-    term_data_id = g_quark_from_static_string("termomix_term");
+    len = strlen(text);
+    termomix_paste_start(term, g_memory_input_stream_new_from_data(
+            g_strndup(text, len), len, g_free), len);
+}
 
-    g_setenv("TERM", "xterm", FALSE);
 
-    /* Config file initialization*/
-    termomix.cfg = g_key_file_new();
-    termomix.config_modified=false;
+static void termomix_paste_file_dialog(GtkWidget *widget, void *data) {
+    struct terminal *term = termomix.term;
+    GtkWidget *dialog;
+    GFileInputStream *in;
+    GFileInfo *info;
+    GError *gerror=NULL;
+    GFile *file;
 
-    configdir = g_build_filename( g_get_user_config_dir(), "termomix", NULL );
-    if( ! g_file_test( g_get_user_config_dir(), G_FILE_TEST_EXISTS) )
-        g_mkdir( g_get_user_config_dir(), 0755 );
-    if( ! g_file_test( configdir, G_FILE_TEST_EXISTS) )
-        g_mkdir( configdir, 0755 );
-    if (option_config_file) {
-        termomix.configfile=g_build_filename(configdir, option_config_file, NULL);
-    } else {
-        /* Use more standard-conforming path for config files, if available. */
-        termomix.configfile=g_build_filename(configdir, DEFAULT_CONFIGFILE, NULL);
-    }
-    g_free(configdir);
+    dialog = gtk_file_chooser_dialog_new(gettext("Select a file to paste"),
+            GTK_WINDOW(term->window), GTK_FILE_CHOOSER_ACTION_OPEN,
+            GTK_STOCK_CANCEL, GTK_RESPONSE_CANCEL, GTK_STOCK_PASTE,
+            GTK_RESPONSE_ACCEPT, NULL);
 
-    /* Open config file */
-    if (!g_key_file_load_from_file(termomix.cfg, termomix.configfile, 0, &gerror)) {
-        /* If there's no file, ignore the error. A new one is created */
-        if (gerror->code==G_KEY_FILE_ERROR_UNKNOWN_ENCODING ||
-                gerror->code==G_KEY_FILE_ERROR_INVALID_VALUE) {
-            fprintf(stderr, "Not valid config file format\n");
-            exit(EXIT_FAILURE);
+    if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
+        file = gtk_file_chooser_get_file(GTK_FILE_CHOOSER(dialog));
+        in = g_file_read(file, NULL, &gerror);
+        if (in) {
+            info = g_file_input_stream_query_info(in,
+                    G_FILE_ATTRIBUTE_STANDARD_SIZE, NULL, NULL);
+            termomix_paste_start(term, G_INPUT_STREAM(in),
+                    info ? g_file_info_get_size(info) : 0);
+            if (info)
+                g_object_unref(info);
+        } else {
+            termomix_error("Cannot paste file: %s", gerror->message);
+            g_error_free(gerror);
         }
+        g_object_unref(file);
     }
-    
-    /* Add GFile monitor to control file external changes */
-    GFile *cfgfile = g_file_new_for_path(termomix.configfile);
-    GFileMonitor *mon_cfgfile = g_file_monitor_file (cfgfile, 0, NULL, NULL);
-    g_signal_connect(G_OBJECT(mon_cfgfile), "changed",
-            G_CALLBACK(termomix_conf_changed), NULL);
-    
-    gchar *cfgtmp = NULL;
 
-    /* We can safely ignore errors from g_key_file_get_value(), since if the
-     * call to g_key_file_has_key() was successful, the key IS there. From the
-     * glib docs I don't know if we can ignore errors from g_key_file_has_key,
-     * too. I think we can: the only possible error is that the config file
-     * doesn't exist, but we have just read it!
-     */
+    gtk_widget_destroy(dialog);
+}
 
-    /* TODO: Use RGBA colors, with rgba_parse when gtk-3.4 deprecates some
-     * functions using GdkColor. Maybe we can convert all termomix to GdkRGBA
-     * colors
-     */
-    if (!g_key_file_has_key(termomix.cfg, cfg_group, "forecolor", NULL)) {
-        termomix_set_config_string("forecolor", "#c0c0c0");
-    }
-    cfgtmp = g_key_file_get_value(termomix.cfg, cfg_group, "forecolor", NULL);
-    gdk_color_parse(cfgtmp, &termomix.forecolor);
-    g_free(cfgtmp);
 
+static void termomix_init_paste_bar(struct terminal *term) {
+    GtkWidget *cancel;
 
-    if (!g_key_file_has_key(termomix.cfg, cfg_group, "backcolor", NULL)) {
-        termomix_set_config_string("backcolor", "#000000");
-    }
-    cfgtmp = g_key_file_get_value(termomix.cfg, cfg_group, "backcolor", NULL);
-    gdk_color_parse(cfgtmp, &termomix.backcolor);
-    g_free(cfgtmp);
+    term->paste_bar=gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 6);
+    term->paste_progress=gtk_progress_bar_new();
+    cancel=gtk_button_new_from_stock(GTK_STOCK_CANCEL);
 
+    gtk_progress_bar_set_show_text(GTK_PROGRESS_BAR(term->paste_progress), TRUE);
+    gtk_box_pack_start(GTK_BOX(term->paste_bar), term->paste_progress, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(term->paste_bar), cancel, FALSE, FALSE, 0);
+    gtk_box_pack_end(GTK_BOX(term->vbox), term->paste_bar, FALSE, FALSE, 0);
 
-    if (!g_key_file_has_key(termomix.cfg, cfg_group, "opacity_level", NULL)) {
-        termomix_set_config_integer("opacity_level", 99);
-    }
-    termomix.opacity_level = g_key_file_get_integer(termomix.cfg, cfg_group, "opacity_level", NULL);
+    g_signal_connect(G_OBJECT(cancel), "clicked",
+            G_CALLBACK(termomix_paste_cancel), term);
+}
 
 
-    if (!g_key_file_has_key(termomix.cfg, cfg_group, "background", NULL)) {
-        termomix_set_config_string("background", "none");
+/* Paste in (total bytes long, 0 if unknown) to term. Takes in */
+static void termomix_paste_start(struct terminal *term, GInputStream *in,
+        guint64 total) {
+    struct paste *paste;
+
+    if (!term->reader) {
+        g_object_unref(in);
+        return;
     }
-    cfgtmp = g_key_file_get_value(termomix.cfg, cfg_group, "background", NULL);
-    if (strcmp(cfgtmp, "none")==0) {
-        termomix.background=NULL;
-    } else {
-        termomix.background=g_strdup(cfgtmp);
+    termomix_paste_stop(term);
+
+    paste = g_new0(struct paste, 1);
+    paste->term = term;
+    paste->in = in;
+    paste->cancel = g_cancellable_new();
+    paste->total = total;
+    paste->bracketed = term->reader->bracketed_paste;
+    term->paste = paste;
+
+    if (!total || total > PASTE_PROGRESS_MIN) {
+        if (!term->paste_bar) {
+            termomix_init_paste_bar(term);
+        }
+        gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(term->paste_progress), 0);
+        gtk_progress_bar_set_text(GTK_PROGRESS_BAR(term->paste_progress),
+                gettext("Pasting..."));
+        gtk_widget_show_all(term->paste_bar);
     }
-    g_free(cfgtmp);
 
+    termomix_paste_read(paste);
+}
 
-    if (!g_key_file_has_key(termomix.cfg, cfg_group, "font", NULL)) {
-        termomix_set_config_string("font", DEFAULT_FONT);
-    }
-    cfgtmp = g_key_file_get_value(termomix.cfg, cfg_group, "font", NULL);
-    termomix.font = pango_font_description_from_string(cfgtmp);
-    free(cfgtmp);
 
-    if (!g_key_file_has_key(termomix.cfg, cfg_group, "cursor_type", NULL)) {
-        termomix_set_config_string("cursor_type", "VTE_CURSOR_SHAPE_BLOCK");
+static void termomix_paste_read(struct paste *paste) {
+    paste->reading = true;
+    g_input_stream_read_async(paste->in, paste->raw, PASTE_CHUNK,
+            G_PRIORITY_DEFAULT, paste->cancel, termomix_paste_read_done, paste);
+}
+
+
+static void termomix_paste_read_done(GObject *source, GAsyncResult *result,
+        gpointer data) {
+    struct paste *paste = (struct paste *)data;
+    struct terminal *term = paste->term;
+    GError *gerror=NULL;
+    gssize n, i;
+
+    n = g_input_stream_read_finish(G_INPUT_STREAM(source), result, &gerror);
+    paste->reading = false;
+
+    /* Cancelled, termomix_paste_stop() left the paste for us to free */
+    if (!term) {
+        g_clear_error(&gerror);
+        termomix_paste_free(paste);
+        return;
+    }
+    if (n < 0) {
+        termomix_error("Cannot paste: %s", gerror->message);
+        g_error_free(gerror);
+        termomix_paste_stop(term);
+        return;
     }
-    termomix.cursor_type = g_key_file_get_integer(termomix.cfg, cfg_group,
-            "cursor_type", NULL);
 
-    if (!g_key_file_has_key(termomix.cfg, cfg_group, "word_chars", NULL)) {
-        termomix_set_config_string("word_chars", DEFAULT_WORD_CHARS);
+    paste->len = paste->pos = 0;
+    if (paste->bracketed && !paste->done && !paste->eof) {
+        memcpy(paste->buf, PASTE_BEGIN, strlen(PASTE_BEGIN));
+        paste->len = strlen(PASTE_BEGIN);
     }
-    termomix.word_chars = g_key_file_get_value(termomix.cfg, cfg_group,
-            "word_chars", NULL);
 
-    termomix.palette=xterm_palette;
-    
-    if (!g_key_file_has_key(termomix.cfg, cfg_group, "copy_accelerator", NULL)) {
-        termomix_set_config_integer("copy_accelerator", DEFAULT_COPY_ACCELERATOR);
+    /* Newlines are sent as carriage returns, like VTE pastes them. Inside
+     * the brackets ESC is dropped: a PASTE_END in the text would end the
+     * paste early and run the rest as typed, and dropping every ESC also
+     * covers a marker split between two reads, or one that removing an
+     * inner marker would put back together */
+    for (i=0; i<n; i++) {
+        gchar c = paste->raw[i];
+
+        if (c == '\033' && paste->bracketed) {
+            continue;
+        }
+        if (c == '\n' && paste->last_cr) {
+            paste->last_cr = false;
+            continue;
+        }
+        paste->last_cr = c == '\r';
+        paste->buf[paste->len++] = c == '\n' ? '\r' : c;
     }
-    termomix.copy_accelerator = g_key_file_get_integer(termomix.cfg, cfg_group,
-            "copy_accelerator", NULL);
 
-    if (!g_key_file_has_key(termomix.cfg, cfg_group, "open_url_accelerator", NULL)) {
-        termomix_set_config_integer("open_url_accelerator",
-                DEFAULT_OPEN_URL_ACCELERATOR);
+    if (n == 0) {
+        paste->eof = true;
+        if (paste->bracketed) {
+            memcpy(paste->buf + paste->len, PASTE_END, strlen(PASTE_END));
+            paste->len += strlen(PASTE_END);
+        }
     }
-    termomix.open_url_accelerator = g_key_file_get_integer(termomix.cfg, cfg_group,
-            "open_url_accelerator", NULL);
+    paste->done += n;
 
-    if (!g_key_file_has_key(termomix.cfg, cfg_group,
-            "font_size_accelerator", NULL)) {
-        termomix_set_config_integer("font_size_accelerator",
-                DEFAULT_FONT_SIZE_ACCELERATOR);
+    if (term->paste_bar && paste->total) {
+        gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(term->paste_progress),
+                MIN((double)paste->done/paste->total, 1.0));
     }
-    termomix.font_size_accelerator = g_key_file_get_integer(termomix.cfg,
-            cfg_group, "font_size_accelerator", NULL);
 
-    if (!g_key_file_has_key(termomix.cfg, cfg_group, "copy_key", NULL)) {
-        termomix_set_config_key( "copy_key", DEFAULT_COPY_KEY);
+    if (paste->len) {
+        paste->watch = g_unix_fd_add(term->reader->fd, G_IO_OUT,
+                termomix_paste_write, paste);
+    } else if (paste->eof) {
+        termomix_paste_stop(term);
+    } else {
+        termomix_paste_read(paste);
     }
-    termomix.copy_key = termomix_get_config_key("copy_key");
+}
 
-    if (!g_key_file_has_key(termomix.cfg, cfg_group, "paste_key", NULL)) {
-        termomix_set_config_key("paste_key", DEFAULT_PASTE_KEY);
+
+/* The PTY can take more */
+static gboolean termomix_paste_write(gint fd, GIOCondition condition,
+        gpointer data) {
+    struct paste *paste = (struct paste *)data;
+    ssize_t n;
+
+    n = write(fd, paste->buf + paste->pos, paste->len - paste->pos);
+    if (n < 0) {
+        if (errno == EINTR || errno == EAGAIN)
+            return TRUE;
+        paste->watch = 0;
+        termomix_paste_stop(paste->term);
+        return FALSE;
     }
-    termomix.paste_key = termomix_get_config_key("paste_key");
 
-    if (!g_key_file_has_key(termomix.cfg, cfg_group, "icon_file", NULL)) {
-        termomix_set_config_string("icon_file", ICON_FILE);
+    paste->pos += n;
+    paste->opened = true;
+    if (paste->pos < paste->len)
+        return TRUE;
+
+    paste->watch = 0;
+    if (paste->eof) {
+        termomix_paste_stop(paste->term);
+    } else {
+        termomix_paste_read(paste);
     }
-    /* We don't need a global because it's not configurable within termomix */
+    return FALSE;
+}
 
-    termomix.provider = gtk_css_provider_new();
 
-    termomix.main_window=gtk_window_new(GTK_WINDOW_TOPLEVEL);
-    gtk_window_set_title(GTK_WINDOW(termomix.main_window), "termomix");
-    gtk_window_set_has_resize_grip(GTK_WINDOW(termomix.main_window), false);
+static void termomix_paste_cancel(GtkWidget *widget, void *data) {
+    struct terminal *term = (struct terminal *)data;
 
-    /* Add datadir path to icon name */
-    char *icon = g_key_file_get_value(termomix.cfg, cfg_group, "icon_file", NULL);
-    char *icon_path = g_strdup_printf(DATADIR "/pixmaps/%s", icon);
-    gtk_window_set_icon_from_file(GTK_WINDOW(termomix.main_window), icon_path,
-            &gerror);
-    g_free(icon); g_free(icon_path); icon=NULL; icon_path=NULL;
+    termomix_paste_stop(term);
+    gtk_widget_grab_focus(term->vte);
+}
 
-    /* Default terminal size*/
-    termomix.columns = DEFAULT_COLUMNS;
-    termomix.rows = DEFAULT_ROWS;
 
-    /* Figure out if we have rgba capabilities. */
-    GdkScreen *screen = gtk_widget_get_screen (GTK_WIDGET (termomix.main_window));
-    GdkVisual *visual = gdk_screen_get_rgba_visual (screen);
-    if (visual != NULL && gdk_screen_is_composited (screen)) {
-        gtk_widget_set_visual (GTK_WIDGET (termomix.main_window), visual);
-        termomix.has_rgba = true;
+/* End the paste of term, whether it's done or not */
+static void termomix_paste_stop(struct terminal *term) {
+    struct paste *paste = term->paste;
+
+    if (!paste)
+        return;
+    term->paste = NULL;
+
+    if (paste->watch) {
+        g_source_remove(paste->watch);
+    }
+
+    /* Don't leave the program in the middle of a bracketed paste */
+    if (paste->bracketed && paste->opened &&
+            !(paste->eof && paste->pos == paste->len)) {
+        termomix_pty_write(term, PASTE_END, strlen(PASTE_END));
+    }
+
+    if (term->paste_bar) {
+        gtk_widget_hide(term->paste_bar);
+    }
+
+    if (paste->reading) {
+        g_cancellable_cancel(paste->cancel);
+        paste->term = NULL;
     } else {
-        /* Probably not needed, as is likely the default initializer */
-        termomix.has_rgba = false;
+        termomix_paste_free(paste);
     }
+}
 
-    /* Command line options initialization */
 
-    /* Set argv for forked childs. Real argv vector starts at argv[1] because we're
-       using G_SPAWN_FILE_AND_ARGV_ZERO to be able to launch login shells */
-    termomix.argv[0]=g_strdup(g_getenv("SHELL"));
-    if (option_login) {
-        termomix.argv[1]=g_strdup_printf("-%s", g_getenv("SHELL"));
+static void termomix_paste_free(struct paste *paste) {
+    g_object_unref(paste->in);
+    g_object_unref(paste->cancel);
+    g_free(paste);
+}
+
+
+/* Compile the text of a search, matched literally unless regex is set. bits
+ * gets the bloom bits of its trigrams, none for a regex. Returns NULL if
+ * there's nothing to search for */
+static GRegex *termomix_search_compile(const gchar *text, bool regex,
+        GArray **bits) {
+    GRegex *compiled;
+    gchar *pattern;
+    const guchar *p;
+    guint bit;
+
+    *bits = NULL;
+    if (!*text)
+        return NULL;
+
+    pattern = regex ? g_strdup(text) : g_regex_escape_string(text, -1);
+    compiled = g_regex_new(pattern, G_REGEX_CASELESS|G_REGEX_OPTIMIZE,
+            G_REGEX_MATCH_NOTEMPTY, NULL);
+    g_free(pattern);
+    if (!compiled || regex)
+        return compiled;
+
+    /* Matching is caseless, and only ASCII is folded in the filter */
+    *bits = g_array_new(FALSE, FALSE, sizeof(guint));
+    for (p = (const guchar *)text; p[0] && p[1] && p[2]; p++) {
+        if (p[0] < 0x80 && p[1] < 0x80 && p[2] < 0x80) {
+            bit = termomix_search_hash(p);
+            g_array_append_val(*bits, bit);
+        }
+    }
+    return compiled;
+}
+
+
+/* Bloom filter bit of the trigram at p */
+static guint termomix_search_hash(const guchar *p) {
+    guint32 trigram = g_ascii_tolower(p[0]) << 16 |
+            g_ascii_tolower(p[1]) << 8 | g_ascii_tolower(p[2]);
+
+    return (trigram * 2654435761u) >> (32 - SEARCH_BLOOM_SHIFT);
+}
+
+
+/* Compile the search entry contents. Returns false if there's nothing to
+ * search for */
+static bool termomix_search_update(struct terminal *term) {
+    struct search *search = term->search;
+    const gchar *text = gtk_entry_get_text(GTK_ENTRY(term->search_entry));
+
+    if (search->regex) {
+        g_regex_unref(search->regex);
+    }
+    if (search->bits) {
+        g_array_free(search->bits, TRUE);
+    }
+    search->regex = termomix_search_compile(text, gtk_toggle_button_get_active(
+            GTK_TOGGLE_BUTTON(term->search_regex)), &search->bits);
+    search->query++;
+    search->found = false;
+
+    /* A half typed regex doesn't compile, show it */
+    gtk_entry_set_icon_from_stock(GTK_ENTRY(term->search_entry),
+            GTK_ENTRY_ICON_SECONDARY,
+            (*text && !search->regex) ? GTK_STOCK_DIALOG_WARNING : NULL);
+    gtk_widget_queue_draw(term->vte);
+
+    return search->regex != NULL;
+}
+
+
+/* Go to the match before (backward) or after the current one, or to the
+ * newest one if there's none yet. Scrolls it into view */
+static void termomix_search_step(struct terminal *term, bool backward) {
+    struct search *search = term->search;
+    GtkAdjustment *adjustment;
+    struct search_match found;
+    glong rows;
+
+    if (!search->regex)
+        return;
+
+    if (!termomix_search_find(term, search->regex, search->bits,
+            backward || !search->found, search->found ? &search->match : NULL,
+            &found, NULL)) {
+        search->found = false;
+        gtk_widget_queue_draw(term->vte);
+        return;
+    }
+    search->match = found;
+    search->found = true;
+
+    adjustment = gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(term->vte));
+    rows = vte_terminal_get_row_count(VTE_TERMINAL(term->vte));
+    if (found.row < gtk_adjustment_get_value(adjustment) ||
+            found.end_row >= gtk_adjustment_get_value(adjustment) + rows) {
+        gtk_adjustment_set_value(adjustment, found.row - rows/2);
+    }
+    gtk_widget_queue_draw(term->vte);
+}
+
+
+/* Search towards older output */
+static void termomix_search_previous(GtkWidget *widget, void *data) {
+    termomix_search_step((struct terminal *)data, true);
+}
+
+
+static void termomix_search_next(GtkWidget *widget, void *data) {
+    termomix_search_step((struct terminal *)data, false);
+}
+
+
+/* Incremental search: look for the new text from the bottom of the buffer */
+static void termomix_search_changed(GtkWidget *widget, void *data) {
+    struct terminal *term = (struct terminal *)data;
+
+    if (termomix_search_update(term))
+        termomix_search_step(term, true);
+}
+
+
+/* Enter goes to older matches, Shift-Enter to newer ones, Escape is done */
+static gboolean termomix_search_key_press(GtkWidget *widget, GdkEventKey *event,
+        gpointer data) {
+    struct terminal *term = (struct terminal *)data;
+
+    if (event->keyval==GDK_KEY_Return || event->keyval==GDK_KEY_KP_Enter) {
+        if (event->state & GDK_SHIFT_MASK) {
+            termomix_search_next(NULL, term);
+        } else {
+            termomix_search_previous(NULL, term);
+        }
+        return TRUE;
+    } else if (event->keyval==GDK_KEY_Escape) {
+        gtk_widget_hide(term->search_bar);
+        gtk_widget_queue_draw(term->vte);
+        gtk_widget_grab_focus(term->vte);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+
+/* The search bar is built the first time it's needed */
+static void termomix_init_search_bar(struct terminal *term) {
+    GtkWidget *previous, *next;
+
+    term->search_bar=gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 6);
+    term->search_entry=gtk_entry_new();
+    term->search_regex=gtk_check_button_new_with_label(gettext("Regex"));
+    previous=gtk_button_new_from_stock(GTK_STOCK_GO_UP);
+    next=gtk_button_new_from_stock(GTK_STOCK_GO_DOWN);
+
+    gtk_box_pack_start(GTK_BOX(term->search_bar), term->search_entry, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(term->search_bar), term->search_regex, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(term->search_bar), previous, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(term->search_bar), next, FALSE, FALSE, 0);
+    gtk_box_pack_end(GTK_BOX(term->vbox), term->search_bar, FALSE, FALSE, 0);
+
+    g_signal_connect(G_OBJECT(term->search_entry), "changed",
+            G_CALLBACK(termomix_search_changed), term);
+    g_signal_connect(G_OBJECT(term->search_entry), "key-press-event",
+            G_CALLBACK(termomix_search_key_press), term);
+    g_signal_connect(G_OBJECT(term->search_regex), "toggled",
+            G_CALLBACK(termomix_search_changed), term);
+    g_signal_connect(G_OBJECT(previous), "clicked",
+            G_CALLBACK(termomix_search_previous), term);
+    g_signal_connect(G_OBJECT(next), "clicked",
+            G_CALLBACK(termomix_search_next), term);
+    g_signal_connect_after(G_OBJECT(term->vte), "draw",
+            G_CALLBACK(termomix_search_draw), term);
+
+    if (!term->search) {
+        term->search = termomix_search_new(term);
+    }
+}
+
+
+/* Show or hide the search bar of the current terminal */
+static void termomix_search(GtkWidget *widget, void *data) {
+    struct terminal *term = termomix.term;
+
+    if (!term->search_bar) {
+        termomix_init_search_bar(term);
+    }
+
+    if (gtk_widget_get_visible(term->search_bar)) {
+        gtk_widget_hide(term->search_bar);
+        gtk_widget_grab_focus(term->vte);
     } else {
-        termomix.argv[1]=g_strdup(g_getenv("SHELL"));
+        gtk_widget_show_all(term->search_bar);
+        gtk_widget_grab_focus(term->search_entry);
     }
-    termomix.argv[2]=NULL;
+    gtk_widget_queue_draw(term->vte);
+}
 
-    if (option_title) {
-        gtk_window_set_title(GTK_WINDOW(termomix.main_window), option_title);
+
+/* Highlight every match on screen, the current one stronger */
+static gboolean termomix_search_draw(GtkWidget *widget, cairo_t *cr,
+        void *data) {
+    struct terminal *term = (struct terminal *)data;
+    struct search *search = term->search;
+    GtkAdjustment *adjustment;
+    glong top, rows, columns, row, first, last;
+    gint char_width, char_height, left = 0, y_top = 0;
+    guint i;
+
+    if (!search || !search->regex || !gtk_widget_get_visible(term->search_bar))
+        return FALSE;
+
+    adjustment = gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(term->vte));
+    top = gtk_adjustment_get_value(adjustment);
+    rows = vte_terminal_get_row_count(VTE_TERMINAL(term->vte));
+    columns = vte_terminal_get_column_count(VTE_TERMINAL(term->vte));
+
+    /* Searched again only when the screen, the scroll or the text change */
+    if (!search->visible || search->visible_query != search->query ||
+            search->visible_version != term->contents_version ||
+            search->visible_top != top) {
+        if (search->visible) {
+            g_array_free(search->visible, TRUE);
+        }
+        search->visible = termomix_search_rows(term, search->regex, top,
+                top + rows);
+        search->visible_query = search->query;
+        search->visible_version = term->contents_version;
+        search->visible_top = top;
     }
 
-    if (option_columns) {
-        termomix.columns = option_columns;
+    char_width = vte_terminal_get_char_width(VTE_TERMINAL(term->vte));
+    char_height = vte_terminal_get_char_height(VTE_TERMINAL(term->vte));
+    if (term->border) {
+        left = term->border->left;
+        y_top = term->border->top;
     }
 
-    if (option_rows) {
-        termomix.rows = option_rows;
+    for (i = 0; i < search->visible->len; i++) {
+        struct search_match *m = &g_array_index(search->visible,
+                struct search_match, i);
+        bool current = search->found && m->row == search->match.row &&
+                m->column == search->match.column;
+
+        for (row = MAX(m->row, top); row <= m->end_row && row < top + rows;
+                row++) {
+            first = row == m->row ? m->column : 0;
+            last = row == m->end_row ? m->end_column : columns - 1;
+            cairo_rectangle(cr, left + first*char_width,
+                    y_top + (row - top)*char_height,
+                    (last - first + 1)*char_width, char_height);
+        }
+        if (current) {
+            cairo_set_source_rgba(cr, 1.0, 0.5, 0.0, 0.55);
+        } else {
+            cairo_set_source_rgba(cr, 1.0, 0.85, 0.0, 0.35);
+        }
+        cairo_fill(cr);
     }
 
-    if (option_font) {
-        termomix.font=pango_font_description_from_string(option_font);
-    } 
+    return FALSE;
+}
 
-    termomix.resized=FALSE;
-    termomix.externally_modified=false;
 
-    gerror=NULL;
-    termomix.http_regexp=g_regex_new(HTTP_REGEXP, G_REGEX_CASELESS,
-            G_REGEX_MATCH_NOTEMPTY, &gerror);
+static struct search *termomix_search_new(struct terminal *term) {
+    struct search *search = g_new0(struct search, 1);
 
-    termomix_init_popup();
+    search->refs = 1;
+    g_mutex_init(&search->lock);
+    search->blooms = g_ptr_array_new_with_free_func(g_free);
+    search->columns = -1;
 
-    g_signal_connect(G_OBJECT(termomix.main_window), "delete_event",
-            G_CALLBACK(termomix_delete_event), NULL);
-    g_signal_connect(G_OBJECT(termomix.main_window), "destroy",
-            G_CALLBACK(termomix_destroy_window), NULL);
-    g_signal_connect(G_OBJECT(termomix.main_window), "key-press-event",
-            G_CALLBACK(termomix_key_press), NULL);
-    g_signal_connect(G_OBJECT(termomix.main_window), "configure-event",
-            G_CALLBACK(termomix_resized_window), NULL);
+    g_signal_connect(G_OBJECT(term->vte), "contents-changed",
+            G_CALLBACK(termomix_search_contents_changed), term);
+    /* Index what's already in the scrollback */
+    term->search = search;
+    termomix_search_contents_changed(VTE_TERMINAL(term->vte), term);
+
+    return search;
 }
 
 
-static void termomix_init_popup() {
-    GtkWidget *item_copy, *item_paste, *item_select_font, *item_select_colors,
-            *item_select_background, *item_set_title, *item_options,
-            *item_input_methods, *item_opacity_menu, *item_cursor,
-            *item_cursor_block, *item_cursor_underline, *item_cursor_ibeam;
-    GtkAction *action_open_link, *action_copy_link, *action_copy,
-            *action_paste, *action_select_font, *action_select_colors,
-            *action_select_background, *action_clear_background,
-            *action_opacity, *action_set_title;
-    GtkWidget *options_menu, *cursor_menu;
+static void termomix_search_unref(struct search *search) {
+    if (!g_atomic_int_dec_and_test(&search->refs))
+        return;
 
-    /* Define actions */
-    action_open_link=gtk_action_new("open_link", gettext("Open link..."), NULL, NULL);
-    action_copy_link=gtk_action_new("copy_link", gettext("Copy link..."), NULL, NULL);
-    action_copy=gtk_action_new("copy", gettext("Copy"), NULL, GTK_STOCK_COPY);
-    action_paste=gtk_action_new("paste", gettext("Paste"), NULL, GTK_STOCK_PASTE);
-    action_select_font=gtk_action_new("select_font", gettext("Select font..."),
-            NULL, GTK_STOCK_SELECT_FONT);
-    action_select_colors=gtk_action_new("select_colors", gettext("Select colors..."),
-            NULL, GTK_STOCK_SELECT_COLOR);
-    action_select_background=gtk_action_new("select_background",
-            gettext("Select background..."), NULL, NULL);
-    action_clear_background=gtk_action_new("clear_background",
-            gettext("Clear background"), NULL, NULL);
-    action_opacity=gtk_action_new("set_opacity", gettext("Set opacity level..."),
-            NULL, NULL);
-    action_set_title=gtk_action_new("set_title", gettext("Set window title..."),
-            NULL, NULL);
+    g_ptr_array_free(search->blooms, TRUE);
+    g_mutex_clear(&search->lock);
+    g_free(search);
+}
 
-    /* Create menuitems */
-    termomix.item_open_link=gtk_action_create_menu_item(action_open_link);
-    termomix.item_copy_link=gtk_action_create_menu_item(action_copy_link);
-    item_copy=gtk_action_create_menu_item(action_copy);
-    item_paste=gtk_action_create_menu_item(action_paste);
-    item_select_font=gtk_action_create_menu_item(action_select_font);
-    item_select_colors=gtk_action_create_menu_item(action_select_colors);
-    item_select_background=gtk_action_create_menu_item(action_select_background);
-    termomix.item_clear_background=gtk_action_create_menu_item(action_clear_background);
-    item_opacity_menu=gtk_action_create_menu_item(action_opacity);
-    item_set_title=gtk_action_create_menu_item(action_set_title);
 
-    item_options=gtk_menu_item_new_with_label(gettext("Options"));
+static void termomix_search_free(struct terminal *term) {
+    struct search *search = term->search;
 
-    /* FIXME: Use actions for all items, or no use'em at all */
-    item_cursor = gtk_menu_item_new_with_label(gettext("Set cursor type"));
-    item_cursor_block = gtk_radio_menu_item_new_with_label(NULL, gettext("Block"));
-    item_cursor_underline = gtk_radio_menu_item_new_with_label_from_widget(
-            GTK_RADIO_MENU_ITEM(item_cursor_block), gettext("Underline"));
-    item_cursor_ibeam = gtk_radio_menu_item_new_with_label_from_widget(
-            GTK_RADIO_MENU_ITEM(item_cursor_block), gettext("IBeam"));
-    item_input_methods = gtk_menu_item_new_with_label(gettext("Input methods"));
+    if (!search)
+        return;
 
-    /* Show defaults in menu items */
-    switch (termomix.cursor_type){
-        case VTE_CURSOR_SHAPE_BLOCK:
-            gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_cursor_block), TRUE);
-            break;
-        case VTE_CURSOR_SHAPE_UNDERLINE:
-            gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_cursor_underline), TRUE);
-            break;
-        case VTE_CURSOR_SHAPE_IBEAM:
-            gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_cursor_ibeam), TRUE);
+    if (search->source) {
+        g_source_remove(search->source);
+    }
+    if (search->regex) {
+        g_regex_unref(search->regex);
     }
+    if (search->bits) {
+        g_array_free(search->bits, TRUE);
+    }
+    if (search->visible) {
+        g_array_free(search->visible, TRUE);
+    }
+    /* Blocks still queued keep the rest alive */
+    termomix_search_unref(search);
+    term->search = NULL;
+}
 
-    termomix.open_link_separator=gtk_separator_menu_item_new();
 
-    termomix.menu=gtk_menu_new();
+/* Start over on another width, a cleared history or when rows scrolled out
+ * of the history before being indexed, and drop the blocks that did */
+static void termomix_search_sync(struct terminal *term) {
+    struct search *search = term->search;
+    GtkAdjustment *adjustment;
+    glong lower, upper, top, columns;
+    guint resets = term->reader ? term->reader->history_resets : 0;
+
+    adjustment = gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(term->vte));
+    lower = gtk_adjustment_get_lower(adjustment);
+    upper = gtk_adjustment_get_upper(adjustment);
+    top = upper - vte_terminal_get_row_count(VTE_TERMINAL(term->vte));
+    columns = vte_terminal_get_column_count(VTE_TERMINAL(term->vte));
+
+    g_mutex_lock(&search->lock);
+    if (columns != search->columns || resets != search->resets ||
+            search->queued < lower || search->queued > MAX(top, lower) ||
+            search->first > lower) {
+        g_ptr_array_set_size(search->blooms, 0);
+        search->first = search->queued = lower;
+        search->columns = columns;
+        search->resets = resets;
+        search->generation++;
+    }
+    while (search->blooms->len && search->first + SEARCH_BLOCK_ROWS <= lower) {
+        g_ptr_array_remove_index(search->blooms, 0);
+        search->first += SEARCH_BLOCK_ROWS;
+    }
+    g_mutex_unlock(&search->lock);
+}
 
-    /* Add items to popup menu */
-    gtk_menu_shell_append(GTK_MENU_SHELL(termomix.menu), termomix.item_open_link);
-    gtk_menu_shell_append(GTK_MENU_SHELL(termomix.menu), termomix.item_copy_link);
-    gtk_menu_shell_append(GTK_MENU_SHELL(termomix.menu), termomix.open_link_separator);
-    gtk_menu_shell_append(GTK_MENU_SHELL(termomix.menu), item_copy);
-    gtk_menu_shell_append(GTK_MENU_SHELL(termomix.menu), item_paste);
-    gtk_menu_shell_append(GTK_MENU_SHELL(termomix.menu), termomix.item_clear_background);
-    gtk_menu_shell_append(GTK_MENU_SHELL(termomix.menu), gtk_separator_menu_item_new());
-    gtk_menu_shell_append(GTK_MENU_SHELL(termomix.menu), item_options);
 
-    termomix.im_menu=gtk_menu_new();
-    options_menu=gtk_menu_new();
-    cursor_menu=gtk_menu_new();
+/* New output, index the history rows it pushed off the screen */
+static void termomix_search_contents_changed(VteTerminal *vte, gpointer data) {
+    struct terminal *term = (struct terminal *)data;
 
-    gtk_menu_shell_append(GTK_MENU_SHELL(options_menu), item_opacity_menu);
-    gtk_menu_shell_append(GTK_MENU_SHELL(options_menu), item_set_title);
-    gtk_menu_shell_append(GTK_MENU_SHELL(options_menu), item_select_colors);
-    gtk_menu_shell_append(GTK_MENU_SHELL(options_menu), item_select_font);
-    gtk_menu_shell_append(GTK_MENU_SHELL(options_menu), item_select_background);
-    gtk_menu_shell_append(GTK_MENU_SHELL(options_menu), item_cursor);
-    gtk_menu_shell_append(GTK_MENU_SHELL(options_menu), item_input_methods);
-    
-    gtk_menu_shell_append(GTK_MENU_SHELL(cursor_menu), item_cursor_block);
-    gtk_menu_shell_append(GTK_MENU_SHELL(cursor_menu), item_cursor_underline);
-    gtk_menu_shell_append(GTK_MENU_SHELL(cursor_menu), item_cursor_ibeam);
+    if (term->search && !term->search->source) {
+        term->search->source = g_idle_add_full(G_PRIORITY_DEFAULT_IDLE,
+                termomix_search_index_step, term, NULL);
+    }
+}
 
-    gtk_menu_item_set_submenu(GTK_MENU_ITEM(item_input_methods), termomix.im_menu);
-    gtk_menu_item_set_submenu(GTK_MENU_ITEM(item_options), options_menu);
-    gtk_menu_item_set_submenu(GTK_MENU_ITEM(item_cursor), cursor_menu);
 
-    /* ... and finally assign callbacks to menuitems */
-    g_signal_connect(G_OBJECT(action_select_font), "activate",
-            G_CALLBACK(termomix_font_dialog), NULL);
-    g_signal_connect(G_OBJECT(action_select_background), "activate",
-            G_CALLBACK(termomix_select_background_dialog), NULL);
-    g_signal_connect(G_OBJECT(action_copy), "activate",
-            G_CALLBACK(termomix_copy), NULL);
-    g_signal_connect(G_OBJECT(action_paste), "activate",
+/* End of the block of rows from row: SEARCH_BLOCK_ROWS rows, then the rest
+ * of the line its last row wraps into, up to SEARCH_BLOCK_ROWS more rows and
+ * not past limit. A match that starts in the block is found in that text
+ * even if it ends in the next block */
+static glong termomix_search_block_end(struct terminal *term, glong row,
+        glong limit) {
+    VteTerminal *vte = VTE_TERMINAL(term->vte);
+    glong end = MIN(row + SEARCH_BLOCK_ROWS, limit);
+    gchar *text;
+    gsize length;
+    bool wraps = true;
+
+    while (wraps && end < MIN(row + 2*SEARCH_BLOCK_ROWS, limit)) {
+        text = termomix_snapshot_row(vte, end - 1);
+        length = strlen(text);
+        wraps = length && text[length-1] != '\n';
+        g_free(text);
+        if (wraps) {
+            end++;
+        }
+    }
+    return end;
+}
+
+
+/* Hand the next whole blocks of history rows to the indexer thread. VTE can
+ * only be read here, the hashing is done there. A block waits until the
+ * rows it may wrap into are history too */
+static gboolean termomix_search_index_step(gpointer data) {
+    struct terminal *term = (struct terminal *)data;
+    struct search *search = term->search;
+    VteTerminal *vte = VTE_TERMINAL(term->vte);
+    GtkAdjustment *adjustment;
+    struct search_job *job;
+    glong top;
+    guint i;
+
+    termomix_search_sync(term);
+    adjustment = gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(term->vte));
+    top = gtk_adjustment_get_upper(adjustment) -
+            vte_terminal_get_row_count(vte);
+
+    if (!termomix.indexer) {
+        termomix.indexer = g_thread_pool_new(termomix_search_index_block,
+                NULL, 1, FALSE, NULL);
+    }
+
+    for (i = 0; i < SEARCH_SLICE_BLOCKS &&
+            search->queued + 2*SEARCH_BLOCK_ROWS <= top; i++) {
+        job = g_new0(struct search_job, 1);
+        job->search = search;
+        g_atomic_int_inc(&search->refs);
+        job->generation = search->generation;
+        job->row = search->queued;
+        job->text = vte_terminal_get_text_range(vte, job->row, 0,
+                termomix_search_block_end(term, job->row, top) - 1,
+                search->columns - 1, termomix_export_all, NULL, NULL);
+        g_thread_pool_push(termomix.indexer, job, NULL);
+        search->queued += SEARCH_BLOCK_ROWS;
+    }
+
+    if (search->queued + 2*SEARCH_BLOCK_ROWS <= top)
+        return TRUE;
+
+    search->source = 0;
+    return FALSE;
+}
+
+
+/* Build the bloom filter of a block, on the indexer thread */
+static void termomix_search_index_block(gpointer data, gpointer user_data) {
+    struct search_job *job = (struct search_job *)data;
+    struct search *search = job->search;
+    guchar *bloom = g_malloc0(SEARCH_BLOOM_BITS/8);
+    const guchar *p;
+    guint bit;
+
+    /* Trigrams across row ends too, a match may wrap */
+    for (p = (const guchar *)job->text; p[0] && p[1] && p[2]; p++) {
+        bit = termomix_search_hash(p);
+        bloom[bit >> 3] |= 1 << (bit & 7);
+    }
+
+    g_mutex_lock(&search->lock);
+    if (job->generation == search->generation && job->row ==
+            search->first + (glong)search->blooms->len*SEARCH_BLOCK_ROWS) {
+        g_ptr_array_add(search->blooms, bloom);
+        bloom = NULL;
+    }
+    g_mutex_unlock(&search->lock);
+
+    g_free(bloom);
+    g_free(job->text);
+    termomix_search_unref(search);
+    g_free(job);
+}
+
+
+/* Matches of regex in the rows from start to end, in order */
+static GArray *termomix_search_rows(struct terminal *term, GRegex *regex,
+        glong start, glong end) {
+    VteTerminal *vte = VTE_TERMINAL(term->vte);
+    GArray *attributes, *matches;
+    GMatchInfo *info;
+    VteCharAttributes *first, *last;
+    struct search_match match;
+    gchar *text;
+    gint from, to;
+
+    matches = g_array_new(FALSE, FALSE, sizeof(struct search_match));
+    if (start >= end)
+        return matches;
+
+    /* One attribute per byte of text */
+    attributes = g_array_new(FALSE, FALSE, sizeof(VteCharAttributes));
+    text = vte_terminal_get_text_range(vte, start, 0, end - 1,
+            vte_terminal_get_column_count(vte) - 1, termomix_export_all, NULL,
+            attributes);
+
+    g_regex_match(regex, text, 0, &info);
+    while (g_match_info_matches(info)) {
+        g_match_info_fetch_pos(info, 0, &from, &to);
+        if (to > from && (guint)to <= attributes->len) {
+            first = &g_array_index(attributes, VteCharAttributes, from);
+            last = &g_array_index(attributes, VteCharAttributes, to - 1);
+            match.row = first->row;
+            match.column = first->column;
+            match.end_row = last->row;
+            match.end_column = last->column;
+            g_array_append_val(matches, match);
+        }
+        g_match_info_next(info, NULL);
+    }
+    g_match_info_free(info);
+
+    g_array_free(attributes, TRUE);
+    g_free(text);
+    return matches;
+}
+
+
+static bool termomix_search_before(const struct search_match *a,
+        const struct search_match *b) {
+    return a->row < b->row || (a->row == b->row && a->column < b->column);
+}
+
+
+/* Find the match of regex closest to from, before it if backward, wrapping
+ * around; the newest or the oldest one if from is NULL. Blocks whose bloom
+ * filter lacks one of bits are skipped, rows not indexed yet are always
+ * read. The filters are checked under the lock and VTE is read without it,
+ * so the indexer doesn't wait for the search. read counts the blocks read
+ * from VTE */
+static bool termomix_search_find(struct terminal *term, GRegex *regex,
+        GArray *bits, bool backward, const struct search_match *from,
+        struct search_match *found, guint *read) {
+    struct search *search = term->search;
+    GtkAdjustment *adjustment;
+    GArray *matches;
+    struct search_match *m;
+    const guchar *bloom;
+    glong lower, upper, first, count, start, block, k, i, j;
+    bool hit = false, bounded, *candidates;
+    guint b;
+
+    termomix_search_sync(term);
+    adjustment = gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(term->vte));
+    lower = gtk_adjustment_get_lower(adjustment);
+    upper = gtk_adjustment_get_upper(adjustment);
+
+    g_mutex_lock(&search->lock);
+    first = search->first;
+    count = (upper - first + SEARCH_BLOCK_ROWS - 1)/SEARCH_BLOCK_ROWS;
+    candidates = g_new(bool, MAX(count, 1));
+    for (k = 0; k < count; k++) {
+        candidates[k] = true;
+        if (bits && k < (glong)search->blooms->len) {
+            bloom = g_ptr_array_index(search->blooms, k);
+            for (b = 0; b < bits->len; b++) {
+                guint bit = g_array_index(bits, guint, b);
+                if (!(bloom[bit >> 3] & (1 << (bit & 7))))
+                    break;
+            }
+            candidates[k] = b == bits->len;
+        }
+    }
+    g_mutex_unlock(&search->lock);
+
+    start = from ? CLAMP((from->row - first)/SEARCH_BLOCK_ROWS, 0,
+            count - 1) : (backward ? count - 1 : 0);
+
+    /* The block of from comes twice: first only past from, last whole */
+    for (i = 0; i <= count && !hit && count > 0; i++) {
+        k = ((backward ? start - i : start + i) % count + count) % count;
+        bounded = from && i == 0;
+        if (!candidates[k])
+            continue;
+
+        if (read) {
+            (*read)++;
+        }
+        /* Read on into the next block, matches starting there are its own */
+        block = first + k*SEARCH_BLOCK_ROWS;
+        matches = termomix_search_rows(term, regex, MAX(block, lower),
+                termomix_search_block_end(term, block, upper));
+        for (j = 0; j < (glong)matches->len && !hit; j++) {
+            m = &g_array_index(matches, struct search_match,
+                    backward ? (glong)matches->len - 1 - j : j);
+            if (m->row >= block + SEARCH_BLOCK_ROWS)
+                continue;
+            if (!bounded || (backward ? termomix_search_before(m, from) :
+                        termomix_search_before(from, m))) {
+                *found = *m;
+                hit = true;
+            }
+        }
+        g_array_free(matches, TRUE);
+    }
+    g_free(candidates);
+
+    return hit;
+}
+
+
+/* Export the scrollback of the current terminal to a file */
+static void termomix_export_dialog(GtkWidget *widget, void *data) {
+    struct terminal *term = termomix.term;
+    GtkWidget *dialog, *ansi;
+    gchar *filename;
+
+    dialog = gtk_file_chooser_dialog_new(gettext("Export scrollback"),
+            GTK_WINDOW(term->window), GTK_FILE_CHOOSER_ACTION_SAVE,
+            GTK_STOCK_CANCEL, GTK_RESPONSE_CANCEL, GTK_STOCK_SAVE,
+            GTK_RESPONSE_ACCEPT, NULL);
+    gtk_file_chooser_set_do_overwrite_confirmation(GTK_FILE_CHOOSER(dialog),
+            TRUE);
+    gtk_file_chooser_set_current_name(GTK_FILE_CHOOSER(dialog),
+            "scrollback.txt");
+    ansi = gtk_check_button_new_with_label(gettext("Keep colors (ANSI)"));
+    gtk_file_chooser_set_extra_widget(GTK_FILE_CHOOSER(dialog), ansi);
+
+    if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
+        filename = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog));
+        termomix_export_start(term, filename,
+                gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(ansi)));
+        g_free(filename);
+    }
+
+    gtk_widget_destroy(dialog);
+}
+
+
+/* The rows are read from VTE in slices from an idle callback, so output and
+ * input keep flowing during a long export, and written by a session log
+ * writer thread. Rows that scroll out of the history meanwhile are lost */
+static void termomix_export_start(struct terminal *term, const gchar *file,
+        bool ansi) {
+    struct export *export;
+    GtkAdjustment *adjustment;
+
+    termomix_export_stop(term);
+
+    adjustment = gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(term->vte));
+    export = g_new0(struct export, 1);
+    export->log = termomix_log_open(file, term->pid, true);
+    export->row = gtk_adjustment_get_lower(adjustment);
+    export->end = gtk_adjustment_get_upper(adjustment);
+    export->ansi = ansi;
+    export->source = g_idle_add_full(G_PRIORITY_DEFAULT_IDLE,
+            termomix_export_step, term, NULL);
+    term->export = export;
+}
+
+
+static gboolean termomix_export_all(VteTerminal *vte, glong column, glong row,
+        gpointer data) {
+    return TRUE;
+}
+
+
+/* Append text to out with SGR sequences for the colors and attributes VTE
+ * gives for every byte */
+static void termomix_export_ansi(struct export *export, GString *out,
+        const gchar *text, GArray *attributes) {
+    VteCharAttributes *attr, *last = &export->last;
+    gsize i;
+
+    for (i=0; text[i]; i++) {
+        attr = i < attributes->len ?
+                &g_array_index(attributes, VteCharAttributes, i) : last;
+
+        if ((text[i] & 0xc0) != 0x80 && text[i] != '\n' &&
+                (!export->started ||
+                !gdk_color_equal(&attr->fore, &last->fore) ||
+                !gdk_color_equal(&attr->back, &last->back) ||
+                attr->underline != last->underline ||
+                attr->strikethrough != last->strikethrough)) {
+            g_string_append(out, "\033[0");
+            if (!gdk_color_equal(&attr->fore, &termomix.forecolor)) {
+                g_string_append_printf(out, ";38;2;%d;%d;%d",
+                        attr->fore.red >> 8, attr->fore.green >> 8,
+                        attr->fore.blue >> 8);
+            }
+            if (!gdk_color_equal(&attr->back, &termomix.backcolor)) {
+                g_string_append_printf(out, ";48;2;%d;%d;%d",
+                        attr->back.red >> 8, attr->back.green >> 8,
+                        attr->back.blue >> 8);
+            }
+            if (attr->underline)
+                g_string_append(out, ";4");
+            if (attr->strikethrough)
+                g_string_append(out, ";9");
+            g_string_append_c(out, 'm');
+            *last = *attr;
+            export->started = true;
+        }
+        g_string_append_c(out, text[i]);
+    }
+}
+
+
+static gboolean termomix_export_step(gpointer data) {
+    struct terminal *term = (struct terminal *)data;
+    struct export *export = term->export;
+    VteTerminal *vte = VTE_TERMINAL(term->vte);
+    GArray *attributes = NULL;
+    GString *out;
+    glong lower, end;
+    gchar *text;
+
+    /* Wait for a slow disk instead of buffering the whole history */
+    if (termomix_log_pending(export->log) > EXPORT_BACKLOG) {
+        if (!export->waiting) {
+            export->waiting = true;
+            export->source = g_timeout_add(EXPORT_WAIT, termomix_export_step,
+                    term);
+            return FALSE;
+        }
+        return TRUE;
+    }
+    if (export->waiting) {
+        export->waiting = false;
+        export->source = g_idle_add_full(G_PRIORITY_DEFAULT_IDLE,
+                termomix_export_step, term, NULL);
+        return FALSE;
+    }
+
+    lower = gtk_adjustment_get_lower(
+            gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(term->vte)));
+    export->row = MAX(export->row, lower);
+    end = MIN(export->row + EXPORT_SLICE, export->end);
+
+    if (export->row < end) {
+        if (export->ansi) {
+            attributes = g_array_new(FALSE, FALSE, sizeof(VteCharAttributes));
+        }
+        text = vte_terminal_get_text_range(vte, export->row, 0, end-1,
+                vte_terminal_get_column_count(vte)-1, termomix_export_all,
+                NULL, attributes);
+
+        if (attributes) {
+            out = g_string_sized_new(strlen(text)*2);
+            termomix_export_ansi(export, out, text, attributes);
+            g_array_free(attributes, TRUE);
+        } else {
+            out = g_string_new(text);
+        }
+        termomix_log_append(export->log, out->str, out->len);
+        g_string_free(out, TRUE);
+        g_free(text);
+        export->row = end;
+    }
+
+    if (export->row >= export->end) {
+        if (export->ansi) {
+            termomix_log_append(export->log, "\033[0m", 4);
+        }
+        export->source = 0;
+        termomix_export_stop(term);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+/* Finish the export of term, the writer thread flushes what's left */
+static void termomix_export_stop(struct terminal *term) {
+    struct export *export = term->export;
+
+    if (!export)
+        return;
+
+    if (export->source) {
+        g_source_remove(export->source);
+    }
+    termomix_log_close(export->log);
+    g_free(export);
+    term->export = NULL;
+}
+
+
+/* Open another window in this process, running a shell in the directory of
+ * the current one. i3 tiles it like any other window */
+static void termomix_new_window (GtkWidget *widget, void *data) {
+    gchar *proc_cwd, *cwd;
+
+    proc_cwd = g_strdup_printf("/proc/%d/cwd", termomix.term->pid);
+    cwd = g_file_read_link(proc_cwd, NULL);
+    g_free(proc_cwd);
+
+    /* The options this process was started with were for the first window */
+    termomix_reset_options();
+    termomix_init_terminal(cwd);
+
+    g_free(cwd);
+}
+
+
+/* Callback called when termomix configuration file is modified by an external
+ * process. Editors write several times in a row, reload once they are done */
+static void termomix_conf_changed (GFileMonitor *monitor, GFile *file,
+        GFile *other_file, GFileMonitorEvent event, void *data) {
+    if (event != G_FILE_MONITOR_EVENT_CHANGED &&
+            event != G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT &&
+            event != G_FILE_MONITOR_EVENT_CREATED)
+        return;
+
+    if (termomix.reload_source) {
+        g_source_remove(termomix.reload_source);
+    }
+    termomix.reload_source = g_timeout_add(CONFIG_RELOAD_DELAY,
+            termomix_config_reload, NULL);
+}
+
+
+/* Parse the config file off the main thread, termomix_config_reloaded() gets
+ * the result. NULL if it can't be read, or if it's what we wrote last */
+static gpointer termomix_config_reload_thread(gpointer data) {
+    gchar *configfile = (gchar *)data;
+    GKeyFile *cfg = NULL;
+    gchar *contents;
+    gsize len;
+    bool ours;
+
+    if (g_file_get_contents(configfile, &contents, &len, NULL)) {
+        g_mutex_lock(&termomix.config_lock);
+        ours = g_strcmp0(contents, termomix.config_written) == 0;
+        g_mutex_unlock(&termomix.config_lock);
+
+        cfg = g_key_file_new();
+        if (ours || !g_key_file_load_from_data(cfg, contents, len, 0, NULL)) {
+            g_key_file_free(cfg);
+            cfg = NULL;
+        }
+        g_free(contents);
+    }
+    g_free(configfile);
+
+    g_idle_add(termomix_config_reloaded, cfg);
+    return NULL;
+}
+
+
+static gboolean termomix_config_reload(gpointer data) {
+    termomix.reload_source = 0;
+
+    /* Read it again once the running reload is done */
+    if (termomix.reload_running) {
+        termomix.reload_pending = true;
+        return FALSE;
+    }
+
+    termomix.reload_running = true;
+    g_thread_unref(g_thread_new("termomix-reload",
+            termomix_config_reload_thread, g_strdup(termomix.configfile)));
+
+    return FALSE;
+}
+
+
+/* Returns true if key has a different value in cfg, and takes the new value.
+ * A key set here and not saved yet is newer than the file, and keeps its
+ * value */
+static bool termomix_config_key_changed(GKeyFile *cfg, const gchar *key) {
+    gchar *old_value, *new_value;
+    bool changed;
+
+    if (g_hash_table_contains(termomix.config_dirty, key))
+        return false;
+
+    new_value = g_key_file_get_value(cfg, cfg_group, key, NULL);
+    if (!new_value)
+        return false;
+
+    old_value = g_key_file_get_value(termomix.cfg, cfg_group, key, NULL);
+    changed = g_strcmp0(old_value, new_value) != 0;
+    if (changed) {
+        g_key_file_set_value(termomix.cfg, cfg_group, key, new_value);
+        termomix.externally_modified=true;
+    }
+    g_free(old_value);
+    g_free(new_value);
+
+    return changed;
+}
+
+
+/* Take the keys of cfg that aren't applied on a reload, like [matchers],
+ * so the next save doesn't write them back to their old values */
+static void termomix_config_merge(GKeyFile *cfg) {
+    gchar **groups, **keys, *value;
+    gsize i, j;
+
+    groups = g_key_file_get_groups(cfg, NULL);
+    for (i = 0; groups[i]; i++) {
+        keys = g_key_file_get_keys(cfg, groups[i], NULL, NULL);
+        for (j = 0; keys && keys[j]; j++) {
+            if (strcmp(groups[i], cfg_group) == 0 &&
+                    g_hash_table_contains(termomix.config_dirty, keys[j]))
+                continue;
+            value = g_key_file_get_value(cfg, groups[i], keys[j], NULL);
+            g_key_file_set_value(termomix.cfg, groups[i], keys[j], value);
+            g_free(value);
+        }
+        g_strfreev(keys);
+    }
+    g_strfreev(groups);
+}
+
+
+/* Apply to every terminal only the settings that changed in the file */
+static gboolean termomix_config_reloaded(gpointer data) {
+    GKeyFile *cfg = (GKeyFile *)data;
+    struct terminal *current = termomix.term;
+    bool colors_changed = false;
+    gchar *cfgtmp;
+    GList *l;
+
+    termomix.reload_running = false;
+
+    if (cfg) {
+        if (termomix_config_key_changed(cfg, "forecolor")) {
+            cfgtmp = g_key_file_get_value(termomix.cfg, cfg_group, "forecolor", NULL);
+            gdk_color_parse(cfgtmp, &termomix.forecolor);
+            g_free(cfgtmp);
+            colors_changed = true;
+        }
+
+        if (termomix_config_key_changed(cfg, "backcolor")) {
+            cfgtmp = g_key_file_get_value(termomix.cfg, cfg_group, "backcolor", NULL);
+            gdk_color_parse(cfgtmp, &termomix.backcolor);
+            g_free(cfgtmp);
+            colors_changed = true;
+        }
+
+        if (termomix_config_key_changed(cfg, "opacity_level")) {
+            termomix.opacity_level = g_key_file_get_integer(termomix.cfg,
+                    cfg_group, "opacity_level", NULL);
+            colors_changed = true;
+        }
+
+        if (colors_changed) {
+            termomix_set_colors();
+        }
+
+        if (termomix_config_key_changed(cfg, "cursor_type")) {
+            termomix.cursor_type = g_key_file_get_integer(termomix.cfg,
+                    cfg_group, "cursor_type", NULL);
+            for (l = termomix.terminals; l != NULL; l = l->next) {
+                struct terminal *term = (struct terminal *)l->data;
+                vte_terminal_set_cursor_shape(VTE_TERMINAL(term->vte),
+                        termomix.cursor_type);
+            }
+        }
+
+        if (termomix_config_key_changed(cfg, "prewarm_ranges")) {
+            cfgtmp = g_key_file_get_value(termomix.cfg, cfg_group,
+                    "prewarm_ranges", NULL);
+            g_free(termomix.prewarm_text);
+            termomix.prewarm_text = termomix_prewarm_text(cfgtmp);
+            g_free(cfgtmp);
+            termomix_prewarm_start();
+        }
+
+        if (termomix_config_key_changed(cfg, "word_chars")) {
+            g_free(termomix.word_chars);
+            termomix.word_chars = g_key_file_get_value(termomix.cfg, cfg_group,
+                    "word_chars", NULL);
+            for (l = termomix.terminals; l != NULL; l = l->next) {
+                struct terminal *term = (struct terminal *)l->data;
+                vte_terminal_set_word_chars(VTE_TERMINAL(term->vte),
+                        termomix.word_chars);
+            }
+        }
+
+        if (termomix_config_key_changed(cfg, "font")) {
+            cfgtmp = g_key_file_get_value(termomix.cfg, cfg_group, "font", NULL);
+            pango_font_description_free(termomix.font);
+            termomix.font = pango_font_description_from_string(cfgtmp);
+            g_free(cfgtmp);
+
+            termomix_set_font();
+        }
+
+        if (termomix_config_key_changed(cfg, "background")) {
+            cfgtmp = g_key_file_get_value(termomix.cfg, cfg_group, "background", NULL);
+            g_free(termomix.background);
+            termomix.background = NULL;
+            if (strcmp(cfgtmp, "none")!=0) {
+                termomix.background = g_strdup(cfgtmp);
+            }
+            g_free(cfgtmp);
+
+            for (l = termomix.terminals; l != NULL; l = l->next) {
+                termomix.term = (struct terminal *)l->data;
+                if (termomix.background) {
+                    termomix_set_bgimage(termomix.background);
+                } else {
+                    vte_terminal_set_background_image(
+                            VTE_TERMINAL(termomix.term->vte), NULL);
+                }
+            }
+            if (termomix.item_clear_background) {
+                gtk_widget_set_visible(termomix.item_clear_background,
+                        termomix.background != NULL);
+            }
+        }
+
+        if (termomix_config_key_changed(cfg, "background_saturation") |
+                termomix_config_key_changed(cfg, "background_scale")) {
+            termomix.bg_saturation = g_key_file_get_double(termomix.cfg,
+                    cfg_group, "background_saturation", NULL);
+            cfgtmp = g_key_file_get_value(termomix.cfg, cfg_group,
+                    "background_scale", NULL);
+            termomix.bg_cover = g_strcmp0(cfgtmp, "cover") == 0;
+            g_free(cfgtmp);
+            g_hash_table_remove_all(termomix.bg_variants);
+            for (l = termomix.terminals; termomix.background && l; l = l->next) {
+                termomix.term = (struct terminal *)l->data;
+                termomix_set_bgimage(termomix.background);
+            }
+        }
+
+        if (termomix_config_key_changed(cfg, "copy_accelerator")) {
+            termomix.copy_accelerator = g_key_file_get_integer(termomix.cfg,
+                    cfg_group, "copy_accelerator", NULL);
+        }
+        if (termomix_config_key_changed(cfg, "open_url_accelerator")) {
+            termomix.open_url_accelerator = g_key_file_get_integer(termomix.cfg,
+                    cfg_group, "open_url_accelerator", NULL);
+        }
+        if (termomix_config_key_changed(cfg, "font_size_accelerator")) {
+            termomix.font_size_accelerator = g_key_file_get_integer(termomix.cfg,
+                    cfg_group, "font_size_accelerator", NULL);
+        }
+        if (termomix_config_key_changed(cfg, "copy_key")) {
+            termomix.copy_key = termomix_get_config_key("copy_key");
+        }
+        if (termomix_config_key_changed(cfg, "paste_key")) {
+            termomix.paste_key = termomix_get_config_key("paste_key");
+        }
+        if (termomix_config_key_changed(cfg, "search_key")) {
+            termomix.search_key = termomix_get_config_key("search_key");
+        }
+        if (termomix_config_key_changed(cfg, "new_window_key")) {
+            termomix.new_window_key = termomix_get_config_key("new_window_key");
+        }
+        if (termomix_config_key_changed(cfg, "scrollback_bytes") |
+                termomix_config_key_changed(cfg, "scrollback_total_bytes")) {
+            termomix.scrollback_bytes = g_key_file_get_uint64(termomix.cfg,
+                    cfg_group, "scrollback_bytes", NULL);
+            termomix.scrollback_total_bytes = g_key_file_get_uint64(
+                    termomix.cfg, cfg_group, "scrollback_total_bytes", NULL);
+            termomix_set_scrollback();
+        }
+        if (termomix_config_key_changed(cfg, "pool_size")) {
+            termomix.pool_size = g_key_file_get_integer(termomix.cfg,
+                    cfg_group, "pool_size", NULL);
+        }
+        if (termomix_config_key_changed(cfg, "frame_pacing")) {
+            termomix.frame_pacing = g_key_file_get_boolean(termomix.cfg,
+                    cfg_group, "frame_pacing", NULL);
+        }
+        if (termomix_config_key_changed(cfg, "metrics")) {
+            if (g_key_file_get_boolean(termomix.cfg, cfg_group, "metrics", NULL)) {
+                termomix_metrics_start();
+            } else {
+                termomix_metrics_stop();
+            }
+        }
+        /* Shells started before keep the socket they were told about */
+        if (termomix_config_key_changed(cfg, "remote_control")) {
+            if (g_key_file_get_boolean(termomix.cfg, cfg_group,
+                        "remote_control", NULL)) {
+                termomix_control_start();
+            } else {
+                termomix_control_stop();
+            }
+        }
+        if (termomix_config_key_changed(cfg, "flood_rate")) {
+            termomix.flood_rate = g_key_file_get_integer(termomix.cfg,
+                    cfg_group, "flood_rate", NULL);
+        }
+        if (termomix_config_key_changed(cfg, "flood_fps")) {
+            termomix.flood_fps = g_key_file_get_integer(termomix.cfg,
+                    cfg_group, "flood_fps", NULL);
+        }
+        /* The log settings apply to the terminals opened from now on */
+        if (termomix_config_key_changed(cfg, "log_file") && !option_log) {
+            g_free(termomix.log_file);
+            termomix.log_file = g_key_file_get_string(termomix.cfg,
+                    cfg_group, "log_file", NULL);
+        }
+        if (termomix_config_key_changed(cfg, "log_strip_ansi")) {
+            termomix.log_strip_ansi = g_key_file_get_boolean(termomix.cfg,
+                    cfg_group, "log_strip_ansi", NULL);
+        }
+        if (termomix_config_key_changed(cfg, "log_compress")) {
+            termomix.log_compress = g_key_file_get_boolean(termomix.cfg,
+                    cfg_group, "log_compress", NULL);
+        }
+        if (termomix_config_key_changed(cfg, "log_max_bytes")) {
+            termomix.log_max_bytes = g_key_file_get_uint64(termomix.cfg,
+                    cfg_group, "log_max_bytes", NULL);
+        }
+        if (termomix_config_key_changed(cfg, "log_rotate")) {
+            termomix.log_rotate = g_key_file_get_integer(termomix.cfg,
+                    cfg_group, "log_rotate", NULL);
+        }
+
+        termomix.term = current;
+        termomix_config_merge(cfg);
+        g_key_file_free(cfg);
+
+        /* Otherwise the pending save writes the file with both */
+        if (!termomix.config_modified) {
+            g_free(termomix.config_saved);
+            termomix.config_saved = g_key_file_to_data(termomix.cfg, NULL,
+                    NULL);
+        }
+    }
+
+    if (termomix.reload_pending) {
+        termomix.reload_pending = false;
+        termomix_config_reload(NULL);
+    }
+
+    return FALSE;
+}
+
+/******* Functions ********/
+
+/******* Startup prefetching ********/
+
+/* Independent startup work runs on worker threads, started as early as
+ * possible and joined on the main thread right before the result is needed.
+ * Workers only touch the data they are given */
+
+static gpointer termomix_load_config_thread(gpointer data) {
+    GError *gerror=NULL;
+
+    g_key_file_load_from_file(termomix.cfg, termomix.configfile, 0, &gerror);
+    return gerror;
+}
+
+
+/* Start reading the config file, termomix_init() picks it up */
+static void termomix_prefetch_config() {
+    char* configdir = NULL;
+
+    /* Config file initialization*/
+    termomix.cfg = g_key_file_new();
+    termomix.config_modified=false;
+    termomix.config_dirty = g_hash_table_new_full(g_str_hash, g_str_equal,
+            g_free, NULL);
+
+    configdir = g_build_filename( g_get_user_config_dir(), "termomix", NULL );
+    if( ! g_file_test( g_get_user_config_dir(), G_FILE_TEST_EXISTS) )
+        g_mkdir( g_get_user_config_dir(), 0755 );
+    if( ! g_file_test( configdir, G_FILE_TEST_EXISTS) )
+        g_mkdir( configdir, 0755 );
+    if (option_config_file) {
+        termomix.configfile=g_build_filename(configdir, option_config_file, NULL);
+    } else {
+        /* Use more standard-conforming path for config files, if available. */
+        termomix.configfile=g_build_filename(configdir, DEFAULT_CONFIGFILE, NULL);
+    }
+    g_free(configdir);
+
+    termomix.config_thread = g_thread_new("termomix-config",
+            termomix_load_config_thread, NULL);
+}
+
+
+static gpointer termomix_find_command_thread(gpointer data) {
+    gchar *command_line = (gchar *)data;
+    gchar **command_argv = NULL;
+    gchar *path = NULL;
+
+    if (g_shell_parse_argv(command_line, NULL, &command_argv, NULL)) {
+        path = g_find_program_in_path(command_argv[0]);
+        g_strfreev(command_argv);
+    }
+    g_free(command_line);
+
+    return path;
+}
+
+
+/* Start the PATH lookup of the -x/-e command, termomix_get_command() picks
+ * it up */
+static void termomix_prefetch_command() {
+    gchar *command_line;
+
+    if (option_execute) {
+        command_line = g_strdup(option_execute);
+    } else if (option_xterm_execute && option_xterm_args) {
+        command_line = g_strjoinv(" ", option_xterm_args);
+    } else {
+        return;
+    }
+
+    termomix.command_thread = g_thread_new("termomix-command",
+            termomix_find_command_thread, command_line);
+}
+
+
+/* Resolve the font ahead of the main thread, see termomix_warm_fonts() */
+static gpointer termomix_resolve_font_thread(gpointer data) {
+    PangoFontDescription *font = (PangoFontDescription *)data;
+
+    termomix_warm_fonts(font, NULL, NULL, 0);
+    pango_font_description_free(font);
+
+    return NULL;
+}
+
+
+static gpointer termomix_load_pixbuf_thread(gpointer data) {
+    gchar *path = (gchar *)data;
+    GdkPixbuf *pixbuf;
+
+    pixbuf = gdk_pixbuf_new_from_file(path, NULL);
+    g_free(path);
+
+    return pixbuf;
+}
+
+
+static void termomix_init() {
+    GError *gerror=NULL;
+
+    termomix_profile_begin(PROFILE_CONFIG);
+
+    term_data_id = g_quark_from_static_string("termomix_term");
+
+    g_setenv("TERM", "xterm", FALSE);
+
+    /* Open config file */
+    if (!termomix.config_thread) {
+        termomix_prefetch_config();
+    }
+    gerror = g_thread_join(termomix.config_thread);
+    termomix.config_thread = NULL;
+    if (gerror) {
+        /* If there's no file, ignore the error. A new one is created */
+        if (gerror->domain==G_KEY_FILE_ERROR &&
+                (gerror->code==G_KEY_FILE_ERROR_UNKNOWN_ENCODING ||
+                gerror->code==G_KEY_FILE_ERROR_INVALID_VALUE)) {
+            fprintf(stderr, "Not valid config file format\n");
+            exit(EXIT_FAILURE);
+        }
+        g_error_free(gerror);
+        gerror=NULL;
+    } else {
+        /* What's on disk, so unchanged settings aren't written back */
+        termomix.config_saved = g_key_file_to_data(termomix.cfg, NULL, NULL);
+    }
+    
+    /* Add GFile monitor to control file external changes */
+    GFile *cfgfile = g_file_new_for_path(termomix.configfile);
+    GFileMonitor *mon_cfgfile = g_file_monitor_file (cfgfile, 0, NULL, NULL);
+    g_signal_connect(G_OBJECT(mon_cfgfile), "changed",
+            G_CALLBACK(termomix_conf_changed), NULL);
+    
+    gchar *cfgtmp = NULL;
+
+    /* We can safely ignore errors from g_key_file_get_value(), since if the
+     * call to g_key_file_has_key() was successful, the key IS there. From the
+     * glib docs I don't know if we can ignore errors from g_key_file_has_key,
+     * too. I think we can: the only possible error is that the config file
+     * doesn't exist, but we have just read it!
+     */
+
+    /* TODO: Use RGBA colors, with rgba_parse when gtk-3.4 deprecates some
+     * functions using GdkColor. Maybe we can convert all termomix to GdkRGBA
+     * colors
+     */
+    if (!g_key_file_has_key(termomix.cfg, cfg_group, "forecolor", NULL)) {
+        termomix_set_config_string("forecolor", "#c0c0c0");
+    }
+    cfgtmp = g_key_file_get_value(termomix.cfg, cfg_group, "forecolor", NULL);
+    gdk_color_parse(cfgtmp, &termomix.forecolor);
+    g_free(cfgtmp);
+
+
+    if (!g_key_file_has_key(termomix.cfg, cfg_group, "backcolor", NULL)) {
+        termomix_set_config_string("backcolor", "#000000");
+    }
+    cfgtmp = g_key_file_get_value(termomix.cfg, cfg_group, "backcolor", NULL);
+    gdk_color_parse(cfgtmp, &termomix.backcolor);
+    g_free(cfgtmp);
+
+
+    if (!g_key_file_has_key(termomix.cfg, cfg_group, "opacity_level", NULL)) {
+        termomix_set_config_integer("opacity_level", 99);
+    }
+    termomix.opacity_level = g_key_file_get_integer(termomix.cfg, cfg_group, "opacity_level", NULL);
+
+
+    if (!g_key_file_has_key(termomix.cfg, cfg_group, "background", NULL)) {
+        termomix_set_config_string("background", "none");
+    }
+    cfgtmp = g_key_file_get_value(termomix.cfg, cfg_group, "background", NULL);
+    if (strcmp(cfgtmp, "none")==0) {
+        termomix.background=NULL;
+    } else {
+        termomix.background=g_strdup(cfgtmp);
+    }
+    g_free(cfgtmp);
+
+    if (!g_key_file_has_key(termomix.cfg, cfg_group, "background_saturation", NULL)) {
+        termomix_set_config_string("background_saturation", "1.0");
+    }
+    termomix.bg_saturation = g_key_file_get_double(termomix.cfg, cfg_group,
+            "background_saturation", NULL);
+
+    if (!g_key_file_has_key(termomix.cfg, cfg_group, "background_scale", NULL)) {
+        termomix_set_config_string("background_scale", "tile");
+    }
+    cfgtmp = g_key_file_get_value(termomix.cfg, cfg_group, "background_scale",
+            NULL);
+    termomix.bg_cover = strcmp(cfgtmp, "cover") == 0;
+    g_free(cfgtmp);
+
+    /* Decoded when a terminal gets its size, see termomix_bg_request() */
+    termomix.bg_variants = g_hash_table_new_full(g_direct_hash,
+            g_direct_equal, NULL, termomix_bg_forget);
+
+
+    if (!g_key_file_has_key(termomix.cfg, cfg_group, "font", NULL)) {
+        termomix_set_config_string("font", DEFAULT_FONT);
+    }
+    cfgtmp = g_key_file_get_value(termomix.cfg, cfg_group, "font", NULL);
+    termomix.font = pango_font_description_from_string(cfgtmp);
+    free(cfgtmp);
+
+    if (!g_key_file_has_key(termomix.cfg, cfg_group, "cursor_type", NULL)) {
+        termomix_set_config_string("cursor_type", "VTE_CURSOR_SHAPE_BLOCK");
+    }
+    termomix.cursor_type = g_key_file_get_integer(termomix.cfg, cfg_group,
+            "cursor_type", NULL);
+
+    if (!g_key_file_has_key(termomix.cfg, cfg_group, "word_chars", NULL)) {
+        termomix_set_config_string("word_chars", DEFAULT_WORD_CHARS);
+    }
+    termomix.word_chars = g_key_file_get_value(termomix.cfg, cfg_group,
+            "word_chars", NULL);
+
+    if (!g_key_file_has_key(termomix.cfg, cfg_group, "prewarm_ranges", NULL)) {
+        termomix_set_config_string("prewarm_ranges", DEFAULT_PREWARM_RANGES);
+    }
+    cfgtmp = g_key_file_get_value(termomix.cfg, cfg_group, "prewarm_ranges", NULL);
+    termomix.prewarm_text = termomix_prewarm_text(cfgtmp);
+    g_free(cfgtmp);
+
+    termomix.palette=xterm_palette;
+    
+    if (!g_key_file_has_key(termomix.cfg, cfg_group, "copy_accelerator", NULL)) {
+        termomix_set_config_integer("copy_accelerator", DEFAULT_COPY_ACCELERATOR);
+    }
+    termomix.copy_accelerator = g_key_file_get_integer(termomix.cfg, cfg_group,
+            "copy_accelerator", NULL);
+
+    if (!g_key_file_has_key(termomix.cfg, cfg_group, "open_url_accelerator", NULL)) {
+        termomix_set_config_integer("open_url_accelerator",
+                DEFAULT_OPEN_URL_ACCELERATOR);
+    }
+    termomix.open_url_accelerator = g_key_file_get_integer(termomix.cfg, cfg_group,
+            "open_url_accelerator", NULL);
+
+    if (!g_key_file_has_key(termomix.cfg, cfg_group,
+            "font_size_accelerator", NULL)) {
+        termomix_set_config_integer("font_size_accelerator",
+                DEFAULT_FONT_SIZE_ACCELERATOR);
+    }
+    termomix.font_size_accelerator = g_key_file_get_integer(termomix.cfg,
+            cfg_group, "font_size_accelerator", NULL);
+
+    if (!g_key_file_has_key(termomix.cfg, cfg_group, "copy_key", NULL)) {
+        termomix_set_config_key( "copy_key", DEFAULT_COPY_KEY);
+    }
+    termomix.copy_key = termomix_get_config_key("copy_key");
+
+    if (!g_key_file_has_key(termomix.cfg, cfg_group, "paste_key", NULL)) {
+        termomix_set_config_key("paste_key", DEFAULT_PASTE_KEY);
+    }
+    termomix.paste_key = termomix_get_config_key("paste_key");
+
+    if (!g_key_file_has_key(termomix.cfg, cfg_group, "search_key", NULL)) {
+        termomix_set_config_key("search_key", DEFAULT_SEARCH_KEY);
+    }
+    termomix.search_key = termomix_get_config_key("search_key");
+
+    if (!g_key_file_has_key(termomix.cfg, cfg_group, "new_window_key", NULL)) {
+        termomix_set_config_key("new_window_key", DEFAULT_NEW_WINDOW_KEY);
+    }
+    termomix.new_window_key = termomix_get_config_key("new_window_key");
+
+    if (!g_key_file_has_key(termomix.cfg, cfg_group, "scrollback_bytes", NULL)) {
+        termomix_set_config_string("scrollback_bytes",
+                G_STRINGIFY(DEFAULT_SCROLLBACK_BYTES));
+    }
+    termomix.scrollback_bytes = g_key_file_get_uint64(termomix.cfg, cfg_group,
+            "scrollback_bytes", NULL);
+
+    if (!g_key_file_has_key(termomix.cfg, cfg_group, "scrollback_total_bytes",
+            NULL)) {
+        termomix_set_config_string("scrollback_total_bytes",
+                G_STRINGIFY(DEFAULT_SCROLLBACK_TOTAL_BYTES));
+    }
+    termomix.scrollback_total_bytes = g_key_file_get_uint64(termomix.cfg,
+            cfg_group, "scrollback_total_bytes", NULL);
+
+    if (!g_key_file_has_key(termomix.cfg, cfg_group, "pool_size", NULL)) {
+        termomix_set_config_integer("pool_size", DEFAULT_POOL_SIZE);
+    }
+    termomix.pool_size = g_key_file_get_integer(termomix.cfg, cfg_group,
+            "pool_size", NULL);
+
+    if (!g_key_file_has_key(termomix.cfg, cfg_group, "frame_pacing", NULL)) {
+        termomix_set_config_boolean("frame_pacing", TRUE);
+    }
+    termomix.frame_pacing = g_key_file_get_boolean(termomix.cfg, cfg_group,
+            "frame_pacing", NULL);
+
+    termomix_metrics_init();
+    if (!g_key_file_has_key(termomix.cfg, cfg_group, "metrics", NULL)) {
+        termomix_set_config_boolean("metrics", FALSE);
+    }
+    if (g_key_file_get_boolean(termomix.cfg, cfg_group, "metrics", NULL)) {
+        termomix_metrics_start();
+    }
+
+    /* Off unless asked for: any local process could type into the shells */
+    if (!g_key_file_has_key(termomix.cfg, cfg_group, "remote_control", NULL)) {
+        termomix_set_config_boolean("remote_control", FALSE);
+    }
+    if (g_key_file_get_boolean(termomix.cfg, cfg_group, "remote_control", NULL)) {
+        termomix_control_start();
+    }
+
+    if (!g_key_file_has_key(termomix.cfg, cfg_group, "flood_rate", NULL)) {
+        termomix_set_config_integer("flood_rate", DEFAULT_FLOOD_RATE);
+    }
+    termomix.flood_rate = g_key_file_get_integer(termomix.cfg, cfg_group,
+            "flood_rate", NULL);
+
+    if (!g_key_file_has_key(termomix.cfg, cfg_group, "flood_fps", NULL)) {
+        termomix_set_config_integer("flood_fps", DEFAULT_FLOOD_FPS);
+    }
+    termomix.flood_fps = g_key_file_get_integer(termomix.cfg, cfg_group,
+            "flood_fps", NULL);
+
+    if (!g_key_file_has_key(termomix.cfg, cfg_group, "log_file", NULL)) {
+        termomix_set_config_string("log_file", "");
+    }
+    if (option_log) {
+        termomix.log_file = g_strdup(option_log);
+    } else {
+        termomix.log_file = g_key_file_get_string(termomix.cfg, cfg_group,
+                "log_file", NULL);
+    }
+
+    if (!g_key_file_has_key(termomix.cfg, cfg_group, "log_strip_ansi", NULL)) {
+        termomix_set_config_boolean("log_strip_ansi", FALSE);
+    }
+    termomix.log_strip_ansi = g_key_file_get_boolean(termomix.cfg, cfg_group,
+            "log_strip_ansi", NULL);
+
+    if (!g_key_file_has_key(termomix.cfg, cfg_group, "log_compress", NULL)) {
+        termomix_set_config_boolean("log_compress", FALSE);
+    }
+    termomix.log_compress = g_key_file_get_boolean(termomix.cfg, cfg_group,
+            "log_compress", NULL);
+
+    if (!g_key_file_has_key(termomix.cfg, cfg_group, "log_max_bytes", NULL)) {
+        termomix_set_config_string("log_max_bytes", "0");
+    }
+    termomix.log_max_bytes = g_key_file_get_uint64(termomix.cfg, cfg_group,
+            "log_max_bytes", NULL);
+
+    if (!g_key_file_has_key(termomix.cfg, cfg_group, "log_rotate", NULL)) {
+        termomix_set_config_integer("log_rotate", DEFAULT_LOG_ROTATE);
+    }
+    termomix.log_rotate = g_key_file_get_integer(termomix.cfg, cfg_group,
+            "log_rotate", NULL);
+
+    if (!g_key_file_has_key(termomix.cfg, cfg_group, "icon_file", NULL)) {
+        termomix_set_config_string("icon_file", ICON_FILE);
+    }
+    /* We don't need a global because it's not configurable within termomix */
+
+    termomix_profile_end(PROFILE_CONFIG);
+
+    /* Figure out if we have rgba capabilities. */
+    GdkScreen *screen = gdk_screen_get_default();
+    GdkVisual *visual = gdk_screen_get_rgba_visual (screen);
+    if (visual != NULL && gdk_screen_is_composited (screen)) {
+        termomix.has_rgba = true;
+    } else {
+        /* Probably not needed, as is likely the default initializer */
+        termomix.has_rgba = false;
+    }
+
+    /* Command line options initialization */
+    if (option_font) {
+        termomix.font=pango_font_description_from_string(option_font);
+    } 
+
+    termomix.font_thread = g_thread_new("termomix-font",
+            termomix_resolve_font_thread,
+            pango_font_description_copy(termomix.font));
+
+    /* Decoded now, set by termomix_init_idle() */
+    char *icon = g_key_file_get_value(termomix.cfg, cfg_group, "icon_file", NULL);
+    termomix.icon_thread = g_thread_new("termomix-icon",
+            termomix_load_pixbuf_thread,
+            g_strdup_printf(DATADIR "/pixmaps/%s", icon));
+    g_free(icon);
+
+    termomix.externally_modified=false;
+
+    termomix_init_matchers();
+
+    /* The icon and the popup menu are built by termomix_init_idle() */
+}
+
+
+/* Compile every pattern of the [matchers] config group into one optimized
+ * regex, each pattern as a named group so termomix_match_kind() can tell
+ * which one matched */
+static void termomix_init_matchers() {
+    GError *gerror=NULL;
+    GString *pattern;
+    gchar *value;
+    GPtrArray *names;
+    gchar **keys;
+    gsize i, count;
+
+    if (!g_key_file_has_group(termomix.cfg, MATCHERS_GROUP)) {
+        g_key_file_set_value(termomix.cfg, MATCHERS_GROUP, "url", DEFAULT_URL_MATCHER);
+        g_key_file_set_value(termomix.cfg, MATCHERS_GROUP, "file_line",
+                DEFAULT_FILE_LINE_MATCHER);
+        g_key_file_set_value(termomix.cfg, MATCHERS_GROUP, "git_hash",
+                DEFAULT_GIT_HASH_MATCHER);
+        g_key_file_set_value(termomix.cfg, MATCHERS_GROUP, "ip", DEFAULT_IP_MATCHER);
+        g_key_file_set_value(termomix.cfg, MATCHERS_GROUP, "ticket",
+                DEFAULT_TICKET_MATCHER);
+        termomix.config_modified=TRUE;
+        termomix_config_schedule_save();
+    }
+
+    /* The first default took any 7 digit number for a hash */
+    value = g_key_file_get_value(termomix.cfg, MATCHERS_GROUP, "git_hash", NULL);
+    if (g_strcmp0(value, OLD_GIT_HASH_MATCHER) == 0) {
+        g_key_file_set_value(termomix.cfg, MATCHERS_GROUP, "git_hash",
+                DEFAULT_GIT_HASH_MATCHER);
+        termomix.config_modified=TRUE;
+        termomix_config_schedule_save();
+    }
+    g_free(value);
+
+    pattern = g_string_new(NULL);
+    names = g_ptr_array_new();
+    keys = g_key_file_get_keys(termomix.cfg, MATCHERS_GROUP, &count, NULL);
+    for (i=0; i<count; i++) {
+        gchar *value = g_key_file_get_value(termomix.cfg, MATCHERS_GROUP,
+                keys[i], NULL);
+        gchar *group = g_strdup_printf("(?<%s>%s)", keys[i], value);
+        GRegex *check = g_regex_new(group, 0, 0, &gerror);
+
+        /* One broken pattern shouldn't take the others down */
+        if (!check) {
+            fprintf(stderr, "Ignoring matcher %s: %s\n", keys[i], gerror->message);
+            g_clear_error(&gerror);
+        } else {
+            g_regex_unref(check);
+            if (pattern->len)
+                g_string_append_c(pattern, '|');
+            g_string_append(pattern, group);
+            g_ptr_array_add(names, g_strdup(keys[i]));
+        }
+        g_free(group);
+        g_free(value);
+    }
+    g_strfreev(keys);
+    g_ptr_array_add(names, NULL);
+    termomix.matchers = (gchar **)g_ptr_array_free(names, FALSE);
+
+    if (pattern->len) {
+        termomix.match_regexp = g_regex_new(pattern->str, G_REGEX_OPTIMIZE,
+                G_REGEX_MATCH_NOTEMPTY, &gerror);
+        if (!termomix.match_regexp) {
+            fprintf(stderr, "Cannot compile matchers: %s\n", gerror->message);
+            g_error_free(gerror);
+        }
+    }
+    g_string_free(pattern, TRUE);
+}
+
+
+/* Name of the matcher that found match */
+static const gchar *termomix_match_kind(const gchar *match) {
+    GMatchInfo *info;
+    const gchar *kind = NULL;
+    int i;
+
+    if (!termomix.match_regexp)
+        return NULL;
+
+    g_regex_match(termomix.match_regexp, match, 0, &info);
+    for (i=0; termomix.matchers[i] && g_match_info_matches(info); i++) {
+        gchar *text = g_match_info_fetch_named(info, termomix.matchers[i]);
+        bool found = text && *text;
+
+        g_free(text);
+        if (found) {
+            kind = termomix.matchers[i];
+            break;
+        }
+    }
+    g_match_info_free(info);
+
+    return kind;
+}
+
+
+/* Matches of the buffer row, from the cache if its text hasn't changed.
+ * History rows don't change, so they are only matched once per width and
+ * history reset. A screen row is read again after contents-changed, and
+ * matched again only if its text is different. The cache starts over once
+ * it holds MATCH_CACHE_ROWS rows */
+static struct match_row *termomix_match_row(struct terminal *term, glong row) {
+    VteTerminal *vte = VTE_TERMINAL(term->vte);
+    struct match_row *entry;
+    struct row_match match;
+    VteCharAttributes *first, *last;
+    GArray *attributes;
+    GMatchInfo *info;
+    GtkAdjustment *adjustment;
+    gint64 *key, at = row;
+    gchar *text;
+    gint from, to, i;
+    gsize length;
+    glong columns = vte_terminal_get_column_count(vte), top;
+    guint resets = term->reader ? term->reader->history_resets : 0;
+
+    if (!term->match_rows) {
+        term->match_rows = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                g_free, termomix_match_row_free);
+    }
+
+    adjustment = gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(term->vte));
+    top = gtk_adjustment_get_upper(adjustment) -
+            vte_terminal_get_row_count(vte);
+    entry = g_hash_table_lookup(term->match_rows, &at);
+    if (entry && entry->columns == columns && entry->resets == resets &&
+            (entry->version == term->contents_version || row < top))
+        return entry;
+
+    attributes = g_array_new(FALSE, FALSE, sizeof(VteCharAttributes));
+    text = vte_terminal_get_text_range(vte, row, 0, row, columns-1,
+            termomix_export_all, NULL, attributes);
+    if (entry && entry->columns == columns && entry->resets == resets &&
+            strcmp(entry->text, text) == 0) {
+        entry->version = term->contents_version;
+        g_array_free(attributes, TRUE);
+        g_free(text);
+        return entry;
+    }
+
+    if (!entry && g_hash_table_size(term->match_rows) >= MATCH_CACHE_ROWS) {
+        g_hash_table_remove_all(term->match_rows);
+    }
+    entry = g_new0(struct match_row, 1);
+    entry->text = text;
+    entry->version = term->contents_version;
+    entry->columns = columns;
+    entry->resets = resets;
+    length = strlen(text);
+    entry->wraps = length == 0 || text[length-1] != '\n';
+    entry->matches = g_array_new(FALSE, FALSE, sizeof(struct row_match));
+
+    g_regex_match(termomix.match_regexp, text, 0, &info);
+    while (g_match_info_matches(info)) {
+        g_match_info_fetch_pos(info, 0, &from, &to);
+        if (to > from && (guint)to <= attributes->len) {
+            first = &g_array_index(attributes, VteCharAttributes, from);
+            last = &g_array_index(attributes, VteCharAttributes, to - 1);
+            match.column = first->column;
+            match.end_column = last->column;
+            match.last = (gsize)to == length;
+            match.kind = NULL;
+            for (i = 0; termomix.matchers[i] && !match.kind; i++) {
+                g_match_info_fetch_named_pos(info, termomix.matchers[i],
+                        &from, &to);
+                if (from >= 0 && to > from) {
+                    match.kind = termomix.matchers[i];
+                }
+            }
+            match.text = g_match_info_fetch(info, 0);
+            g_array_append_val(entry->matches, match);
+        }
+        g_match_info_next(info, NULL);
+    }
+    g_match_info_free(info);
+    g_array_free(attributes, TRUE);
+
+    key = g_new(gint64, 1);
+    *key = row;
+    g_hash_table_replace(term->match_rows, key, entry);
+    return entry;
+}
+
+
+static void termomix_match_row_free(gpointer data) {
+    struct match_row *entry = (struct match_row *)data;
+    guint i;
+
+    for (i = 0; i < entry->matches->len; i++) {
+        g_free(g_array_index(entry->matches, struct row_match, i).text);
+    }
+    g_array_free(entry->matches, TRUE);
+    g_free(entry->text);
+    g_free(entry);
+}
+
+
+/* The match under column and row of the screen and its kind, like
+ * vte_terminal_match_check(), from the per row cache. A match that may go
+ * on in the row above or below, because the line wraps, is left to VTE,
+ * which matches across rows */
+static gchar *termomix_match_at(struct terminal *term, glong column,
+        glong row, const gchar **kind) {
+    GtkAdjustment *adjustment;
+    struct match_row *entry;
+    struct row_match *match = NULL;
+    glong top;
+    guint i;
+    bool before, after;
+    gint tag;
+
+    *kind = NULL;
+    if (!termomix.match_regexp)
+        return NULL;
+
+    adjustment = gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(term->vte));
+    top = gtk_adjustment_get_value(adjustment);
+    entry = termomix_match_row(term, top + row);
+    for (i = 0; i < entry->matches->len && !match; i++) {
+        struct row_match *m = &g_array_index(entry->matches, struct row_match, i);
+        if (m->column <= column && column <= m->end_column) {
+            match = m;
+        }
+    }
+
+    /* A click off every match may still hit the end of one that starts in
+     * the row above */
+    before = !match || match->column == 0;
+    after = match && match->last;
+    if ((after && entry->wraps) || (before &&
+            top + row > gtk_adjustment_get_lower(adjustment) &&
+            termomix_match_row(term, top + row - 1)->wraps)) {
+        gchar *text = vte_terminal_match_check(VTE_TERMINAL(term->vte),
+                column, row, &tag);
+        *kind = text ? termomix_match_kind(text) : NULL;
+        return text;
+    }
+
+    if (!match)
+        return NULL;
+    *kind = match->kind;
+    return g_strdup(match->text);
+}
+
+
+/* Build what the first frame doesn't need, once the main loop goes idle
+ * after drawing it */
+static gboolean termomix_init_idle(gpointer data) {
+    GdkPixbuf *icon;
+
+    if (termomix.icon_thread) {
+        /* The icon is loaded once and shared by every window we open */
+        termomix_profile_begin(PROFILE_ICON);
+        icon = g_thread_join(termomix.icon_thread);
+        termomix.icon_thread = NULL;
+        if (icon) {
+            gtk_window_set_default_icon(icon);
+            g_object_unref(icon);
+        }
+        termomix_profile_end(PROFILE_ICON);
+    }
+
+    termomix_init_popup();
+    termomix_prewarm_start();
+
+    return FALSE;
+}
+
+
+static gboolean termomix_first_draw(GtkWidget *widget, cairo_t *cr,
+        void *data) {
+    g_signal_handlers_disconnect_by_func(widget, termomix_first_draw, data);
+    if (!termomix.menu) {
+        g_idle_add(termomix_init_idle, NULL);
+    }
+    return FALSE;
+}
+
+
+/* The dialog CSS is parsed the first time a dialog is shown */
+static void termomix_set_dialog_style(GtkWidget *dialog) {
+    if (!termomix.provider) {
+        termomix.provider = gtk_css_provider_new();
+        gtk_css_provider_load_from_data(termomix.provider, HIG_DIALOG_CSS, -1,
+                NULL);
+    }
+
+    gtk_style_context_add_provider(gtk_widget_get_style_context(dialog),
+            GTK_STYLE_PROVIDER(termomix.provider),
+            GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);
+}
+
+
+static void termomix_init_popup() {
+    GtkWidget *item_copy, *item_paste, *item_paste_file, *item_new_window,
+            *item_search, *item_export,
+            *item_select_font, *item_select_colors,
+            *item_select_background, *item_set_title, *item_options,
+            *item_input_methods, *item_opacity_menu, *item_cursor,
+            *item_cursor_block, *item_cursor_underline, *item_cursor_ibeam;
+    GtkAction *action_open_link, *action_copy_link, *action_copy,
+            *action_paste, *action_paste_file, *action_new_window,
+            *action_search, *action_export,
+            *action_select_font, *action_select_colors,
+            *action_select_background, *action_clear_background,
+            *action_opacity, *action_set_title;
+    GtkWidget *options_menu, *cursor_menu;
+
+    /* Built on demand, see termomix_init_idle() */
+    if (termomix.menu)
+        return;
+
+    termomix_profile_begin(PROFILE_POPUP);
+
+    /* Define actions */
+    action_open_link=gtk_action_new("open_link", gettext("Open link..."), NULL, NULL);
+    action_copy_link=gtk_action_new("copy_link", gettext("Copy link..."), NULL, NULL);
+    action_copy=gtk_action_new("copy", gettext("Copy"), NULL, GTK_STOCK_COPY);
+    action_paste=gtk_action_new("paste", gettext("Paste"), NULL, GTK_STOCK_PASTE);
+    action_paste_file=gtk_action_new("paste_file", gettext("Paste file..."),
+            NULL, NULL);
+    action_new_window=gtk_action_new("new_window", gettext("New window"), NULL,
+            GTK_STOCK_NEW);
+    action_search=gtk_action_new("search", gettext("Search..."), NULL,
+            GTK_STOCK_FIND);
+    action_export=gtk_action_new("export", gettext("Export scrollback..."),
+            NULL, GTK_STOCK_SAVE_AS);
+    action_select_font=gtk_action_new("select_font", gettext("Select font..."),
+            NULL, GTK_STOCK_SELECT_FONT);
+    action_select_colors=gtk_action_new("select_colors", gettext("Select colors..."),
+            NULL, GTK_STOCK_SELECT_COLOR);
+    action_select_background=gtk_action_new("select_background",
+            gettext("Select background..."), NULL, NULL);
+    action_clear_background=gtk_action_new("clear_background",
+            gettext("Clear background"), NULL, NULL);
+    action_opacity=gtk_action_new("set_opacity", gettext("Set opacity level..."),
+            NULL, NULL);
+    action_set_title=gtk_action_new("set_title", gettext("Set window title..."),
+            NULL, NULL);
+
+    /* Create menuitems */
+    termomix.item_open_link=gtk_action_create_menu_item(action_open_link);
+    termomix.item_copy_link=gtk_action_create_menu_item(action_copy_link);
+    item_copy=gtk_action_create_menu_item(action_copy);
+    item_paste=gtk_action_create_menu_item(action_paste);
+    item_paste_file=gtk_action_create_menu_item(action_paste_file);
+    item_new_window=gtk_action_create_menu_item(action_new_window);
+    item_search=gtk_action_create_menu_item(action_search);
+    item_export=gtk_action_create_menu_item(action_export);
+    item_select_font=gtk_action_create_menu_item(action_select_font);
+    item_select_colors=gtk_action_create_menu_item(action_select_colors);
+    item_select_background=gtk_action_create_menu_item(action_select_background);
+    termomix.item_clear_background=gtk_action_create_menu_item(action_clear_background);
+    item_opacity_menu=gtk_action_create_menu_item(action_opacity);
+    item_set_title=gtk_action_create_menu_item(action_set_title);
+
+    item_options=gtk_menu_item_new_with_label(gettext("Options"));
+
+    /* FIXME: Use actions for all items, or no use'em at all */
+    item_cursor = gtk_menu_item_new_with_label(gettext("Set cursor type"));
+    item_cursor_block = gtk_radio_menu_item_new_with_label(NULL, gettext("Block"));
+    item_cursor_underline = gtk_radio_menu_item_new_with_label_from_widget(
+            GTK_RADIO_MENU_ITEM(item_cursor_block), gettext("Underline"));
+    item_cursor_ibeam = gtk_radio_menu_item_new_with_label_from_widget(
+            GTK_RADIO_MENU_ITEM(item_cursor_block), gettext("IBeam"));
+    item_input_methods = gtk_menu_item_new_with_label(gettext("Input methods"));
+
+    /* Show defaults in menu items */
+    switch (termomix.cursor_type){
+        case VTE_CURSOR_SHAPE_BLOCK:
+            gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_cursor_block), TRUE);
+            break;
+        case VTE_CURSOR_SHAPE_UNDERLINE:
+            gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_cursor_underline), TRUE);
+            break;
+        case VTE_CURSOR_SHAPE_IBEAM:
+            gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_cursor_ibeam), TRUE);
+    }
+
+    termomix.open_link_separator=gtk_separator_menu_item_new();
+
+    termomix.menu=gtk_menu_new();
+
+    /* Add items to popup menu */
+    gtk_menu_shell_append(GTK_MENU_SHELL(termomix.menu), termomix.item_open_link);
+    gtk_menu_shell_append(GTK_MENU_SHELL(termomix.menu), termomix.item_copy_link);
+    gtk_menu_shell_append(GTK_MENU_SHELL(termomix.menu), termomix.open_link_separator);
+    gtk_menu_shell_append(GTK_MENU_SHELL(termomix.menu), item_copy);
+    gtk_menu_shell_append(GTK_MENU_SHELL(termomix.menu), item_paste);
+    gtk_menu_shell_append(GTK_MENU_SHELL(termomix.menu), item_paste_file);
+    gtk_menu_shell_append(GTK_MENU_SHELL(termomix.menu), item_search);
+    gtk_menu_shell_append(GTK_MENU_SHELL(termomix.menu), item_export);
+    gtk_menu_shell_append(GTK_MENU_SHELL(termomix.menu), item_new_window);
+    gtk_menu_shell_append(GTK_MENU_SHELL(termomix.menu), termomix.item_clear_background);
+    gtk_menu_shell_append(GTK_MENU_SHELL(termomix.menu), gtk_separator_menu_item_new());
+    gtk_menu_shell_append(GTK_MENU_SHELL(termomix.menu), item_options);
+
+    termomix.im_menu=gtk_menu_new();
+    options_menu=gtk_menu_new();
+    cursor_menu=gtk_menu_new();
+
+    gtk_menu_shell_append(GTK_MENU_SHELL(options_menu), item_opacity_menu);
+    gtk_menu_shell_append(GTK_MENU_SHELL(options_menu), item_set_title);
+    gtk_menu_shell_append(GTK_MENU_SHELL(options_menu), item_select_colors);
+    gtk_menu_shell_append(GTK_MENU_SHELL(options_menu), item_select_font);
+    gtk_menu_shell_append(GTK_MENU_SHELL(options_menu), item_select_background);
+    gtk_menu_shell_append(GTK_MENU_SHELL(options_menu), item_cursor);
+    gtk_menu_shell_append(GTK_MENU_SHELL(options_menu), item_input_methods);
+    
+    gtk_menu_shell_append(GTK_MENU_SHELL(cursor_menu), item_cursor_block);
+    gtk_menu_shell_append(GTK_MENU_SHELL(cursor_menu), item_cursor_underline);
+    gtk_menu_shell_append(GTK_MENU_SHELL(cursor_menu), item_cursor_ibeam);
+
+    gtk_menu_item_set_submenu(GTK_MENU_ITEM(item_input_methods), termomix.im_menu);
+    gtk_menu_item_set_submenu(GTK_MENU_ITEM(item_options), options_menu);
+    gtk_menu_item_set_submenu(GTK_MENU_ITEM(item_cursor), cursor_menu);
+
+    /* ... and finally assign callbacks to menuitems */
+    g_signal_connect(G_OBJECT(action_select_font), "activate",
+            G_CALLBACK(termomix_font_dialog), NULL);
+    g_signal_connect(G_OBJECT(action_select_background), "activate",
+            G_CALLBACK(termomix_select_background_dialog), NULL);
+    g_signal_connect(G_OBJECT(action_copy), "activate",
+            G_CALLBACK(termomix_copy), NULL);
+    g_signal_connect(G_OBJECT(action_paste), "activate",
             G_CALLBACK(termomix_paste), NULL);
+    g_signal_connect(G_OBJECT(action_paste_file), "activate",
+            G_CALLBACK(termomix_paste_file_dialog), NULL);
+    g_signal_connect(G_OBJECT(action_new_window), "activate",
+            G_CALLBACK(termomix_new_window), NULL);
+    g_signal_connect(G_OBJECT(action_search), "activate",
+            G_CALLBACK(termomix_search), NULL);
+    g_signal_connect(G_OBJECT(action_export), "activate",
+            G_CALLBACK(termomix_export_dialog), NULL);
     g_signal_connect(G_OBJECT(action_select_colors), "activate",
             G_CALLBACK(termomix_color_dialog), NULL);
     g_signal_connect(G_OBJECT(action_opacity), "activate",
@@ -945,279 +3103,3662 @@ static void termomix_init_popup() {
     g_signal_connect(G_OBJECT(action_clear_background), "activate",
             G_CALLBACK(termomix_clear), NULL);
 
-    gtk_widget_show_all(termomix.menu);
+    gtk_widget_show_all(termomix.menu);
+
+    /* We don't want to see this if there's no background image */
+    if (!termomix.background) {
+        gtk_widget_hide(termomix.item_clear_background);
+    }
+
+    termomix_profile_end(PROFILE_POPUP);
+}
+
+
+static void termomix_destroy() {
+    termomix_config_done();
+    termomix_log_done();
+    termomix_latency_report();
+    termomix_frame_report();
+
+    /* A decode, prewarm or search index still running is of no use anymore */
+    if (termomix.bg_decoder) {
+        g_thread_pool_free(termomix.bg_decoder, TRUE, FALSE);
+        termomix.bg_decoder = NULL;
+    }
+    if (termomix.prewarmer) {
+        g_thread_pool_free(termomix.prewarmer, TRUE, FALSE);
+        termomix.prewarmer = NULL;
+    }
+    if (termomix.indexer) {
+        g_thread_pool_free(termomix.indexer, TRUE, FALSE);
+        termomix.indexer = NULL;
+    }
+
+    if (termomix.daemon_service) {
+        g_socket_service_stop(termomix.daemon_service);
+        g_unlink(termomix.daemon_socket);
+        g_free(termomix.daemon_socket);
+    }
+    termomix_metrics_stop();
+    termomix_control_stop();
+
+    g_key_file_free(termomix.cfg);
+    g_hash_table_destroy(termomix.config_dirty);
+
+    pango_font_description_free(termomix.font);
+
+    if (termomix.background)
+        free(termomix.background);
+
+    free(termomix.configfile);
+
+    gtk_main_quit();
+}
+
+
+static void termomix_set_size(gint columns, gint rows) {
+    struct terminal *term = termomix.term;
+    gint pad_x, pad_y;
+    gint char_width, char_height;
+    guint width, height;
+    bool resized = term->resized;
+
+    /* Mayhaps an user resize happened. Check if row and columns have changed */
+    if (term->resized) {
+        term->columns=vte_terminal_get_column_count(VTE_TERMINAL(term->vte));
+        term->rows=vte_terminal_get_row_count(VTE_TERMINAL(term->vte));
+        term->resized=FALSE;
+    }
+
+    gtk_widget_style_get(term->vte, "inner-border", &term->border, NULL);
+    pad_x = term->border->left + term->border->right;
+    pad_y = term->border->top + term->border->bottom;
+    char_width = vte_terminal_get_char_width(VTE_TERMINAL(term->vte));
+    char_height = vte_terminal_get_char_height(VTE_TERMINAL(term->vte));
+
+    width = pad_x + (char_width * term->columns);
+    height = pad_y + (char_height * term->rows);
+
+    /* Same grid and same char metrics: the window already has the size we
+     * would ask for, and asking again is a round trip with the WM */
+    if (!resized && width == term->width && height == term->height) {
+        return;
+    }
+    term->width = width;
+    term->height = height;
+
+    /* GTK ignores resizes for maximized windows, so we don't need no check if
+     * it's maximized or not
+     */
+    gtk_window_resize(GTK_WINDOW(term->window), term->width, term->height);
+
+    /* The number of lines that fit the budget depends on the width */
+    termomix_set_scrollback();
+}
+
+
+/* Turn the scrollback budgets into a number of lines for every terminal. A
+ * terminal gets its own budget, or its share of the global one if that's
+ * smaller, so wide terminals keep fewer lines. VTE doesn't tell how much it
+ * really uses, so this is a line cap from an estimate, not a limit */
+static void termomix_set_scrollback() {
+    guint count = g_list_length(termomix.terminals);
+    guint64 budget = termomix.scrollback_bytes;
+    GList *l;
+
+    if (count && termomix.scrollback_total_bytes/count < budget) {
+        budget = termomix.scrollback_total_bytes/count;
+    }
+
+    for (l = termomix.terminals; l != NULL; l = l->next) {
+        struct terminal *term = (struct terminal *)l->data;
+        glong lines = budget / (MAX(term->columns, 1) * SCROLLBACK_CELL_BYTES);
+
+        vte_terminal_set_scrollback_lines(VTE_TERMINAL(term->vte),
+                MAX(lines, SCROLLBACK_MIN_LINES));
+    }
+}
+
+
+/* The colors and opacity are shared, so all the terminals follow them */
+static void termomix_set_colors() {
+    GdkColor white={0, 255, 255, 255};
+    GList *l;
+
+    for (l = termomix.terminals; l != NULL; l = l->next) {
+        struct terminal *term = (struct terminal *)l->data;
+        if (termomix.has_rgba) {
+            /* This is needed for set_opacity to have effect */
+            vte_terminal_set_color_background(VTE_TERMINAL(term->vte), &white);
+            vte_terminal_set_opacity(VTE_TERMINAL(term->vte),
+                    (termomix.opacity_level*65535)/99); /* 0-99 value */
+        }
+        vte_terminal_set_colors(VTE_TERMINAL(term->vte), &termomix.forecolor,
+                &termomix.backcolor, termomix.palette, PALETTE_SIZE);
+    }
+}
+
+
+/* The font is shared, so all the terminals follow it. Their windows keep
+ * the same number of columns and rows */
+static void termomix_set_font() {
+    struct terminal *current = termomix.term;
+    GList *l;
+
+    /* Whatever Ctrl+/- steps are pending were relative to the old font */
+    if (termomix.font_source) {
+        g_source_remove(termomix.font_source);
+        termomix.font_source = 0;
+    }
+    termomix.font_size_pending = 0;
+
+    termomix_font_cache(termomix.font);
+    for (l = termomix.terminals; l != NULL; l = l->next) {
+        struct terminal *term = (struct terminal *)l->data;
+        vte_terminal_set_font(VTE_TERMINAL(term->vte), termomix.font);
+        termomix.term = term;
+        termomix_set_size(term->columns, term->rows);
+    }
+    termomix.term = current;
+
+    /* Fallback fonts depend on the main one */
+    termomix_prewarm_start();
+}
+
+
+/* Build the argv of the -x/-e command. Returns false, after telling the user
+ * why, if there's nothing we can run */
+static bool termomix_get_command(gchar ***command_argv) {
+    int command_argc;
+    GError *gerror = NULL;
+    gchar *path;
+    gboolean parsed;
+
+    if(option_execute) {
+        /* -x option */
+        parsed = g_shell_parse_argv(option_execute, &command_argc, command_argv,
+                &gerror);
+    } else {
+        /* -e option - last in the command line */
+        gchar *command_joined;
+        /* the xterm -e command takes all extra arguments */
+        command_joined = g_strjoinv(" ", option_xterm_args);
+        parsed = g_shell_parse_argv(command_joined, &command_argc, command_argv,
+                &gerror);
+        g_free(command_joined);
+    }
+    g_strfreev(option_xterm_args); option_xterm_args=NULL;
+
+    if (!parsed) {
+        switch (gerror->code) {
+            case G_SHELL_ERROR_EMPTY_STRING:
+                termomix_error("Empty exec string");
+                break;
+            case G_SHELL_ERROR_BAD_QUOTING: 
+                termomix_error("Cannot parse command line arguments: mangled quoting");
+                break;
+            case G_SHELL_ERROR_FAILED:
+                termomix_error("Error in exec option command line arguments");
+        }
+        g_error_free(gerror);
+        return false;
+    }
+
+    /* Check if the command is valid */
+    if (termomix.command_thread) {
+        path=g_thread_join(termomix.command_thread);
+        termomix.command_thread = NULL;
+    } else {
+        path=g_find_program_in_path((*command_argv)[0]);
+    }
+    if (!path) {
+        termomix_error("%s binary not found", (*command_argv)[0]);
+        g_strfreev(*command_argv); *command_argv=NULL;
+        return false;
+    }
+    free(path);
+
+    return true;
+}
+
+
+/* Create a terminal in a window that isn't shown yet, and make it the current
+ * one. Nothing runs in it until termomix_spawn_shell() or a fork */
+static struct terminal *termomix_create_terminal() {
+    struct terminal *term;
+
+    term = g_new0( struct terminal, 1 );
+    term->id = ++termomix.next_id;
+    term->window=gtk_window_new(GTK_WINDOW_TOPLEVEL);
+    gtk_window_set_title(GTK_WINDOW(term->window), "termomix");
+    gtk_window_set_has_resize_grip(GTK_WINDOW(term->window), false);
+    if (termomix.has_rgba) {
+        gtk_widget_set_visual(term->window,
+                gdk_screen_get_rgba_visual(gtk_widget_get_screen(term->window)));
+    }
+
+    /* Default terminal size*/
+    term->columns = DEFAULT_COLUMNS;
+    term->rows = DEFAULT_ROWS;
+    term->resized=FALSE;
+
+    term->vbox=gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
+    term->hbox=gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
+    termomix_profile_begin(PROFILE_VTE);
+    term->vte=vte_terminal_new();
+    termomix_profile_end(PROFILE_VTE);
+
+    termomix.terminals = g_list_append(termomix.terminals, term);
+    termomix.term = term;
+
+    /* Init vte */
+    if (termomix.match_regexp) {
+        vte_terminal_match_add_gregex(VTE_TERMINAL(term->vte),
+                termomix.match_regexp, 0);
+    }
+    vte_terminal_set_mouse_autohide(VTE_TERMINAL(term->vte), TRUE);
+    
+    gtk_box_pack_start(GTK_BOX(term->hbox), term->vte, TRUE, TRUE, 0);
+
+    gtk_box_pack_start(GTK_BOX(term->vbox), term->hbox, TRUE, TRUE, 0);
+    gtk_container_add(GTK_CONTAINER(term->window), term->vbox); 
+
+    g_signal_connect(G_OBJECT(term->window), "delete_event",
+            G_CALLBACK(termomix_delete_event), term);
+    g_signal_connect(G_OBJECT(term->window), "destroy",
+            G_CALLBACK(termomix_destroy_window), term);
+    g_signal_connect(G_OBJECT(term->window), "key-press-event",
+            G_CALLBACK(termomix_key_press), term);
+    g_signal_connect(G_OBJECT(term->window), "configure-event",
+            G_CALLBACK(termomix_resized_window), term);
+    g_signal_connect(G_OBJECT(term->window), "map-event",
+            G_CALLBACK(termomix_map_event), term);
+
+    /* vte signals */
+    g_signal_connect(G_OBJECT(term->vte), "increase-font-size",
+            G_CALLBACK(termomix_increase_font), term);
+    g_signal_connect(G_OBJECT(term->vte), "decrease-font-size",
+            G_CALLBACK(termomix_decrease_font), term);
+    g_signal_connect(G_OBJECT(term->vte), "commit",
+            G_CALLBACK(termomix_pty_commit), term);
+    g_signal_connect(G_OBJECT(term->vte), "contents-changed",
+            G_CALLBACK(termomix_pty_parsed), term);
+    g_signal_connect(G_OBJECT(term->vte), "cursor-moved",
+            G_CALLBACK(termomix_pty_parsed), term);
+    g_signal_connect_after(G_OBJECT(term->vte), "size-allocate",
+            G_CALLBACK(termomix_pty_resize), term);
+    g_signal_connect_after(G_OBJECT(term->vte), "size-allocate",
+            G_CALLBACK(termomix_bg_resize), term);
+    g_signal_connect(G_OBJECT(term->vte), "button-press-event",
+            G_CALLBACK(termomix_button_press), term);
+    g_signal_connect(G_OBJECT(term->vte), "motion-notify-event",
+            G_CALLBACK(termomix_motion_notify), term);
+
+    if (!termomix.menu) {
+        g_signal_connect_after(G_OBJECT(term->vte), "draw",
+                G_CALLBACK(termomix_first_draw), NULL);
+    }
+
+    if (termomix.latency_log) {
+        g_signal_connect_after(G_OBJECT(term->vte), "draw",
+                G_CALLBACK(termomix_latency_draw), term);
+    }
+
+    g_signal_connect(G_OBJECT(term->vte), "contents-changed",
+            G_CALLBACK(termomix_snapshot_changed), term);
+
+    /* For FRAME_STATS_ENV and the metrics socket */
+    g_signal_connect(G_OBJECT(term->vte), "draw",
+            G_CALLBACK(termomix_frame_begin), NULL);
+    g_signal_connect_after(G_OBJECT(term->vte), "draw",
+            G_CALLBACK(termomix_frame_draw), NULL);
+
+    if (option_profile_startup) {
+        g_signal_connect(G_OBJECT(term->vte), "draw",
+                G_CALLBACK(termomix_profile_draw), NULL);
+        g_signal_connect(G_OBJECT(term->vte), "contents-changed",
+                G_CALLBACK(termomix_profile_contents_changed), NULL);
+    }
+
+    termomix_profile_begin(PROFILE_FONT);
+    if (termomix.font_thread) {
+        g_thread_join(termomix.font_thread);
+        termomix.font_thread = NULL;
+    }
+    vte_terminal_set_font(VTE_TERMINAL(term->vte), termomix.font);
+    termomix_profile_end(PROFILE_FONT);
+    /* Set size before showing the widgets but after setting the font */
+    termomix_set_size(term->columns, term->rows);
+
+    gtk_widget_show_all(term->vbox);
+
+    /* Configuration for the newly created terminal */
+    GdkColor white={0, 255, 255, 255};
+    vte_terminal_set_color_background(VTE_TERMINAL (term->vte), &white);
+    vte_terminal_set_backspace_binding(VTE_TERMINAL(term->vte),
+            VTE_ERASE_ASCII_DELETE);
+    vte_terminal_set_colors(VTE_TERMINAL(term->vte), &termomix.forecolor,
+            &termomix.backcolor, termomix.palette, PALETTE_SIZE);
+    if (termomix.has_rgba) {
+        vte_terminal_set_opacity(VTE_TERMINAL (term->vte),
+                (termomix.opacity_level*65535)/99); /* 0-99 value */
+    }
+
+    if (termomix.background) {
+        termomix_set_bgimage(termomix.background);
+    }
+
+    if (termomix.word_chars) {
+        vte_terminal_set_word_chars( VTE_TERMINAL (term->vte),
+                termomix.word_chars );
+    }
+
+    /* Change cursor */    
+    vte_terminal_set_cursor_shape (VTE_TERMINAL(term->vte),
+            termomix.cursor_type);
+
+    return term;
+}
+
+
+/******* PTY ********/
+
+/* termomix owns the PTY master instead of VTE. A thread per terminal reads
+ * the child output into a single-producer/single-consumer ring, and the main
+ * loop hands it to VTE one batch at a time. vte_terminal_feed() only queues
+ * the bytes, VTE parses them later from its own timeout, so the next batch
+ * waits until VTE has shown the last one. While VTE is behind the ring fills
+ * up, the reader stops and the child blocks on its writes, instead of VTE's
+ * queue growing without bound. Keystrokes come from the VTE "commit" signal
+ * and are written straight to the PTY, or queued while it's full */
+
+/* Add the source that runs termomix_pty_feed(), right away or after delay
+ * ms. Only called by whoever set reader->scheduled, from the reader thread
+ * too: the lock keeps the source from running, and clearing feed_source,
+ * before its id is stored */
+static void termomix_pty_add_feed(struct terminal *term, guint delay) {
+    struct pty_reader *reader = term->reader;
+
+    g_mutex_lock(&reader->lock);
+    if (delay) {
+        reader->feed_source = g_timeout_add_full(G_PRIORITY_DEFAULT_IDLE,
+                delay, termomix_pty_feed, term, NULL);
+    } else {
+        reader->feed_source = g_idle_add_full(G_PRIORITY_DEFAULT_IDLE,
+                termomix_pty_feed, term, NULL);
+    }
+    g_mutex_unlock(&reader->lock);
+}
+
+
+/* Called by the reader thread, gap is the time since the previous read */
+static void termomix_pty_schedule_feed(struct terminal *term, gint64 gap) {
+    struct pty_reader *reader = term->reader;
+
+    /* Output went quiet, show what comes next right away */
+    if (gap > FLOOD_QUIET) {
+        g_atomic_int_set(&reader->frame_interval, 0);
+    }
+
+    if (g_atomic_int_compare_and_exchange(&reader->scheduled, 0, 1)) {
+        termomix_pty_add_feed(term, 0);
+    }
+}
+
+
+/* Milliseconds between the frames drawn during a flood */
+static guint termomix_pty_frame_interval(struct terminal *term) {
+    GdkFrameClock *clock;
+    gint64 refresh = G_USEC_PER_SEC/60;
+
+    if (termomix.flood_fps > 0)
+        return MAX(1000/termomix.flood_fps, 1);
+
+    clock = gtk_widget_get_frame_clock(term->vte);
+    if (clock) {
+        gdk_frame_clock_get_refresh_info(clock,
+                gdk_frame_clock_get_frame_time(clock), &refresh, NULL);
+    }
+    return MAX(refresh/1000, 1);
+}
+
+
+/* Measure the output rate and start or stop pacing the frames */
+static void termomix_pty_flood(struct terminal *term, gsize fed) {
+    struct pty_reader *reader = term->reader;
+    gint64 now = g_get_monotonic_time();
+    guint interval = 0;
+
+    reader->rate_bytes += fed;
+    if (now - reader->rate_start < FLOOD_WINDOW)
+        return;
+
+    if (termomix.frame_pacing && reader->rate_bytes*G_USEC_PER_SEC >=
+            termomix.flood_rate*(guint64)(now - reader->rate_start)) {
+        interval = termomix_pty_frame_interval(term);
+    }
+    g_atomic_int_set(&reader->frame_interval, interval);
+    reader->rate_start = now;
+    reader->rate_bytes = 0;
+}
+
+
+static gpointer termomix_pty_read_thread(gpointer data) {
+    struct terminal *term = (struct terminal *)data;
+    struct pty_reader *reader = term->reader;
+    GPollFD fds[2];
+    guint head, tail, start, room;
+    gint64 now, gap;
+    ssize_t n;
+
+    fds[0].fd = reader->fd;
+    fds[0].events = G_IO_IN|G_IO_HUP|G_IO_ERR;
+    g_cancellable_make_pollfd(reader->cancel, &fds[1]);
+
+    while (!g_cancellable_is_cancelled(reader->cancel)) {
+        head = reader->head;
+        tail = g_atomic_int_get(&reader->tail);
+
+        /* Full: stop reading, so the child blocks until VTE catches up */
+        if (head - tail == PTY_RING_SIZE) {
+            g_mutex_lock(&reader->lock);
+            while (g_atomic_int_get(&reader->tail) == tail &&
+                    !g_cancellable_is_cancelled(reader->cancel)) {
+                g_cond_wait(&reader->space, &reader->lock);
+            }
+            g_mutex_unlock(&reader->lock);
+            continue;
+        }
+
+        if (g_poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (fds[1].revents)
+            break;
+
+        start = head & (PTY_RING_SIZE-1);
+        room = MIN(PTY_RING_SIZE - (head - tail), PTY_RING_SIZE - start);
+        n = read(reader->fd, reader->ring + start, room);
+        if (n < 0 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        if (n <= 0) {
+            /* EIO once every slave side is closed */
+            g_atomic_int_set(&reader->eof, 1);
+            termomix_pty_schedule_feed(term, G_MAXINT64);
+            break;
+        }
+
+        if (reader->log) {
+            termomix_log_append(reader->log, reader->ring + start, n);
+        }
+        if (reader->record) {
+            termomix_record_append(reader, reader->ring + start, n);
+        }
+        reader->read_bytes += n;
+
+        now = g_get_monotonic_time();
+        g_mutex_lock(&reader->lock);
+        gap = now - reader->read_time;
+        reader->read_time = now;
+        g_mutex_unlock(&reader->lock);
+        g_atomic_int_set(&reader->head, head + n);
+        termomix_pty_schedule_feed(term, gap);
+    }
+
+    g_cancellable_release_fd(reader->cancel);
+    return NULL;
+}
+
+
+/* Hand VTE the next batch of output, or give up the schedule if there's
+ * none. The next batch is scheduled by termomix_pty_parsed() */
+static gboolean termomix_pty_feed(gpointer data) {
+    struct terminal *term = (struct terminal *)data;
+    struct pty_reader *reader = term->reader;
+    guint interval = g_atomic_int_get(&reader->frame_interval);
+    guint head, tail, start, len;
+    gsize fed = 0, batch = PTY_FEED_BATCH;
+    gint64 read_time;
+    guint wait;
+
+    g_mutex_lock(&reader->lock);
+    reader->feed_source = 0;
+    g_mutex_unlock(&reader->lock);
+
+    /* Paced, a batch is what VTE parses in three quarters of a frame, so
+     * one frame draws it all and has time left to draw */
+    if (interval) {
+        batch = CLAMP(reader->drain_rate*interval*3/4000, PTY_FEED_BATCH,
+                PTY_FEED_MAX);
+    }
+
+    while (fed < batch) {
+        head = g_atomic_int_get(&reader->head);
+        tail = reader->tail;
+        if (head == tail)
+            break;
+
+        start = tail & (PTY_RING_SIZE-1);
+        len = MIN(MIN(head - tail, PTY_RING_SIZE - start), batch - fed);
+        vte_terminal_feed(VTE_TERMINAL(term->vte), reader->ring + start, len);
+        termomix_pty_modes(reader, reader->ring + start, len);
+        g_atomic_int_set(&reader->tail, tail + len);
+        fed += len;
+
+        if (head - tail == PTY_RING_SIZE) {
+            g_mutex_lock(&reader->lock);
+            g_cond_signal(&reader->space);
+            g_mutex_unlock(&reader->lock);
+        }
+    }
+
+    if (fed) {
+        if (termomix.latency_log) {
+            g_mutex_lock(&reader->lock);
+            read_time = reader->read_time;
+            g_mutex_unlock(&reader->lock);
+            termomix_latency_echo(term, read_time);
+        }
+        termomix_pty_flood(term, fed);
+        termomix_histogram_add(&termomix.metrics.feed_batch, fed);
+
+        /* Keep the schedule until VTE has parsed it. A batch that changes
+         * nothing on screen emits nothing, hence the timeout, short unless
+         * the batch takes VTE long to parse */
+        wait = PTY_PARSE_WAIT;
+        if (reader->drain_rate) {
+            wait += MIN(fed*2000/reader->drain_rate, PTY_PARSE_MAX);
+        }
+        reader->parsing = fed;
+        reader->fed_time = g_get_monotonic_time();
+        reader->parse_source = g_timeout_add(wait,
+                termomix_pty_parse_timeout, term);
+        return FALSE;
+    }
+
+    g_atomic_int_set(&reader->scheduled, 0);
+    /* The reader may have added more right before we cleared the flag */
+    if (g_atomic_int_get(&reader->head) != reader->tail &&
+            g_atomic_int_compare_and_exchange(&reader->scheduled, 0, 1)) {
+        termomix_pty_add_feed(term, 0);
+        return FALSE;
+    }
+
+    if (g_atomic_int_get(&reader->eof)) {
+        g_atomic_int_set(&reader->eof, 0);
+        termomix_eof(term->vte, term);
+    }
+
+    return FALSE;
+}
+
+
+/* "contents-changed" and "cursor-moved" are emitted once VTE has processed
+ * its queue, the last batch is parsed */
+static void termomix_pty_parsed(VteTerminal *vte, gpointer data) {
+    struct terminal *term = (struct terminal *)data;
+    struct pty_reader *reader = term->reader;
+
+    gint64 took;
+
+    if (!reader || !reader->parsing)
+        return;
+
+    took = MAX(g_get_monotonic_time() - reader->fed_time, 1);
+    reader->drain_rate = (reader->drain_rate*3 +
+            reader->parsing*G_USEC_PER_SEC/took)/4;
+
+    g_source_remove(reader->parse_source);
+    termomix_pty_next(term);
+}
+
+
+static gboolean termomix_pty_parse_timeout(gpointer data) {
+    struct terminal *term = (struct terminal *)data;
+
+    term->reader->parse_source = 0;
+    termomix_pty_next(term);
+
+    return FALSE;
+}
+
+
+/* Schedule the batch after the one VTE has just parsed. Paced, no more than
+ * one batch per frame, sized by termomix_pty_feed() */
+static void termomix_pty_next(struct terminal *term) {
+    struct pty_reader *reader = term->reader;
+    guint interval = g_atomic_int_get(&reader->frame_interval);
+    gint64 elapsed = (g_get_monotonic_time() - reader->fed_time)/1000;
+
+    reader->parsing = 0;
+    reader->parse_source = 0;
+    termomix_pty_add_feed(term, elapsed < (gint64)interval ?
+            interval - elapsed : 0);
+}
+
+
+/* Write all of text to the PTY. What doesn't fit is queued and written from
+ * a G_IO_OUT watch, behind anything queued before */
+static void termomix_pty_write(struct terminal *term, const gchar *text,
+        gsize size) {
+    struct pty_reader *reader = term->reader;
+    gsize written = 0;
+    ssize_t n;
+
+    if (reader->output_watch) {
+        g_string_append_len(reader->output, text, size);
+        return;
+    }
+
+    while (written < size) {
+        n = write(reader->fd, text + written, size - written);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                return;
+            g_string_append_len(reader->output, text + written,
+                    size - written);
+            reader->output_watch = g_unix_fd_add(reader->fd, G_IO_OUT,
+                    termomix_pty_flush, term);
+            break;
+        }
+        written += n;
+    }
+    termomix.metrics.pty_written += written;
+}
+
+
+/* The PTY can take more of the queued input */
+static gboolean termomix_pty_flush(gint fd, GIOCondition condition,
+        gpointer data) {
+    struct terminal *term = (struct terminal *)data;
+    struct pty_reader *reader = term->reader;
+    ssize_t n;
+
+    n = write(fd, reader->output->str, reader->output->len);
+    if (n < 0) {
+        if (errno == EINTR || errno == EAGAIN)
+            return TRUE;
+        g_string_truncate(reader->output, 0);
+        reader->output_watch = 0;
+        return FALSE;
+    }
+
+    termomix.metrics.pty_written += n;
+    g_string_erase(reader->output, 0, n);
+    if (reader->output->len)
+        return TRUE;
+
+    reader->output_watch = 0;
+    return FALSE;
+}
+
+
+static void termomix_pty_commit(VteTerminal *vte, gchar *text, guint size,
+        gpointer data) {
+    struct terminal *term = (struct terminal *)data;
+
+    if (!term->reader)
+        return;
+
+    termomix_pty_write(term, text, size);
+
+    if (termomix.latency_log) {
+        termomix_latency_write(term);
+    }
+    if (termomix.metrics.key_time) {
+        termomix_histogram_add(&termomix.metrics.key_latency,
+                (g_get_monotonic_time() - termomix.metrics.key_time)/1e6);
+        termomix.metrics.key_time = 0;
+    }
+}
+
+
+/* Follow the terminal modes termomix itself needs to know about. A sequence
+ * split between two batches is missed */
+static void termomix_pty_modes(struct pty_reader *reader, const gchar *data,
+        gsize len) {
+    const gchar *p = data, *end = data + len;
+
+    while ((p = memchr(p, '\033', end - p))) {
+        if (end - p >= 8 && memcmp(p, "\033[?2004", 7) == 0) {
+            if (p[7] == 'h') {
+                reader->bracketed_paste = true;
+            } else if (p[7] == 'l') {
+                reader->bracketed_paste = false;
+            }
+        } else if ((end - p >= 2 && p[1] == 'c') ||
+                (end - p >= 4 && memcmp(p, "\033[3J", 4) == 0)) {
+            reader->history_resets++;
+        }
+        p++;
+    }
+}
+
+
+/* Keep the PTY window size in sync with the VTE grid. A drag or a tiling
+ * WM relayout allocates a stream of sizes, and each TIOCSWINSZ makes vim or
+ * less redraw the whole screen. The first change goes through, then at most
+ * one per PTY_RESIZE_DELAY, the last one with the size things settled at */
+static void termomix_pty_resize(GtkWidget *widget, GtkAllocation *allocation,
+        gpointer data) {
+    struct terminal *term = (struct terminal *)data;
+
+    if (!term->reader || term->reader->resize_source)
+        return;
+
+    if (termomix_pty_set_size(term)) {
+        term->reader->resize_source = g_timeout_add(PTY_RESIZE_DELAY,
+                termomix_pty_resized, term);
+    }
+}
+
+
+/* Give the PTY the size of the VTE grid. False if it had it already */
+static bool termomix_pty_set_size(struct terminal *term) {
+    glong columns, rows;
+
+    columns = vte_terminal_get_column_count(VTE_TERMINAL(term->vte));
+    rows = vte_terminal_get_row_count(VTE_TERMINAL(term->vte));
+    if (columns == term->reader->columns && rows == term->reader->rows) {
+        return false;
+    }
+
+    vte_pty_set_size(term->reader->pty, rows, columns, NULL);
+    term->reader->columns = columns;
+    term->reader->rows = rows;
+    return true;
+}
+
+
+static gboolean termomix_pty_resized(gpointer data) {
+    struct terminal *term = (struct terminal *)data;
+
+    /* Still resizing, hold the next one back as well */
+    if (termomix_pty_set_size(term)) {
+        return TRUE;
+    }
+    term->reader->resize_source = 0;
+
+    return FALSE;
+}
+
+
+static void termomix_pty_child_watch(GPid pid, gint status, gpointer data) {
+    struct terminal *term = (struct terminal *)data;
+
+    term->reader->child_watch = 0;
+    g_spawn_close_pid(pid);
+    termomix_child_exited(term->vte, term);
+}
+
+
+/* Collect a child hung up by termomix_pty_close() */
+static void termomix_pty_reap(GPid pid, gint status, gpointer data) {
+    g_spawn_close_pid(pid);
+}
+
+
+/* Run argv in a new PTY attached to term */
+static bool termomix_spawn(struct terminal *term, const gchar *cwd,
+        gchar **argv, GSpawnFlags flags) {
+    struct pty_reader *reader;
+    GError *gerror=NULL;
+    VtePty *pty;
+    gchar **envp, *id;
+
+    termomix_profile_begin(PROFILE_FORK);
+
+    pty = vte_pty_new(VTE_PTY_DEFAULT, &gerror);
+    if (!pty) {
+        termomix_error("Cannot open a PTY: %s", gerror->message);
+        g_error_free(gerror);
+        return false;
+    }
+    vte_pty_set_size(pty, term->rows, term->columns, NULL);
+
+    /* Where termomix @ finds this window */
+    envp = g_get_environ();
+    if (termomix.control_socket) {
+        id = g_strdup_printf("%u", term->id);
+        envp = g_environ_setenv(envp, CONTROL_SOCKET_ENV,
+                termomix.control_socket, TRUE);
+        envp = g_environ_setenv(envp, CONTROL_WINDOW_ENV, id, TRUE);
+        g_free(id);
+    } else {
+        envp = g_environ_unsetenv(envp, CONTROL_SOCKET_ENV);
+        envp = g_environ_unsetenv(envp, CONTROL_WINDOW_ENV);
+    }
+
+    if (!g_spawn_async(cwd, argv, envp, flags|G_SPAWN_DO_NOT_REAP_CHILD,
+            (GSpawnChildSetupFunc)vte_pty_child_setup, pty, &term->pid,
+            &gerror)) {
+        termomix_error("Couldn't exec \"%s\": %s", argv[0], gerror->message);
+        g_error_free(gerror);
+        g_strfreev(envp);
+        g_object_unref(pty);
+        return false;
+    }
+    g_strfreev(envp);
+
+    reader = g_new0(struct pty_reader, 1);
+    reader->pty = pty;
+    reader->fd = vte_pty_get_fd(pty);
+    /* Pastes and input the PTY has no room for wait for G_IO_OUT instead
+     * of blocking */
+    fcntl(reader->fd, F_SETFL, fcntl(reader->fd, F_GETFL) | O_NONBLOCK);
+    reader->columns = term->columns;
+    reader->rows = term->rows;
+    reader->ring = g_malloc(PTY_RING_SIZE);
+    reader->output = g_string_new(NULL);
+    reader->cancel = g_cancellable_new();
+    g_mutex_init(&reader->lock);
+    g_cond_init(&reader->space);
+    term->reader = reader;
+
+    if (termomix.log_file && *termomix.log_file) {
+        reader->log = termomix_log_open(termomix.log_file, term->pid, false);
+    }
+    if (term->record) {
+        termomix_record_open(term, term->record);
+        g_free(term->record);
+        term->record = NULL;
+    }
+
+    reader->child_watch = g_child_watch_add(term->pid,
+            termomix_pty_child_watch, term);
+    reader->thread = g_thread_new("termomix-pty", termomix_pty_read_thread,
+            term);
+
+    termomix_profile_end(PROFILE_FORK);
+    termomix_profile_begin(PROFILE_FIRST_OUTPUT);
+
+    return true;
+}
+
+
+/* Stop the reader thread and hang up the child */
+static void termomix_pty_close(struct terminal *term) {
+    struct pty_reader *reader = term->reader;
+
+    if (!reader)
+        return;
+
+    if (reader->child_watch) {
+        g_source_remove(reader->child_watch);
+        kill(term->pid, SIGHUP);
+        g_child_watch_add(term->pid, termomix_pty_reap, NULL);
+    }
+
+    g_cancellable_cancel(reader->cancel);
+    g_mutex_lock(&reader->lock);
+    g_cond_signal(&reader->space);
+    g_mutex_unlock(&reader->lock);
+    g_thread_join(reader->thread);
+    termomix.metrics.pty_read_closed += reader->read_bytes;
+
+    if (reader->log) {
+        termomix_log_close(reader->log);
+    }
+    if (reader->record) {
+        termomix_log_close(reader->record);
+    }
+
+    if (reader->feed_source) {
+        g_source_remove(reader->feed_source);
+    }
+    if (reader->parse_source) {
+        g_source_remove(reader->parse_source);
+    }
+    if (reader->output_watch) {
+        g_source_remove(reader->output_watch);
+    }
+    if (reader->resize_source) {
+        g_source_remove(reader->resize_source);
+    }
+
+    g_object_unref(reader->pty);
+    g_object_unref(reader->cancel);
+    g_mutex_clear(&reader->lock);
+    g_cond_clear(&reader->space);
+    g_free(reader->ring);
+    g_string_free(reader->output, TRUE);
+    g_free(reader);
+    term->reader = NULL;
+}
+
+
+/******* Session log ********/
+
+/* With log_file or --log the raw PTY output of every terminal is copied to
+ * a file. The PTY reader thread only appends to a buffer; a writer thread
+ * per terminal strips escape sequences, compresses and writes it in large
+ * batches, so a slow disk never reaches the main loop. A full buffer makes
+ * the reader wait, and with it the shell, instead of losing output */
+
+/* raw logs, for --record, are written as they come to a new file */
+static struct session_log *termomix_log_open(const gchar *pattern, GPid pid,
+        bool raw) {
+    struct session_log *log = g_new0(struct session_log, 1);
+    gchar pidstr[16], datestr[32];
+    GDateTime *now;
+    GString *path;
+    const gchar *p;
+
+    /* %p is the pid of the shell and %d the date, for one file per shell */
+    g_snprintf(pidstr, sizeof(pidstr), "%d", pid);
+    now = g_date_time_new_now_local();
+    g_snprintf(datestr, sizeof(datestr), "%04d%02d%02d-%02d%02d%02d",
+            g_date_time_get_year(now), g_date_time_get_month(now),
+            g_date_time_get_day_of_month(now), g_date_time_get_hour(now),
+            g_date_time_get_minute(now), g_date_time_get_second(now));
+    g_date_time_unref(now);
+
+    path = g_string_new(NULL);
+    for (p = pattern; *p; p++) {
+        if (p[0] == '%' && p[1] == 'p') {
+            g_string_append(path, pidstr); p++;
+        } else if (p[0] == '%' && p[1] == 'd') {
+            g_string_append(path, datestr); p++;
+        } else {
+            g_string_append_c(path, *p);
+        }
+    }
+    if (!raw && termomix.log_compress && !g_str_has_suffix(path->str, ".gz")) {
+        g_string_append(path, ".gz");
+    }
+
+    log->path = g_string_free(path, FALSE);
+    log->buffer = g_byte_array_sized_new(LOG_BATCH);
+    if (raw) {
+        log->replace = true;
+    } else {
+        log->strip = termomix.log_strip_ansi;
+        log->compress = termomix.log_compress;
+        log->max_bytes = termomix.log_max_bytes;
+        log->rotate = termomix.log_rotate;
+    }
+    g_mutex_init(&log->lock);
+    g_cond_init(&log->cond);
+
+    g_mutex_lock(&termomix.log_lock);
+    termomix.log_writers++;
+    g_mutex_unlock(&termomix.log_lock);
+
+    g_thread_unref(g_thread_new("termomix-log", termomix_log_thread, log));
+
+    return log;
+}
+
+
+/* Called by the PTY reader thread */
+static void termomix_log_append(struct session_log *log, const gchar *data,
+        gsize len) {
+    g_mutex_lock(&log->lock);
+    while (log->buffer->len + len > LOG_BUFFER_MAX && !log->failed) {
+        g_cond_wait(&log->cond, &log->lock);
+    }
+    if (!log->failed) {
+        g_byte_array_append(log->buffer, (const guint8 *)data, len);
+        if (log->buffer->len >= LOG_BATCH) {
+            g_cond_broadcast(&log->cond);
+        }
+    }
+    g_mutex_unlock(&log->lock);
+}
+
+
+/* Bytes waiting to be written */
+static gsize termomix_log_pending(struct session_log *log) {
+    gsize len;
+
+    g_mutex_lock(&log->lock);
+    len = log->buffer->len;
+    g_mutex_unlock(&log->lock);
+
+    return len;
+}
+
+
+/* The writer thread finishes the file and frees log */
+static void termomix_log_close(struct session_log *log) {
+    g_mutex_lock(&log->lock);
+    log->closing = true;
+    g_cond_broadcast(&log->cond);
+    g_mutex_unlock(&log->lock);
+}
+
+
+/* Drop escape sequences and control characters but newlines and tabs from
+ * data, in place. The state carries sequences split between batches */
+static gsize termomix_log_strip(struct session_log *log, guint8 *data,
+        gsize len) {
+    gsize i, out = 0;
+
+    for (i=0; i<len; i++) {
+        guint8 c = data[i];
+
+        switch (log->strip_state) {
+        case LOG_TEXT:
+            if (c == 0x1b) {
+                log->strip_state = LOG_ESC;
+            } else if (c >= 0x20 ? c != 0x7f : c == '\n' || c == '\t') {
+                data[out++] = c;
+            }
+            break;
+        case LOG_ESC:
+            if (c == '[') {
+                log->strip_state = LOG_CSI;
+            } else if (c == ']' || c == 'P' || c == '_' || c == '^') {
+                log->strip_state = LOG_STRING;
+            } else if (c && strchr("()*+#%", c)) {
+                log->strip_state = LOG_CHARSET;
+            } else {
+                log->strip_state = LOG_TEXT;
+            }
+            break;
+        case LOG_CSI:
+            if (c >= 0x40 && c <= 0x7e)
+                log->strip_state = LOG_TEXT;
+            break;
+        case LOG_STRING:
+            if (c == 0x07) {
+                log->strip_state = LOG_TEXT;
+            } else if (c == 0x1b) {
+                log->strip_state = LOG_STRING_ESC;
+            }
+            break;
+        case LOG_STRING_ESC:
+            log->strip_state = c == '\\' ? LOG_TEXT : LOG_STRING;
+            break;
+        case LOG_CHARSET:
+            log->strip_state = LOG_TEXT;
+            break;
+        }
+    }
+
+    return out;
+}
+
+
+/* Open log->path for appending, through gzip if asked to */
+static GOutputStream *termomix_log_create(struct session_log *log,
+        GError **gerror) {
+    GFileOutputStream *file_out;
+    GOutputStream *out;
+    GFile *file;
+
+    file = g_file_new_for_path(log->path);
+    if (log->replace) {
+        file_out = g_file_replace(file, NULL, FALSE, G_FILE_CREATE_PRIVATE,
+                NULL, gerror);
+    } else {
+        file_out = g_file_append_to(file, G_FILE_CREATE_PRIVATE, NULL, gerror);
+    }
+    g_object_unref(file);
+    if (!file_out)
+        return NULL;
+
+    if (log->compress) {
+        GZlibCompressor *gzip;
+
+        gzip = g_zlib_compressor_new(G_ZLIB_COMPRESSOR_FORMAT_GZIP, -1);
+        out = g_converter_output_stream_new(G_OUTPUT_STREAM(file_out),
+                G_CONVERTER(gzip));
+        g_object_unref(gzip);
+        g_object_unref(file_out);
+    } else {
+        out = G_OUTPUT_STREAM(file_out);
+    }
+
+    return out;
+}
+
+
+/* path becomes path.1, path.1 path.2... up to path.<rotate> */
+static void termomix_log_rotate(struct session_log *log) {
+    gchar *from, *to;
+    guint i;
+
+    for (i=log->rotate; i>0; i--) {
+        from = i>1 ? g_strdup_printf("%s.%u", log->path, i-1) :
+                g_strdup(log->path);
+        to = g_strdup_printf("%s.%u", log->path, i);
+        g_rename(from, to);
+        g_free(from); g_free(to);
+    }
+    if (!log->rotate) {
+        g_unlink(log->path);
+    }
+}
+
+
+static gpointer termomix_log_thread(gpointer data) {
+    struct session_log *log = (struct session_log *)data;
+    GByteArray *batch = g_byte_array_sized_new(LOG_BATCH), *full;
+    GOutputStream *out;
+    GError *gerror=NULL;
+    gint64 deadline;
+    gsize len;
+    bool closing;
+
+    out = termomix_log_create(log, &gerror);
+
+    for (;;) {
+        g_mutex_lock(&log->lock);
+        deadline = g_get_monotonic_time() + LOG_FLUSH_DELAY;
+        while (log->buffer->len < LOG_BATCH && !log->closing &&
+                g_cond_wait_until(&log->cond, &log->lock, deadline));
+        /* Swap buffers, the reader fills the empty one meanwhile */
+        g_byte_array_set_size(batch, 0);
+        full = log->buffer;
+        log->buffer = batch;
+        batch = full;
+        closing = log->closing;
+        if (!out) {
+            log->failed = true;
+        }
+        g_cond_broadcast(&log->cond);
+        g_mutex_unlock(&log->lock);
+
+        len = batch->len;
+        if (out && log->strip) {
+            len = termomix_log_strip(log, batch->data, len);
+        }
+        if (out && len) {
+            if (!g_output_stream_write_all(out, batch->data, len, NULL,
+                    NULL, &gerror)) {
+                g_output_stream_close(out, NULL, NULL);
+                g_object_unref(out);
+                out = NULL;
+            }
+            log->written += len;
+        }
+        if (out && log->max_bytes && log->written >= log->max_bytes) {
+            g_output_stream_close(out, NULL, &gerror);
+            g_object_unref(out);
+            termomix_log_rotate(log);
+            log->written = 0;
+            out = termomix_log_create(log, &gerror);
+        }
+        if (gerror) {
+            fprintf(stderr, "Cannot log to %s: %s\n", log->path,
+                    gerror->message);
+            g_clear_error(&gerror);
+        }
+
+        if (closing)
+            break;
+    }
+
+    if (out) {
+        if (!g_output_stream_close(out, NULL, &gerror)) {
+            fprintf(stderr, "Cannot log to %s: %s\n", log->path,
+                    gerror->message);
+            g_error_free(gerror);
+        }
+        g_object_unref(out);
+    }
+
+    g_byte_array_free(batch, TRUE);
+    g_byte_array_free(log->buffer, TRUE);
+    g_mutex_clear(&log->lock);
+    g_cond_clear(&log->cond);
+    g_free(log->path);
+    g_free(log);
+
+    g_mutex_lock(&termomix.log_lock);
+    termomix.log_writers--;
+    g_cond_signal(&termomix.log_idle);
+    g_mutex_unlock(&termomix.log_lock);
+
+    return NULL;
+}
+
+
+/* Let the writers finish before exiting */
+static void termomix_log_done() {
+    g_mutex_lock(&termomix.log_lock);
+    while (termomix.log_writers) {
+        g_cond_wait(&termomix.log_idle, &termomix.log_lock);
+    }
+    g_mutex_unlock(&termomix.log_lock);
+}
+
+
+/******* Record and replay ********/
+
+/* --record writes the output of the first terminal as an asciicast v2 file:
+ * a JSON header line, then one [seconds, "o", "text"] line per PTY read.
+ * Lines are built by the PTY reader and written by a session log writer */
+
+static void termomix_record_open(struct terminal *term, const gchar *file) {
+    struct pty_reader *reader = term->reader;
+    gchar *header;
+
+    reader->record = termomix_log_open(file, term->pid, true);
+    reader->record_start = g_get_monotonic_time();
+
+    header = g_strdup_printf("{\"version\": 2, \"width\": %ld, "
+            "\"height\": %ld, \"timestamp\": %" G_GINT64_FORMAT ", "
+            "\"env\": {\"TERM\": \"%s\"}}\n", term->columns, term->rows,
+            g_get_real_time()/G_USEC_PER_SEC,
+            vte_terminal_get_emulation(VTE_TERMINAL(term->vte)));
+    termomix_log_append(reader->record, header, strlen(header));
+    g_free(header);
+}
+
+
+/* Append len bytes of valid UTF-8 to out as the inside of a JSON string */
+static void termomix_json_escape(GString *out, const gchar *text, gsize len) {
+    gsize i;
+
+    for (i=0; i<len; i++) {
+        guchar c = text[i];
+
+        if (c == '"' || c == '\\') {
+            g_string_append_c(out, '\\');
+            g_string_append_c(out, c);
+        } else if (c == '\n') {
+            g_string_append(out, "\\n");
+        } else if (c == '\r') {
+            g_string_append(out, "\\r");
+        } else if (c < 0x20) {
+            g_string_append_printf(out, "\\u%04x", c);
+        } else {
+            g_string_append_c(out, c);
+        }
+    }
+}
+
+
+/* Called by the PTY reader thread. A UTF-8 character split between two reads
+ * waits for the rest, invalid bytes become U+FFFD */
+static void termomix_record_append(struct pty_reader *reader,
+        const gchar *data, gsize len) {
+    GString *chunk, *line;
+    const gchar *p, *end, *valid;
+
+    chunk = g_string_new_len(reader->record_partial, reader->record_partial_len);
+    g_string_append_len(chunk, data, len);
+    p = chunk->str;
+    end = chunk->str + chunk->len;
+
+    line = g_string_sized_new(chunk->len + 32);
+    g_string_append_printf(line, "[%.6f, \"o\", \"",
+            (g_get_monotonic_time() - reader->record_start)/1e6);
+
+    while (p < end) {
+        g_utf8_validate(p, end - p, &valid);
+        termomix_json_escape(line, p, valid - p);
+        p = valid;
+        if (p == end)
+            break;
+        if (*p == '\0') {
+            g_string_append(line, "\\u0000");
+            p++;
+        } else if (g_utf8_get_char_validated(p, end - p) == (gunichar)-2 &&
+                end - p < (gssize)sizeof(reader->record_partial)) {
+            break;
+        } else {
+            g_string_append(line, "\\ufffd");
+            p++;
+        }
+    }
+
+    reader->record_partial_len = end - p;
+    memcpy(reader->record_partial, p, reader->record_partial_len);
+
+    if (p != chunk->str) {
+        g_string_append(line, "\"]\n");
+        termomix_log_append(reader->record, line->str, line->len);
+    }
+
+    g_string_free(line, TRUE);
+    g_string_free(chunk, TRUE);
+}
+
+
+/* Value of the four hex digits at s, or -1 */
+static gunichar termomix_json_hex4(const gchar *s) {
+    gunichar value = 0;
+    int i, digit;
+
+    for (i=0; i<4; i++) {
+        if ((digit = g_ascii_xdigit_value(s[i])) < 0)
+            return (gunichar)-1;
+        value = value*16 + digit;
+    }
+    return value;
+}
+
+
+/* Read the JSON string at *p, which points to its opening quote, and move
+ * *p past it. Returns NULL if it isn't a valid string */
+static GString *termomix_json_string(const gchar **p) {
+    const gchar *s = *p;
+    GString *out;
+    gunichar c;
+
+    if (*s != '"')
+        return NULL;
+
+    out = g_string_new(NULL);
+    for (s++; *s && *s != '"'; s++) {
+        if (*s != '\\') {
+            g_string_append_c(out, *s);
+            continue;
+        }
+        switch (*++s) {
+        case 'n': g_string_append_c(out, '\n'); break;
+        case 'r': g_string_append_c(out, '\r'); break;
+        case 't': g_string_append_c(out, '\t'); break;
+        case 'b': g_string_append_c(out, '\b'); break;
+        case 'f': g_string_append_c(out, '\f'); break;
+        case 'u':
+            if ((c = termomix_json_hex4(s+1)) == (gunichar)-1)
+                goto bad;
+            s += 4;
+            /* Characters out of the BMP come as a surrogate pair */
+            if (c >= 0xd800 && c < 0xdc00 && s[1] == '\\' && s[2] == 'u') {
+                gunichar low = termomix_json_hex4(s+3);
+
+                if (low >= 0xdc00 && low < 0xe000) {
+                    c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+                    s += 6;
+                }
+            }
+            if (c >= 0xd800 && c < 0xe000)
+                c = 0xfffd;
+            g_string_append_unichar(out, c);
+            break;
+        case '\0':
+            goto bad;
+        default:    /* \" \\ \/ */
+            g_string_append_c(out, *s);
+        }
+    }
+    if (*s != '"')
+        goto bad;
+
+    *p = s+1;
+    return out;
+
+bad:
+    g_string_free(out, TRUE);
+    return NULL;
+}
+
+
+/* --replay feeds an asciicast v2 file to a terminal without a child, at the
+ * recorded pace or, with --replay-fast, as fast as VTE takes it. The fast
+ * mode prints how long VTE took to parse it all and closes the window, as a
+ * parser benchmark on real sessions */
+
+static struct replay *termomix_replay_load(const gchar *file) {
+    struct replay *replay;
+    gchar *contents, **lines;
+    GError *gerror=NULL;
+    const gchar *p;
+    int i;
+
+    if (!g_file_get_contents(file, &contents, NULL, &gerror)) {
+        fprintf(stderr, "Cannot replay %s: %s\n", file, gerror->message);
+        g_error_free(gerror);
+        return NULL;
+    }
+
+    lines = g_strsplit(contents, "\n", -1);
+    g_free(contents);
+
+    /* Only the size is needed from the header */
+    if (!lines[0] || !strstr(lines[0], "\"version\": 2") ||
+            !(p = strstr(lines[0], "\"width\""))) {
+        fprintf(stderr, "Cannot replay %s: not an asciicast v2 file\n", file);
+        g_strfreev(lines);
+        return NULL;
+    }
+
+    replay = g_new0(struct replay, 1);
+    replay->events = g_array_new(FALSE, FALSE, sizeof(struct replay_event));
+    replay->columns = strtol(strchr(p, ':')+1, NULL, 10);
+    if ((p = strstr(lines[0], "\"height\""))) {
+        replay->rows = strtol(strchr(p, ':')+1, NULL, 10);
+    }
+
+    for (i=1; lines[i]; i++) {
+        struct replay_event event;
+        GString *type, *data;
+        gchar *end;
+        double time;
+
+        p = lines[i];
+        while (g_ascii_isspace(*p)) p++;
+        if (!*p)
+            continue;
+        if (*p++ != '[')
+            goto bad;
+        time = g_ascii_strtod(p, &end);
+        p = end;
+        while (g_ascii_isspace(*p) || *p == ',') p++;
+        if (!(type = termomix_json_string(&p)))
+            goto bad;
+        while (g_ascii_isspace(*p) || *p == ',') p++;
+        if (!(data = termomix_json_string(&p))) {
+            g_string_free(type, TRUE);
+            goto bad;
+        }
+
+        /* Input and other events don't go to the screen */
+        if (strcmp(type->str, "o") == 0) {
+            event.time = time*G_USEC_PER_SEC;
+            event.len = data->len;
+            event.data = g_string_free(data, FALSE);
+            g_array_append_val(replay->events, event);
+            replay->bytes += event.len;
+        } else {
+            g_string_free(data, TRUE);
+        }
+        g_string_free(type, TRUE);
+        continue;
+
+bad:
+        fprintf(stderr, "Cannot replay %s: bad event on line %d\n", file, i+1);
+        g_strfreev(lines);
+        termomix_replay_free(replay);
+        return NULL;
+    }
+
+    g_strfreev(lines);
+    return replay;
+}
+
+
+static void termomix_replay_free(struct replay *replay) {
+    guint i;
+
+    if (replay->source) {
+        g_source_remove(replay->source);
+    }
+    for (i=0; i<replay->events->len; i++) {
+        g_free(g_array_index(replay->events, struct replay_event, i).data);
+    }
+    g_array_free(replay->events, TRUE);
+    g_free(replay);
+}
+
+
+static gboolean termomix_replay_step(gpointer data) {
+    struct terminal *term = (struct terminal *)data;
+    struct replay *replay = term->replay;
+    gint64 now = g_get_monotonic_time();
+    struct replay_event *event;
+    gsize fed = 0;
+
+    while (replay->next < replay->events->len) {
+        event = &g_array_index(replay->events, struct replay_event,
+                replay->next);
+
+        if (!replay->fast && event->time > now - replay->start) {
+            replay->source = g_timeout_add(
+                    (event->time - (now - replay->start))/1000,
+                    termomix_replay_step, term);
+            return FALSE;
+        }
+
+        vte_terminal_feed(VTE_TERMINAL(term->vte), event->data, event->len);
+        replay->next++;
+        fed += event->len;
+        if (replay->fast) {
+            replay->replies += termomix_replay_queries(event->data,
+                    event->len);
+        }
+
+        now = g_get_monotonic_time();
+        /* Let drawing in, like termomix_pty_feed() does */
+        if (replay->fast && fed >= PTY_FEED_BATCH)
+            return TRUE;
+    }
+
+    replay->source = 0;
+    if (replay->fast) {
+        /* vte_terminal_feed() only queues, the events are parsed later. VTE
+         * answers a cursor position request once it gets to it, after
+         * everything before it. The session may have sent some of its own */
+        replay->replies++;
+        g_signal_connect(G_OBJECT(term->vte), "commit",
+                G_CALLBACK(termomix_replay_reply), term);
+        vte_terminal_feed(VTE_TERMINAL(term->vte), "\033[6n", 4);
+    }
+
+    return FALSE;
+}
+
+
+static void termomix_replay_reply(VteTerminal *vte, gchar *text, guint size,
+        gpointer data) {
+    struct terminal *term = (struct terminal *)data;
+    struct replay *replay = term->replay;
+    double took = (g_get_monotonic_time() - replay->start)/1e6;
+
+    /* Other answers, or one to a request of the session */
+    if (size < 1 || text[size-1] != 'R' || --replay->replies > 0)
+        return;
+
+    g_signal_handlers_disconnect_by_func(vte, termomix_replay_reply, data);
+    printf("replayed %u events, %" G_GSIZE_FORMAT " bytes in %.3f s, "
+            "%.1f MB/s\n", replay->events->len, replay->bytes, took,
+            replay->bytes/1e6/took);
+    fflush(stdout);
+
+    replay->source = g_idle_add(termomix_replay_finish, term);
+}
+
+
+/* Cursor position requests in data. One split between two events is
+ * missed */
+static guint termomix_replay_queries(const gchar *data, gsize len) {
+    const gchar *p = data, *end = data + len;
+    guint n = 0;
+
+    while ((p = memchr(p, '\033', end - p))) {
+        if (end - p >= 4 && memcmp(p, "\033[6n", 4) == 0) {
+            n++;
+        }
+        p++;
+    }
+    return n;
+}
+
+
+static gboolean termomix_replay_finish(gpointer data) {
+    struct terminal *term = (struct terminal *)data;
+
+    term->replay->source = 0;
+    termomix_destroy_terminal(term);
+    return FALSE;
+}
+
+
+static void termomix_replay_start(struct terminal *term,
+        struct replay *replay) {
+    term->replay = replay;
+    replay->fast = option_replay_fast;
+    if (replay->columns > 0 && replay->rows > 0) {
+        term->columns = replay->columns;
+        term->rows = replay->rows;
+        termomix_set_size(term->columns, term->rows);
+    }
+
+    replay->start = g_get_monotonic_time();
+    if (replay->fast) {
+        replay->source = g_idle_add_full(G_PRIORITY_DEFAULT_IDLE,
+                termomix_replay_step, term, NULL);
+    } else {
+        replay->source = g_idle_add(termomix_replay_step, term);
+    }
+}
+
+
+static void termomix_replay_close(struct terminal *term) {
+    if (term->replay) {
+        termomix_replay_free(term->replay);
+        term->replay = NULL;
+    }
+}
+
+
+/* Run the user shell in term */
+static void termomix_spawn_shell(struct terminal *term, const gchar *cwd,
+        bool login) {
+    gchar *argv[3];
+
+    /* Set argv for forked childs. Real argv vector starts at argv[1] because we're
+       using G_SPAWN_FILE_AND_ARGV_ZERO to be able to launch login shells */
+    argv[0]=g_strdup(g_getenv("SHELL"));
+    if (login) {
+        argv[1]=g_strdup_printf("-%s", g_getenv("SHELL"));
+    } else {
+        argv[1]=g_strdup(g_getenv("SHELL"));
+    }
+    argv[2]=NULL;
+
+    termomix_spawn(term, cwd, argv,
+            G_SPAWN_SEARCH_PATH|G_SPAWN_FILE_AND_ARGV_ZERO);
+    g_free(argv[0]); g_free(argv[1]);
+}
+
+
+/* Top up the pool of warm terminals, one per main loop iteration so that
+ * the windows already on screen stay responsive */
+static gboolean termomix_pool_refill(gpointer data) {
+    struct terminal *current = termomix.term;
+    struct terminal *term;
+
+    if (g_list_length(termomix.pool) >= termomix.pool_size) {
+        termomix.pool_source = 0;
+        return FALSE;
+    }
+
+    /* Pooled shells start where the last window was asked for */
+    if (!termomix.pool_cwd) {
+        termomix.pool_cwd = g_strdup(g_get_home_dir());
+    }
+    term = termomix_create_terminal();
+    gtk_widget_realize(term->window);
+    term->pool_cwd = g_strdup(termomix.pool_cwd);
+    termomix_spawn_shell(term, term->pool_cwd, false);
+    termomix.pool = g_list_append(termomix.pool, term);
+
+    termomix.term = current;
+    return TRUE;
+}
+
+
+static void termomix_pool_schedule_refill() {
+    if (termomix.pool_size > 0 && !termomix.pool_source) {
+        termomix.pool_source = g_idle_add_full(G_PRIORITY_LOW,
+                termomix_pool_refill, NULL, NULL);
+    }
+}
+
+
+/* Hand out a warm terminal whose shell was started in cwd, or NULL if the
+ * pool has none. A shell is never moved to another directory: on a miss
+ * the pool is refilled in cwd instead, for the next window asked for there */
+static struct terminal *termomix_pool_take(const gchar *cwd) {
+    struct terminal *term = NULL;
+    GList *l, *next;
+
+    if (!cwd) {
+        cwd = g_get_home_dir();
+    }
+
+    for (l = termomix.pool; l != NULL && !term; l = l->next) {
+        if (g_strcmp0(((struct terminal *)l->data)->pool_cwd, cwd) == 0) {
+            term = (struct terminal *)l->data;
+        }
+    }
+
+    if (term) {
+        termomix.pool = g_list_remove(termomix.pool, term);
+        g_free(term->pool_cwd);
+        term->pool_cwd = NULL;
+        termomix.term = term;
+    } else if (termomix.pool_size > 0 &&
+            g_strcmp0(termomix.pool_cwd, cwd) != 0) {
+        g_free(termomix.pool_cwd);
+        termomix.pool_cwd = g_strdup(cwd);
+        for (l = termomix.pool; l != NULL; l = next) {
+            next = l->next;
+            gtk_widget_destroy(((struct terminal *)l->data)->window);
+        }
+    }
+
+    termomix_pool_schedule_refill();
+
+    return term;
+}
+
+
+/* Open a new window with a terminal running in cwd, as requested by the
+ * current option_* values */
+static bool termomix_init_terminal(const gchar *cwd) {
+    struct terminal *term = NULL;
+    struct replay *replay = NULL;
+    gchar **command_argv = NULL;
+
+    if (option_execute||option_xterm_execute) {
+        if (!termomix_get_command(&command_argv)) {
+            return false;
+        }
+    }
+
+    if (option_replay) {
+        replay = termomix_replay_load(option_replay);
+        g_free(option_replay); option_replay = NULL;
+        if (!replay) {
+            g_strfreev(command_argv);
+            return false;
+        }
+    }
+
+    /* Warm shells are plain non-login shells, anything else is forked now */
+    if (!command_argv && !option_login && !option_hold && !option_record &&
+            !replay) {
+        term = termomix_pool_take(cwd);
+    }
+    if (!term) {
+        term = termomix_create_terminal();
+    }
+
+    if (option_title) {
+        gtk_window_set_title(GTK_WINDOW(term->window), option_title);
+    }
+
+    term->hold=option_hold;
+    if (option_columns || option_rows) {
+        term->columns = option_columns ? option_columns : DEFAULT_COLUMNS;
+        term->rows = option_rows ? option_rows : DEFAULT_ROWS;
+        termomix_set_size(term->columns, term->rows);
+    }
+
+    termomix_profile_begin(PROFILE_FIRST_DRAW);
+    if (option_geometry) {
+        if (!gtk_window_parse_geometry(GTK_WINDOW(term->window), option_geometry)) {
+            fprintf(stderr, "Invalid geometry.\n");
+            gtk_widget_show(term->window);
+        } else {
+            gtk_widget_show(term->window);
+            term->columns = VTE_TERMINAL(term->vte)->column_count;
+            term->rows = VTE_TERMINAL(term->vte)->row_count;
+        }
+    } else {
+        gtk_widget_show(term->window);
+    }
+
+    /* Only the first terminal is recorded */
+    term->record = option_record;
+    option_record = NULL;
+
+    if (replay) {
+        termomix_replay_start(term, replay);
+        g_strfreev(command_argv);
+    } else if (command_argv) {
+        termomix_spawn(term, cwd, command_argv, G_SPAWN_SEARCH_PATH);
+        g_strfreev(command_argv);
+    } else if (!term->pid) { /* No execute option, and not a warm terminal */
+        if (term->hold) {
+            termomix_error("Hold option given without any command");
+            term->hold=FALSE;
+        }
+
+        termomix_spawn_shell(term, cwd, option_login);
+    }
+
+    gtk_widget_grab_focus(term->vte);
+
+    return true;
+}
+
+
+static void termomix_destroy_terminal(struct terminal *term) {
+    /* termomix_destroy_window() does the bookkeeping */
+    gtk_widget_destroy(term->window);
+}
+
+static void termomix_set_bgimage(char *infile) {
+    struct terminal *term = termomix.term;
+    GtkAllocation allocation;
+
+    /* Check file existence and type */
+    if (!g_file_test(infile, G_FILE_TEST_IS_REGULAR)) {
+        return;
+    }
+
+    if (g_strcmp0(termomix.bg_file, infile) != 0) {
+        g_free(termomix.bg_file);
+        termomix.bg_file = g_strdup(infile);
+        g_hash_table_remove_all(termomix.bg_variants);
+    }
+
+    /* The saturation is already in the decoded image */
+    vte_terminal_set_background_saturation(VTE_TERMINAL(term->vte), 1.0);
+    vte_terminal_set_background_transparent(VTE_TERMINAL(term->vte), FALSE);
+
+    /* Tiled, one copy at the size of the file fits every window */
+    term->bg_width = term->bg_height = 0;
+    if (!termomix.bg_cover) {
+        termomix_bg_request(term, 0, 0);
+        return;
+    }
+
+    /* Not allocated yet, termomix_bg_resize() asks for it later */
+    gtk_widget_get_allocation(term->vte, &allocation);
+    if (allocation.width > 1 && allocation.height > 1) {
+        termomix_bg_request(term, allocation.width, allocation.height);
+    }
+}
+
+
+/* Show the background scaled to width x height in term, or 0 x 0 to tile it
+ * at the size of the file, decoding it on the bg_decoder thread unless some
+ * terminal of the same size has it */
+static void termomix_bg_request(struct terminal *term, gint width, gint height) {
+    struct bg_request *req;
+    GdkPixbuf *pixbuf;
+
+    term->bg_width = width;
+    term->bg_height = height;
+
+    if (g_hash_table_lookup_extended(termomix.bg_variants,
+                BG_KEY(width, height), NULL, (gpointer *)&pixbuf)) {
+        /* NULL while decoding, termomix_bg_decoded() sets it then */
+        if (pixbuf) {
+            vte_terminal_set_background_image(VTE_TERMINAL(term->vte), pixbuf);
+        }
+        return;
+    }
+    g_hash_table_insert(termomix.bg_variants, BG_KEY(width, height), NULL);
+
+    req = g_new0(struct bg_request, 1);
+    req->file = g_strdup(termomix.bg_file);
+    req->width = width;
+    req->height = height;
+    req->saturation = termomix.bg_saturation;
+
+    /* A single thread, so a resize doesn't decode the same size twice */
+    if (!termomix.bg_decoder) {
+        termomix.bg_decoder = g_thread_pool_new(termomix_bg_decode,
+                NULL, 1, FALSE, NULL);
+    }
+    g_thread_pool_push(termomix.bg_decoder, req, NULL);
+}
+
+
+/* Runs on the bg_decoder thread. The image is scaled to cover the window
+ * keeping its aspect ratio, desaturated, and kept in the cache dir under a
+ * name made from everything that went into it */
+static void termomix_bg_decode(gpointer data, gpointer user_data) {
+    struct bg_request *req = (struct bg_request *)data;
+    GStatBuf st;
+    GdkPixbuf *image;
+    gchar *id, *sum, *name, *dir, *cache, *tmp;
+    gint width, height;
+    double scale;
+
+    if (g_stat(req->file, &st) != 0) {
+        g_set_error(&req->error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                "%s: %s", req->file, g_strerror(errno));
+        g_idle_add(termomix_bg_decoded, req);
+        return;
+    }
+
+    id = g_strdup_printf("%s\n%ld\n%lld\n%dx%d\n%.3f", req->file,
+            (long)st.st_mtime, (long long)st.st_size, req->width, req->height,
+            req->saturation);
+    sum = g_compute_checksum_for_string(G_CHECKSUM_SHA1, id, -1);
+    name = g_strconcat(sum, ".png", NULL);
+    dir = g_build_filename(g_get_user_cache_dir(), "termomix", "backgrounds", NULL);
+    cache = g_build_filename(dir, name, NULL);
+
+    req->pixbuf = gdk_pixbuf_new_from_file(cache, NULL);
+    if (req->pixbuf) {
+        g_utime(cache, NULL);       /* For termomix_bg_prune_cache() */
+    } else if (!gdk_pixbuf_get_file_info(req->file, &width, &height)) {
+        g_set_error(&req->error, GDK_PIXBUF_ERROR,
+                GDK_PIXBUF_ERROR_UNKNOWN_TYPE, "%s: unknown image format",
+                req->file);
+    } else {
+        if (!req->width) {
+            /* Tiled by VTE, at the size of the file */
+            req->pixbuf = gdk_pixbuf_new_from_file(req->file, &req->error);
+        } else {
+            /* Loaders like JPEG's decode straight at the smaller size */
+            scale = MAX((double)req->width/width, (double)req->height/height);
+            image = gdk_pixbuf_new_from_file_at_scale(req->file,
+                    MAX(req->width, ceil(width*scale)),
+                    MAX(req->height, ceil(height*scale)), FALSE, &req->error);
+            if (image) {
+                req->pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB,
+                        gdk_pixbuf_get_has_alpha(image), 8, req->width,
+                        req->height);
+                gdk_pixbuf_copy_area(image,
+                        (gdk_pixbuf_get_width(image) - req->width)/2,
+                        (gdk_pixbuf_get_height(image) - req->height)/2,
+                        req->width, req->height, req->pixbuf, 0, 0);
+                g_object_unref(image);
+            }
+        }
+        if (req->pixbuf && req->saturation != 1.0) {
+            gdk_pixbuf_saturate_and_pixelate(req->pixbuf, req->pixbuf,
+                    req->saturation, FALSE);
+        }
+
+        /* A tiled image decodes from the file as fast as from a copy */
+        if (req->pixbuf && req->width) {
+            /* Renamed into place, so a reader never sees half of it */
+            tmp = g_strdup_printf("%s.%d", cache, getpid());
+            if (g_mkdir_with_parents(dir, 0700) == 0
+                    && gdk_pixbuf_save(req->pixbuf, tmp, "png", NULL, NULL)
+                    && g_rename(tmp, cache) == 0) {
+                termomix_bg_prune_cache(dir);
+            } else {
+                g_unlink(tmp);
+            }
+            g_free(tmp);
+        }
+    }
+
+    g_free(id);
+    g_free(sum);
+    g_free(name);
+    g_free(dir);
+    g_free(cache);
+
+    g_idle_add(termomix_bg_decoded, req);
+}
+
+
+static gint termomix_bg_compare_mtime(gconstpointer a, gconstpointer b) {
+    const struct bg_cache_file *fa = a, *fb = b;
+
+    return (fa->mtime > fb->mtime) - (fa->mtime < fb->mtime);
+}
+
+
+/* Keep the BG_CACHE_FILES most recently used files of dir */
+static void termomix_bg_prune_cache(const gchar *dir) {
+    GDir *d;
+    GArray *files;
+    struct bg_cache_file file;
+    GStatBuf st;
+    const gchar *name;
+    guint i;
+
+    if (!(d = g_dir_open(dir, 0, NULL))) {
+        return;
+    }
+    files = g_array_new(FALSE, FALSE, sizeof(struct bg_cache_file));
+    while ((name = g_dir_read_name(d))) {
+        file.path = g_build_filename(dir, name, NULL);
+        if (g_stat(file.path, &st) == 0) {
+            file.mtime = st.st_mtime;
+            g_array_append_val(files, file);
+        } else {
+            g_free(file.path);
+        }
+    }
+    g_dir_close(d);
+
+    g_array_sort(files, termomix_bg_compare_mtime);
+    for (i = 0; i < files->len; i++) {
+        file = g_array_index(files, struct bg_cache_file, i);
+        if (i + BG_CACHE_FILES < files->len) {
+            g_unlink(file.path);
+        }
+        g_free(file.path);
+    }
+    g_array_free(files, TRUE);
+}
+
+
+/* Back on the main thread with a termomix_bg_decode() result */
+static gboolean termomix_bg_decoded(gpointer data) {
+    struct bg_request *req = (struct bg_request *)data;
+    struct terminal *term;
+    GHashTableIter iter;
+    gpointer key, value;
+    GList *l;
+    bool used;
+
+    /* Stale if the image, its saturation or scaling changed meanwhile */
+    if (termomix.background && g_strcmp0(req->file, termomix.bg_file) == 0
+            && req->saturation == termomix.bg_saturation
+            && (req->width != 0) == termomix.bg_cover) {
+        if (!req->pixbuf) {
+            g_hash_table_remove(termomix.bg_variants,
+                    BG_KEY(req->width, req->height));
+            termomix_error("Error loading image file: %s", req->error->message);
+        } else {
+            g_hash_table_replace(termomix.bg_variants,
+                    BG_KEY(req->width, req->height), g_object_ref(req->pixbuf));
+            for (l = termomix.terminals; l != NULL; l = l->next) {
+                term = (struct terminal *)l->data;
+                if (term->bg_width == req->width && term->bg_height == req->height) {
+                    vte_terminal_set_background_image(VTE_TERMINAL(term->vte),
+                            req->pixbuf);
+                }
+            }
+
+            /* Drop the sizes no terminal has anymore */
+            g_hash_table_iter_init(&iter, termomix.bg_variants);
+            while (g_hash_table_iter_next(&iter, &key, &value)) {
+                used = (value == NULL);
+                for (l = termomix.terminals; l != NULL && !used; l = l->next) {
+                    term = (struct terminal *)l->data;
+                    used = (key == BG_KEY(term->bg_width, term->bg_height));
+                }
+                if (!used) {
+                    g_hash_table_iter_remove(&iter);
+                }
+            }
+        }
+    }
+
+    if (req->pixbuf) {
+        g_object_unref(req->pixbuf);
+    }
+    if (req->error) {
+        g_error_free(req->error);
+    }
+    g_free(req->file);
+    g_free(req);
+
+    return FALSE;
+}
+
+
+/* bg_variants value destroy function, NULL is a decode in progress */
+static void termomix_bg_forget(gpointer data) {
+    if (data) {
+        g_object_unref(data);
+    }
+}
+
+
+/* The first size is decoded right away, the ones of an interactive resize
+ * once it stops for BG_RESIZE_DELAY. VTE keeps showing the old image until
+ * then */
+static void termomix_bg_resize(GtkWidget *widget, GtkAllocation *allocation,
+        void *data) {
+    struct terminal *term = (struct terminal *)data;
+
+    if (!termomix.background || !termomix.bg_cover || allocation->width <= 1 ||
+            allocation->height <= 1
+            || (allocation->width == term->bg_width
+                && allocation->height == term->bg_height)) {
+        return;
+    }
+
+    if (term->bg_source) {
+        g_source_remove(term->bg_source);
+        term->bg_source = 0;
+    }
+    if (!term->bg_width) {
+        termomix_bg_request(term, allocation->width, allocation->height);
+    } else {
+        term->bg_source = g_timeout_add(BG_RESIZE_DELAY, termomix_bg_resized, term);
+    }
+}
+
+
+static gboolean termomix_bg_resized(gpointer data) {
+    struct terminal *term = (struct terminal *)data;
+    GtkAllocation allocation;
+
+    term->bg_source = 0;
+    if (termomix.background && termomix.bg_cover) {
+        gtk_widget_get_allocation(term->vte, &allocation);
+        termomix_bg_request(term, allocation.width, allocation.height);
+    }
+
+    return FALSE;
+}
+
+
+/* Count and time the frames drawn, for the metrics socket and for
+ * FRAME_STATS_ENV. The longest frame is where a font fallback lookup in the
+ * middle of output shows */
+static gboolean termomix_frame_begin(GtkWidget *widget, cairo_t *cr, void *data) {
+    termomix.frame_start = g_get_monotonic_time();
+
+    return FALSE;
+}
+
+
+static gboolean termomix_frame_draw(GtkWidget *widget, cairo_t *cr, void *data) {
+    gint64 now = g_get_monotonic_time();
+
+    if (!termomix.frames++) {
+        termomix.first_frame = now;
+    }
+    termomix.last_frame = now;
+    termomix.frame_longest = MAX(termomix.frame_longest,
+            now - termomix.frame_start);
+    termomix_histogram_add(&termomix.metrics.frame_time,
+            (now - termomix.frame_start)/1e6);
+
+    return FALSE;
+}
+
+
+static void termomix_frame_report() {
+    double seconds = (termomix.last_frame - termomix.first_frame)/1e6;
+
+    if (!g_getenv(FRAME_STATS_ENV) || termomix.frames < 2) {
+        return;
+    }
+    fprintf(stderr, "termomix: %u frames in %.3f s, %.1f fps, longest %.1f ms\n",
+            termomix.frames, seconds, (termomix.frames - 1)/seconds,
+            termomix.frame_longest/1000.0);
+}
+
+
+/* The characters of a prewarm_ranges list, like "2500-257F,1F600", as
+ * lines of text. NULL if there are none */
+static gchar *termomix_prewarm_text(const gchar *spec) {
+    gchar **ranges = g_strsplit(spec, ",", -1);
+    GString *text = g_string_new(NULL);
+    gunichar c, first, last;
+    gchar *end;
+    guint i, count = 0;
+
+    for (i = 0; ranges[i]; i++) {
+        g_strstrip(ranges[i]);
+        if (!*ranges[i]) {
+            continue;
+        }
+        first = last = strtoul(ranges[i], &end, 16);
+        if (end != ranges[i] && *end == '-') {
+            last = strtoul(end + 1, &end, 16);
+        }
+        if (end == ranges[i] || *end || last < first || last > 0x10FFFF) {
+            fprintf(stderr, "Ignoring prewarm range %s\n", ranges[i]);
+            continue;
+        }
+
+        for (c = first; c <= last && count < PREWARM_MAX_CHARS; c++) {
+            if (!g_unichar_isprint(c) || g_unichar_ismark(c)) {
+                continue;
+            }
+            g_string_append_unichar(text, c);
+            if (++count % PREWARM_LINE == 0) {
+                g_string_append_c(text, '\n');
+            }
+        }
+    }
+    g_strfreev(ranges);
+
+    if (!count) {
+        g_string_free(text, TRUE);
+        return NULL;
+    }
+    return g_string_free(text, FALSE);
+}
+
+
+/* Render prewarm_text with the current font on the prewarmer thread, after
+ * startup and after every font change, so the fontconfig fallback matching
+ * for those characters is done before htop or tree show them */
+static void termomix_prewarm_start() {
+    struct prewarm_job *job;
+    GdkScreen *screen = gdk_screen_get_default();
+    const cairo_font_options_t *options;
+
+    if (!termomix.prewarm_text || !screen) {
+        return;
+    }
+
+    job = g_new0(struct prewarm_job, 1);
+    job->font = pango_font_description_copy(termomix.font);
+    job->text = g_strdup(termomix.prewarm_text);
+    if ((options = gdk_screen_get_font_options(screen))) {
+        job->options = cairo_font_options_copy(options);
+    }
+    job->resolution = gdk_screen_get_resolution(screen);
+    job->generation = g_atomic_int_add(&termomix.prewarm_generation, 1) + 1;
+
+    if (!termomix.prewarmer) {
+        termomix.prewarmer = g_thread_pool_new(termomix_prewarm, NULL, 1,
+                FALSE, NULL);
+    }
+    g_thread_pool_push(termomix.prewarmer, job, NULL);
+}
+
+
+static void termomix_prewarm(gpointer data, gpointer user_data) {
+    struct prewarm_job *job = (struct prewarm_job *)data;
+
+    /* Skipped if the font changed again meanwhile, Ctrl+plus does that */
+    if (job->generation == g_atomic_int_get(&termomix.prewarm_generation)) {
+        termomix_warm_fonts(job->font, job->text, job->options,
+                job->resolution);
+    }
+
+    pango_font_description_free(job->font);
+    g_free(job->text);
+    if (job->options) {
+        cairo_font_options_destroy(job->options);
+    }
+    g_free(job);
+}
+
+
+/* Load font, and lay out and draw text with it if not NULL, on a worker
+ * thread. Pango isn't thread safe, so this goes through a private font map
+ * and VTE's Pango font and fontset caches stay cold. What's shared is
+ * fontconfig: its config, the font match and the fallback fonts picked for
+ * text. FreeType faces and cairo scaled fonts are cached process wide too,
+ * but whether VTE's lookups hit them depends on the font options matching */
+static void termomix_warm_fonts(const PangoFontDescription *font,
+        const gchar *text, const cairo_font_options_t *options,
+        double resolution) {
+    PangoFontMap *fontmap;
+    PangoContext *context;
+    PangoLayout *layout;
+    PangoFont *loaded;
+    cairo_surface_t *surface;
+    cairo_t *cr;
+    gint width, height;
+
+    fontmap = pango_cairo_font_map_new();
+    context = pango_font_map_create_context(fontmap);
+    if (options) {
+        pango_cairo_context_set_font_options(context, options);
+    }
+    if (resolution > 0) {
+        pango_cairo_context_set_resolution(context, resolution);
+    }
+
+    if (!text) {
+        loaded = pango_font_map_load_font(fontmap, context, font);
+        if (loaded)
+            g_object_unref(loaded);
+        g_object_unref(context);
+        g_object_unref(fontmap);
+        return;
+    }
+
+    /* Laying it out picks the fallback fonts, drawing rasterizes */
+    layout = pango_layout_new(context);
+    pango_layout_set_font_description(layout, font);
+    pango_layout_set_text(layout, text, -1);
+    pango_layout_get_pixel_size(layout, &width, &height);
+
+    surface = cairo_image_surface_create(CAIRO_FORMAT_A8,
+            MAX(width, 1), MAX(height, 1));
+    cr = cairo_create(surface);
+    pango_cairo_update_context(cr, context);
+    pango_layout_context_changed(layout);
+    pango_cairo_show_layout(cr, layout);
+
+    cairo_destroy(cr);
+    cairo_surface_destroy(surface);
+    g_object_unref(layout);
+    g_object_unref(context);
+    g_object_unref(fontmap);
+}
+
+
+static void termomix_set_config_key(const gchar *key, guint value) {
+    char *valname;
+
+    valname=gdk_keyval_name(value);
+    g_key_file_set_string(termomix.cfg, cfg_group, key, valname);
+    termomix_config_dirty(key);
+    //FIXME: free() valname?
+} 
+
+
+static guint termomix_get_config_key(const gchar *key) {
+    gchar *value;
+    guint retval=GDK_KEY_VoidSymbol;
+
+    value=g_key_file_get_string(termomix.cfg, cfg_group, key, NULL);
+    if (value!=NULL){
+        retval=gdk_keyval_from_name(value);
+        g_free(value);
+    }
+
+    /* For backwards compatibility with integer values */
+    /* If gdk_keyval_from_name fail, it seems to be integer value*/
+    if ((retval==GDK_KEY_VoidSymbol)||(retval==0)) {
+        retval=g_key_file_get_integer(termomix.cfg, cfg_group, key, NULL);
+    }
+
+    return retval;
+}
+
+
+static void termomix_error(const char *format, ...) {
+    GtkWidget *dialog;
+    va_list args;
+    char* buff;
+
+    va_start(args, format);
+    buff = malloc(sizeof(char)*ERROR_BUFFER_LENGTH);
+    vsnprintf(buff, sizeof(char)*ERROR_BUFFER_LENGTH, format, args);
+    va_end(args);
+
+    dialog = gtk_message_dialog_new(termomix.term ? GTK_WINDOW(termomix.term->window) : NULL,
+            GTK_DIALOG_DESTROY_WITH_PARENT, GTK_MESSAGE_ERROR,
+            GTK_BUTTONS_CLOSE, "%s", buff);
+    gtk_window_set_title(GTK_WINDOW(dialog), gettext("Error message"));
+    gtk_dialog_run (GTK_DIALOG (dialog));
+    gtk_widget_destroy (dialog);
+    free(buff);
+}
+
+
+/* Startup profiling. Timestamps are always taken, they are cheap enough, and
+ * only the first occurrence of every phase counts */
+static void termomix_profile_begin(enum profile_phase phase) {
+    if (!profile_begin[phase]) {
+        profile_begin[phase] = g_get_monotonic_time();
+    }
+}
+
+
+static void termomix_profile_end(enum profile_phase phase) {
+    if (profile_begin[phase] && !profile_end[phase]) {
+        profile_end[phase] = g_get_monotonic_time();
+    }
+}
+
+
+static gboolean termomix_profile_draw(GtkWidget *widget, cairo_t *cr,
+        void *data) {
+    termomix_profile_end(PROFILE_FIRST_DRAW);
+    g_signal_handlers_disconnect_by_func(widget, termomix_profile_draw, data);
+    return FALSE;
+}
+
+
+/* The first PTY output is the last phase we trace, report everything */
+static void termomix_profile_contents_changed(GtkWidget *widget, void *data) {
+    int i;
+
+    termomix_profile_end(PROFILE_FIRST_OUTPUT);
+    g_signal_handlers_disconnect_by_func(widget,
+            termomix_profile_contents_changed, data);
+
+    /* Started by termomix_profile_repeat(), which wants raw numbers */
+    if (g_getenv(PROFILE_CHILD_ENV)) {
+        for (i=0; i<PROFILE_PHASES; i++) {
+            printf("%s %" G_GINT64_FORMAT " %" G_GINT64_FORMAT "\n",
+                    profile_names[i], profile_begin[i]-profile_begin[0],
+                    profile_end[i]-profile_begin[i]);
+        }
+        fflush(stdout);
+        exit(EXIT_SUCCESS);
+    }
+
+    fprintf(stderr, "%-14s %10s %10s\n", "phase", "start ms", "took ms");
+    for (i=0; i<PROFILE_PHASES; i++) {
+        if (!profile_end[i])
+            continue;
+        fprintf(stderr, "%-14s %10.2f %10.2f\n", profile_names[i],
+                (profile_begin[i]-profile_begin[0])/1000.0,
+                (profile_end[i]-profile_begin[i])/1000.0);
+    }
+    fprintf(stderr, "%-14s %10.2f\n", "total",
+            (profile_end[PROFILE_FIRST_OUTPUT]-profile_begin[0])/1000.0);
+}
+
+
+static gint termomix_profile_compare(gconstpointer a, gconstpointer b) {
+    gint64 x = *(const gint64 *)a, y = *(const gint64 *)b;
+    return x < y ? -1 : x > y;
+}
+
+
+/* Value at percentile pct of the sorted values, nearest rank */
+static gint64 termomix_profile_percentile(GArray *values, int pct) {
+    guint rank = (values->len*pct + 99)/100;
+
+    return g_array_index(values, gint64, rank ? rank-1 : 0);
+}
+
+
+/* --profile-startup=N: start a standalone termomix N times and report the
+ * median and p95 of every phase */
+static int termomix_profile_repeat(int argc, char **argv) {
+    GArray *took[PROFILE_PHASES+1];
+    GPtrArray *child_argv;
+    gchar **envp, *out, **lines;
+    GError *gerror=NULL;
+    gint status;
+    int i, j, run;
+
+    child_argv = g_ptr_array_new();
+    g_ptr_array_add(child_argv, argv[0]);
+    g_ptr_array_add(child_argv, "--standalone");
+    g_ptr_array_add(child_argv, "--profile-startup");
+    for (i=1; i<argc; i++) {
+        if (!g_str_has_prefix(argv[i], "--profile-startup")) {
+            g_ptr_array_add(child_argv, argv[i]);
+        }
+    }
+    g_ptr_array_add(child_argv, NULL);
+    envp = g_environ_setenv(g_get_environ(), PROFILE_CHILD_ENV, "1", TRUE);
+
+    for (i=0; i<=PROFILE_PHASES; i++) {
+        took[i] = g_array_new(FALSE, FALSE, sizeof(gint64));
+    }
+
+    for (run=0; run<option_profile_startup; run++) {
+        if (!g_spawn_sync(NULL, (gchar **)child_argv->pdata, envp,
+                G_SPAWN_SEARCH_PATH|G_SPAWN_STDERR_TO_DEV_NULL, NULL, NULL,
+                &out, NULL, &status,
+                &gerror)) {
+            fprintf(stderr, "Cannot run %s: %s\n", argv[0], gerror->message);
+            return EXIT_FAILURE;
+        }
+
+        lines = g_strsplit(out, "\n", -1);
+        for (j=0; lines[j]; j++) {
+            gchar name[32];
+            gint64 start, duration;
+
+            if (sscanf(lines[j], "%31s %" G_GINT64_FORMAT " %" G_GINT64_FORMAT,
+                    name, &start, &duration) != 3)
+                continue;
+            for (i=0; i<PROFILE_PHASES; i++) {
+                if (strcmp(name, profile_names[i])==0 && duration >= 0) {
+                    g_array_append_val(took[i], duration);
+                }
+            }
+            if (strcmp(name, profile_names[PROFILE_FIRST_OUTPUT])==0) {
+                start += duration;
+                g_array_append_val(took[PROFILE_PHASES], start);
+            }
+        }
+        g_strfreev(lines);
+        g_free(out);
+    }
+
+    printf("%-14s %10s %10s %6s\n", "phase", "median ms", "p95 ms", "runs");
+    for (i=0; i<=PROFILE_PHASES; i++) {
+        if (!took[i]->len)
+            continue;
+        g_array_sort(took[i], termomix_profile_compare);
+        printf("%-14s %10.2f %10.2f %6u\n",
+                i<PROFILE_PHASES ? profile_names[i] : "total",
+                termomix_profile_percentile(took[i], 50)/1000.0,
+                termomix_profile_percentile(took[i], 95)/1000.0, took[i]->len);
+        g_array_free(took[i], TRUE);
+    }
+
+    g_strfreev(envp);
+    g_ptr_array_free(child_argv, TRUE);
+
+    return EXIT_SUCCESS;
+}
+
+
+static gboolean termomix_profile_option(const gchar *name, const gchar *value,
+        gpointer data, GError **error) {
+    option_profile_startup = value ? atoi(value) : 1;
+    if (option_profile_startup < 1) {
+        g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                "Bad number of startup runs: %s", value);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+
+/******* Latency trace ********/
+
+/* --latency-trace follows every key from termomix_key_press() to the PTY,
+ * back from it and to the screen, logs every stage and prints min, median,
+ * p99 and a histogram when termomix exits. Timestamps are taken when termomix
+ * sees the key, so the X server and input method delay isn't included */
+
+static void termomix_latency_init() {
+    int i;
+
+    if (!option_latency_trace)
+        return;
+
+    termomix.latency_log = fopen(option_latency_trace, "w");
+    if (!termomix.latency_log) {
+        fprintf(stderr, "Cannot open %s: %s\n", option_latency_trace,
+                g_strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    setvbuf(termomix.latency_log, NULL, _IOLBF, 0);
+    fprintf(termomix.latency_log, "# %s %s %s %s (ms)\n", latency_names[1],
+            latency_names[2], latency_names[3], latency_names[0]);
+
+    termomix.latency = g_queue_new();
+    for (i=0; i<LATENCY_STAGES; i++) {
+        termomix.latency_took[i] = g_array_new(FALSE, FALSE, sizeof(gint64));
+    }
+}
+
+
+static void termomix_latency_key(struct terminal *term) {
+    struct latency_sample *sample = g_new0(struct latency_sample, 1);
+
+    sample->term = term;
+    sample->at[LATENCY_KEY] = g_get_monotonic_time();
+    g_queue_push_tail(termomix.latency, sample);
+}
+
+
+/* Move the keys of term that got to the previous stage by time on to stage */
+static void termomix_latency_advance(struct terminal *term,
+        enum latency_stage stage, gint64 time) {
+    GList *l;
+
+    for (l=termomix.latency->head; l; l=l->next) {
+        struct latency_sample *sample = l->data;
+
+        if (sample->term == term && sample->at[stage-1] &&
+                !sample->at[stage] && sample->at[stage-1] <= time) {
+            sample->at[stage] = time;
+            /* A commit is one key, an echo or a frame can carry many */
+            if (stage == LATENCY_WRITE)
+                break;
+        }
+    }
+}
+
+
+static void termomix_latency_write(struct terminal *term) {
+    termomix_latency_advance(term, LATENCY_WRITE, g_get_monotonic_time());
+}
+
+
+static void termomix_latency_echo(struct terminal *term, gint64 read_time) {
+    termomix_latency_advance(term, LATENCY_ECHO, read_time);
+}
+
+
+static gboolean termomix_latency_draw(GtkWidget *widget, cairo_t *cr,
+        void *data) {
+    struct terminal *term = (struct terminal *)data;
+    gint64 now = g_get_monotonic_time(), took;
+    GList *l, *next;
+    int i;
+
+    termomix_latency_advance(term, LATENCY_DRAW, now);
+
+    for (l=termomix.latency->head; l; l=next) {
+        struct latency_sample *sample = l->data;
+
+        next = l->next;
+        if (sample->at[LATENCY_DRAW]) {
+            for (i=1; i<LATENCY_STAGES; i++) {
+                took = sample->at[i] - sample->at[i-1];
+                g_array_append_val(termomix.latency_took[i], took);
+                fprintf(termomix.latency_log, "%.3f ", took/1000.0);
+            }
+            took = sample->at[LATENCY_DRAW] - sample->at[LATENCY_KEY];
+            g_array_append_val(termomix.latency_took[LATENCY_KEY], took);
+            fprintf(termomix.latency_log, "%.3f\n", took/1000.0);
+        } else if (now - sample->at[LATENCY_KEY] > LATENCY_TIMEOUT) {
+            /* Not echoed, like a password */
+            termomix.latency_lost++;
+        } else {
+            continue;
+        }
+        g_free(sample);
+        g_queue_delete_link(termomix.latency, l);
+    }
+
+    return FALSE;
+}
+
+
+static void termomix_latency_forget(struct terminal *term) {
+    GList *l, *next;
+
+    if (!termomix.latency_log)
+        return;
+
+    for (l=termomix.latency->head; l; l=next) {
+        next = l->next;
+        if (((struct latency_sample *)l->data)->term == term) {
+            g_free(l->data);
+            g_queue_delete_link(termomix.latency, l);
+        }
+    }
+}
+
+
+static void termomix_latency_report() {
+    GArray *total;
+    guint buckets[LATENCY_BUCKETS] = {0}, most = 0, b, j;
+    int i;
+
+    if (!termomix.latency_log)
+        return;
+
+    fprintf(termomix.latency_log, "\n%-12s %8s %8s %8s %8s %6s\n", "stage",
+            "min ms", "median", "p99", "max", "keys");
+    for (i=1; i<=LATENCY_STAGES; i++) {
+        GArray *took = termomix.latency_took[i % LATENCY_STAGES];
+
+        if (!took->len)
+            continue;
+        g_array_sort(took, termomix_profile_compare);
+        fprintf(termomix.latency_log, "%-12s %8.3f %8.3f %8.3f %8.3f %6u\n",
+                latency_names[i % LATENCY_STAGES],
+                g_array_index(took, gint64, 0)/1000.0,
+                termomix_profile_percentile(took, 50)/1000.0,
+                termomix_profile_percentile(took, 99)/1000.0,
+                g_array_index(took, gint64, took->len-1)/1000.0, took->len);
+    }
+    fprintf(termomix.latency_log, "%u keys never showed up\n",
+            termomix.latency_lost + g_queue_get_length(termomix.latency));
+
+    /* Total latency in power of two buckets: <1 ms, 1-2 ms, 2-4 ms... */
+    total = termomix.latency_took[LATENCY_KEY];
+    for (j=0; j<total->len; j++) {
+        gint64 ms = g_array_index(total, gint64, j)/1000;
+
+        for (b=0; b<LATENCY_BUCKETS-1 && ms >= (1<<b); b++);
+        most = MAX(most, ++buckets[b]);
+    }
+    fprintf(termomix.latency_log, "\n");
+    for (b=0; b<LATENCY_BUCKETS && most; b++) {
+        fprintf(termomix.latency_log, "%5u ms %6u ", b ? 1<<(b-1) : 0,
+                buckets[b]);
+        for (j=0; j<(buckets[b]*50 + most-1)/most; j++) {
+            fputc('#', termomix.latency_log);
+        }
+        fputc('\n', termomix.latency_log);
+    }
+
+    for (i=0; i<LATENCY_STAGES; i++) {
+        g_array_free(termomix.latency_took[i], TRUE);
+    }
+    g_queue_free_full(termomix.latency, g_free);
+    fclose(termomix.latency_log);
+    termomix.latency_log = NULL;
+}
+
+
+/******* Metrics ********/
+
+static void termomix_histogram_add(struct histogram *h, double value) {
+    guint b;
+
+    for (b = 0; b < METRICS_BUCKETS && value > h->bounds[b]; b++);
+    h->counts[b]++;
+    h->sum += value;
+}
+
+
+static void termomix_metrics_init() {
+    termomix.metrics.feed_batch.bounds = feed_batch_bounds;
+    termomix.metrics.frame_time.bounds = frame_time_bounds;
+    termomix.metrics.key_latency.bounds = key_latency_bounds;
+}
+
+
+/* Serve the metrics on METRICS_SOCKET in the runtime dir. If another
+ * termomix has it, on metrics-PID.sock next to it */
+static void termomix_metrics_start() {
+    GSocketAddress *address;
+    GSocketClient *probe;
+    GSocketConnection *connection;
+    GError *gerror=NULL;
+    gchar *dir, *name;
+
+    if (termomix.metrics_service)
+        return;
+
+    dir = g_build_filename(g_get_user_runtime_dir(), "termomix", NULL);
+    g_mkdir_with_parents(dir, 0700);
+    termomix.metrics_socket = g_build_filename(dir, METRICS_SOCKET, NULL);
+    address = g_unix_socket_address_new(termomix.metrics_socket);
+
+    probe = g_socket_client_new();
+    connection = g_socket_client_connect(probe, G_SOCKET_CONNECTABLE(address),
+            NULL, NULL);
+    g_object_unref(probe);
+    if (connection) {
+        g_object_unref(connection);
+        g_object_unref(address);
+        g_free(termomix.metrics_socket);
+        name = g_strdup_printf("metrics-%d.sock", getpid());
+        termomix.metrics_socket = g_build_filename(dir, name, NULL);
+        address = g_unix_socket_address_new(termomix.metrics_socket);
+        g_free(name);
+    }
+    g_free(dir);
+    g_unlink(termomix.metrics_socket);
+
+    termomix.metrics_service = g_socket_service_new();
+    if (!g_socket_listener_add_address(
+            G_SOCKET_LISTENER(termomix.metrics_service), address,
+            G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_DEFAULT, NULL, NULL,
+            &gerror)) {
+        fprintf(stderr, "Cannot listen on %s: %s\n", termomix.metrics_socket,
+                gerror->message);
+        g_error_free(gerror);
+        g_object_unref(address);
+        g_object_unref(termomix.metrics_service);
+        termomix.metrics_service=NULL;
+        g_free(termomix.metrics_socket);
+        termomix.metrics_socket=NULL;
+        return;
+    }
+    g_object_unref(address);
+
+    g_signal_connect(G_OBJECT(termomix.metrics_service), "incoming",
+            G_CALLBACK(termomix_metrics_incoming), NULL);
+    g_socket_service_start(termomix.metrics_service);
+}
+
+
+static void termomix_metrics_stop() {
+    if (!termomix.metrics_service)
+        return;
+
+    g_socket_service_stop(termomix.metrics_service);
+    g_socket_listener_close(G_SOCKET_LISTENER(termomix.metrics_service));
+    g_object_unref(termomix.metrics_service);
+    termomix.metrics_service = NULL;
+    g_unlink(termomix.metrics_socket);
+    g_free(termomix.metrics_socket);
+    termomix.metrics_socket = NULL;
+    termomix.metrics.key_time = 0;
+}
+
+
+/* Every connection gets the metrics as an HTTP response, whatever it asks,
+ * so both curl --unix-socket and a plain socat work */
+static gboolean termomix_metrics_incoming(GSocketService *service,
+        GSocketConnection *connection, GObject *source, gpointer data) {
+    gchar *body, *reply;
+
+    /* Written from the main loop, don't let a stuck client freeze it */
+    g_socket_set_timeout(g_socket_connection_get_socket(connection), 2);
 
-    /* We don't want to see this if there's no background image */
-    if (!termomix.background) {
-        gtk_widget_hide(termomix.item_clear_background);
-    }
+    body = termomix_metrics_text();
+    reply = g_strdup_printf("HTTP/1.0 200 OK\r\n"
+            "Content-Type: text/plain; version=0.0.4\r\n"
+            "Content-Length: %zu\r\n\r\n%s", strlen(body), body);
+    g_output_stream_write_all(g_io_stream_get_output_stream(
+            G_IO_STREAM(connection)), reply, strlen(reply), NULL, NULL, NULL);
+    g_io_stream_close(G_IO_STREAM(connection), NULL, NULL);
+
+    g_free(reply);
+    g_free(body);
+
+    return FALSE;
 }
 
 
-static void termomix_destroy() {
-    g_key_file_free(termomix.cfg);
+/* The metrics in the Prometheus text format */
+static gchar *termomix_metrics_text() {
+    GString *out = g_string_new(NULL);
+    guint64 read_bytes = termomix.metrics.pty_read_closed;
+    guint64 lines = 0, cells = 0;
+    gchar *stat, *p, **fields, *label;
+    gchar number[G_ASCII_DTOSTR_BUF_SIZE];
+    long pages = 0;
+    double cpu;
+    GList *l;
+
+    for (l = termomix.terminals; l != NULL; l = l->next) {
+        struct terminal *term = (struct terminal *)l->data;
+        GtkAdjustment *adjustment = gtk_scrollable_get_vadjustment(
+                GTK_SCROLLABLE(term->vte));
+        glong rows = gtk_adjustment_get_upper(adjustment);
+
+        if (term->reader) {
+            read_bytes += term->reader->read_bytes;
+        }
+        lines += rows;
+        cells += rows * vte_terminal_get_column_count(VTE_TERMINAL(term->vte));
+    }
 
-    pango_font_description_free(termomix.font);
+    termomix_metrics_value(out, "termomix_pty_read_bytes_total", "counter",
+            "Bytes read from the PTYs", read_bytes);
+    termomix_metrics_value(out, "termomix_pty_written_bytes_total", "counter",
+            "Bytes written to the PTYs", termomix.metrics.pty_written);
+    termomix_metrics_histogram(out, "termomix_feed_batch_bytes",
+            "Bytes handed to VTE per feed", &termomix.metrics.feed_batch);
+    termomix_metrics_value(out, "termomix_frames_total", "counter",
+            "Frames drawn by all the terminals", termomix.frames);
+    termomix_metrics_histogram(out, "termomix_frame_seconds",
+            "Time to draw a frame", &termomix.metrics.frame_time);
+    termomix_metrics_histogram(out, "termomix_key_to_pty_seconds",
+            "Time from a key press to its input written to the PTY",
+            &termomix.metrics.key_latency);
+    termomix_metrics_value(out, "termomix_config_writes_total", "counter",
+            "Config file saves", termomix.metrics.config_writes);
+    termomix_metrics_value(out, "termomix_terminals", "gauge",
+            "Open terminals, pooled ones included",
+            g_list_length(termomix.terminals));
+    termomix_metrics_value(out, "termomix_scrollback_lines", "gauge",
+            "Lines in the scrollback and screen of all the terminals", lines);
+    termomix_metrics_value(out, "termomix_scrollback_bytes", "gauge",
+            "Estimated memory of those lines", cells * SCROLLBACK_CELL_BYTES);
+
+    if (g_file_get_contents("/proc/self/statm", &stat, NULL, NULL)) {
+        sscanf(stat, "%*s %ld", &pages);
+        g_free(stat);
+    }
+    termomix_metrics_value(out, "termomix_resident_memory_bytes", "gauge",
+            "Resident set size", (double)pages * sysconf(_SC_PAGESIZE));
+
+    g_string_append(out, "# HELP termomix_child_cpu_seconds_total CPU time of "
+            "the shell and its waited for children\n"
+            "# TYPE termomix_child_cpu_seconds_total counter\n");
+    for (l = termomix.terminals; l != NULL; l = l->next) {
+        struct terminal *term = (struct terminal *)l->data;
+
+        if (!term->reader || !term->pid)
+            continue;
+        label = g_strdup_printf("/proc/%d/stat", term->pid);
+        if (g_file_get_contents(label, &stat, NULL, NULL)) {
+            /* The fields after the command name, which may have spaces */
+            if ((p = strrchr(stat, ')'))) {
+                fields = g_strsplit(p + 2, " ", 16);
+                if (g_strv_length(fields) == 16) {
+                    cpu = (g_ascii_strtod(fields[11], NULL) +
+                            g_ascii_strtod(fields[12], NULL) +
+                            g_ascii_strtod(fields[13], NULL) +
+                            g_ascii_strtod(fields[14], NULL)) /
+                            sysconf(_SC_CLK_TCK);
+                    g_string_append_printf(out,
+                            "termomix_child_cpu_seconds_total{pid=\"%d\"} %s\n",
+                            term->pid, g_ascii_formatd(number, sizeof(number),
+                                "%.2f", cpu));
+                }
+                g_strfreev(fields);
+            }
+            g_free(stat);
+        }
+        g_free(label);
+    }
 
-    if (termomix.background)
-        free(termomix.background);
+    return g_string_free(out, FALSE);
+}
 
-    free(termomix.configfile);
 
-    gtk_main_quit();
+/* Numbers go through g_ascii_formatd(), a decimal comma would break the
+ * format */
+static void termomix_metrics_value(GString *out, const gchar *name,
+        const gchar *type, const gchar *help, double value) {
+    gchar number[G_ASCII_DTOSTR_BUF_SIZE];
+
+    g_string_append_printf(out, "# HELP %s %s\n# TYPE %s %s\n%s %s\n",
+            name, help, name, type, name,
+            g_ascii_formatd(number, sizeof(number), "%.15g", value));
 }
 
 
-static void termomix_set_size(gint columns, gint rows) {
-    gint pad_x, pad_y;
-    gint char_width, char_height;
+static void termomix_metrics_histogram(GString *out, const gchar *name,
+        const gchar *help, const struct histogram *h) {
+    gchar number[G_ASCII_DTOSTR_BUF_SIZE];
+    guint64 count = 0;
+    guint b;
 
-    /* Mayhaps an user resize happened. Check if row and columns have changed */
-    if (termomix.resized) {
-        termomix.columns=vte_terminal_get_column_count(VTE_TERMINAL(termomix.term->vte));
-        termomix.rows=vte_terminal_get_row_count(VTE_TERMINAL(termomix.term->vte));
-        termomix.resized=FALSE;
+    g_string_append_printf(out, "# HELP %s %s\n# TYPE %s histogram\n",
+            name, help, name);
+    for (b = 0; b < METRICS_BUCKETS; b++) {
+        count += h->counts[b];
+        g_string_append_printf(out, "%s_bucket{le=\"%s\"} %" G_GUINT64_FORMAT "\n",
+                name, g_ascii_formatd(number, sizeof(number), "%g", h->bounds[b]),
+                count);
     }
+    count += h->counts[METRICS_BUCKETS];
+    g_string_append_printf(out, "%s_bucket{le=\"+Inf\"} %" G_GUINT64_FORMAT "\n",
+            name, count);
+    g_string_append_printf(out, "%s_sum %s\n%s_count %" G_GUINT64_FORMAT "\n",
+            name, g_ascii_formatd(number, sizeof(number), "%.15g", h->sum),
+            name, count);
+}
 
-    gtk_widget_style_get(termomix.term->vte, "inner-border", &termomix.term->border, NULL);
-    pad_x = termomix.term->border->left + termomix.term->border->right;
-    pad_y = termomix.term->border->top + termomix.term->border->bottom;
-    char_width = vte_terminal_get_char_width(VTE_TERMINAL(termomix.term->vte));
-    char_height = vte_terminal_get_char_height(VTE_TERMINAL(termomix.term->vte));
 
-    termomix.width = pad_x + (char_width * termomix.columns);
-    termomix.height = pad_y + (char_height * termomix.rows);
+/******* Remote control ********/
 
-    /* GTK ignores resizes for maximized windows, so we don't need no check if
-     * it's maximized or not
-     */
-    gtk_window_resize(GTK_WINDOW(termomix.main_window), termomix.width, termomix.height);
+/* Listen on control-PID.sock in the runtime dir. The shells get its path
+ * and their window id in CONTROL_SOCKET_ENV and CONTROL_WINDOW_ENV */
+static void termomix_control_start() {
+    GSocketAddress *address;
+    GError *gerror=NULL;
+    gchar *name, *dir;
+
+    if (termomix.control_service)
+        return;
+
+    dir = g_build_filename(g_get_user_runtime_dir(), "termomix", NULL);
+    g_mkdir_with_parents(dir, 0700);
+    name = g_strdup_printf("control-%d.sock", getpid());
+    termomix.control_socket = g_build_filename(dir, name, NULL);
+    g_free(name);
+    g_free(dir);
+    g_unlink(termomix.control_socket);
+
+    address = g_unix_socket_address_new(termomix.control_socket);
+    termomix.control_service = g_socket_service_new();
+    if (!g_socket_listener_add_address(
+            G_SOCKET_LISTENER(termomix.control_service), address,
+            G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_DEFAULT, NULL, NULL,
+            &gerror)) {
+        fprintf(stderr, "Cannot listen on %s: %s\n", termomix.control_socket,
+                gerror->message);
+        g_error_free(gerror);
+        g_object_unref(address);
+        g_object_unref(termomix.control_service);
+        termomix.control_service=NULL;
+        g_free(termomix.control_socket);
+        termomix.control_socket=NULL;
+        return;
+    }
+    g_object_unref(address);
+
+    g_signal_connect(G_OBJECT(termomix.control_service), "incoming",
+            G_CALLBACK(termomix_control_incoming), NULL);
+    g_socket_service_start(termomix.control_service);
 }
 
 
-static void termomix_set_font() {
-    vte_terminal_set_font(VTE_TERMINAL(termomix.term->vte), termomix.font);
+static void termomix_control_stop() {
+    if (!termomix.control_service)
+        return;
+
+    g_socket_service_stop(termomix.control_service);
+    g_socket_listener_close(G_SOCKET_LISTENER(termomix.control_service));
+    g_object_unref(termomix.control_service);
+    termomix.control_service = NULL;
+    g_unlink(termomix.control_socket);
+    g_free(termomix.control_socket);
+    termomix.control_socket = NULL;
 }
 
 
-static void termomix_init_terminal() {
-    gchar *cwd = NULL;
+/* A termomix @ request: the client cwd, the window id (empty for the last
+ * active one), the command and its arguments, every field terminated by a
+ * NUL byte. The reply is "ok" or "error: ..." on a line, then the output */
+static gboolean termomix_control_incoming(GSocketService *service,
+        GSocketConnection *connection, GObject *source, gpointer data) {
+    GInputStream *in;
+    GOutputStream *out;
+    GError *gerror=NULL;
+    GPtrArray *fields;
+    GString *reply;
+    struct terminal *term;
+    gchar *request, *p, *end, *error;
+    gsize len=0;
+
+    /* The main loop is blocked while we read, don't let a stuck client
+     * freeze every window */
+    g_socket_set_timeout(g_socket_connection_get_socket(connection), 2);
+
+    in = g_io_stream_get_input_stream(G_IO_STREAM(connection));
+    out = g_io_stream_get_output_stream(G_IO_STREAM(connection));
+    request = g_malloc(CONTROL_REQUEST_MAX);
+    if (!g_input_stream_read_all(in, request, CONTROL_REQUEST_MAX, &len, NULL,
+            &gerror)) {
+        fprintf(stderr, "Remote control request failed: %s\n", gerror->message);
+        g_error_free(gerror);
+        g_free(request);
+        return FALSE;
+    }
 
-    termomix.term = g_new0( struct terminal, 1 );
-    termomix.term->hbox=gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
-    termomix.term->vte=vte_terminal_new();
+    fields = g_ptr_array_new();
+    for (p = request, end = request+len; p < end; p += strlen(p)+1) {
+        if (!memchr(p, '\0', end-p))
+            break;
+        g_ptr_array_add(fields, p);
+    }
+    g_ptr_array_add(fields, NULL);
+
+    reply = g_string_new("ok\n");
+    if (len == CONTROL_REQUEST_MAX) {
+        error = g_strdup("request too long");
+    } else if (fields->len < 4) {
+        /* At least a cwd, a window and a command */
+        error = g_strdup("bad request");
+    } else if (!(term = termomix_control_find(fields->pdata[1]))) {
+        error = g_strdup_printf("no window %s", (gchar *)fields->pdata[1]);
+    } else {
+        error = termomix_control_run(term, fields->pdata[0],
+                (gchar **)fields->pdata + 2, reply);
+    }
+    if (error) {
+        g_string_printf(reply, "error: %s\n", error);
+        g_free(error);
+    }
 
-    /* Init vte */
-    vte_terminal_set_scrollback_lines(VTE_TERMINAL(termomix.term->vte), SCROLL_LINES);
-    vte_terminal_match_add_gregex(VTE_TERMINAL(termomix.term->vte), termomix.http_regexp, 0);
-    vte_terminal_set_mouse_autohide(VTE_TERMINAL(termomix.term->vte), TRUE);
-    
-    gtk_box_pack_start(GTK_BOX(termomix.term->hbox), termomix.term->vte, TRUE, TRUE, 0);
+    g_output_stream_write_all(out, reply->str, reply->len, NULL, NULL, NULL);
+    g_io_stream_close(G_IO_STREAM(connection), NULL, NULL);
 
-    cwd = g_get_current_dir();
-   
-    gtk_container_add(GTK_CONTAINER(termomix.main_window), termomix.term->hbox); 
+    g_string_free(reply, TRUE);
+    g_ptr_array_free(fields, TRUE);
+    g_free(request);
 
+    return FALSE;
+}
 
-    /* vte signals */
-    g_signal_connect(G_OBJECT(termomix.term->vte), "increase-font-size",
-            G_CALLBACK(termomix_increase_font), NULL);
-    g_signal_connect(G_OBJECT(termomix.term->vte), "decrease-font-size",
-            G_CALLBACK(termomix_decrease_font), NULL);
-    g_signal_connect(G_OBJECT(termomix.term->vte), "child-exited",
-            G_CALLBACK(termomix_child_exited), NULL);
-    g_signal_connect(G_OBJECT(termomix.term->vte), "eof",
-            G_CALLBACK(termomix_eof), NULL);
-    g_signal_connect_swapped(G_OBJECT(termomix.term->vte), "button-press-event",
-            G_CALLBACK(termomix_button_press), termomix.menu);
 
-    termomix_set_font();
-    /* Set size before showing the widgets but after setting the font */
-    termomix_set_size(termomix.columns, termomix.rows);
+static struct terminal *termomix_control_find(const gchar *id) {
+    GList *l;
 
-    gtk_widget_show_all(termomix.term->hbox);
+    /* Pooled terminals are hidden warm shells, not windows. ls skips them
+     * and so must everything else */
+    if (!*id)
+        return g_list_find(termomix.pool, termomix.term) ? NULL : termomix.term;
 
-    if (option_geometry) {
-        if (!gtk_window_parse_geometry(GTK_WINDOW(termomix.main_window), option_geometry)) {
-            fprintf(stderr, "Invalid geometry.\n");
-            gtk_widget_show(termomix.main_window);
-        } else {
-            gtk_widget_show(termomix.main_window);
-            termomix.columns = VTE_TERMINAL(termomix.term->vte)->column_count;
-            termomix.rows = VTE_TERMINAL(termomix.term->vte)->row_count;
+    for (l = termomix.terminals; l != NULL; l = l->next) {
+        struct terminal *term = (struct terminal *)l->data;
+        if (strtoul(id, NULL, 10) == term->id) {
+            return g_list_find(termomix.pool, term) ? NULL : term;
         }
-    } else {
-        gtk_widget_show(termomix.main_window);
     }
+    return NULL;
+}
 
-    if (option_execute||option_xterm_execute) {
-        int command_argc; char **command_argv;
-        GError *gerror = NULL;
-        gchar *path;
-
-        if(option_execute) {
-                /* -x option */
-                if (!g_shell_parse_argv(option_execute, &command_argc, &command_argv, &gerror)) {
-                    switch (gerror->code) {
-                        case G_SHELL_ERROR_EMPTY_STRING:
-                            termomix_error("Empty exec string");
-                            exit(1);
-                            break;
-                        case G_SHELL_ERROR_BAD_QUOTING: 
-                            termomix_error("Cannot parse command line arguments: mangled quoting");
-                            exit(1);
-                            break;
-                        case G_SHELL_ERROR_FAILED:
-                            termomix_error("Error in exec option command line arguments");
-                            exit(1);
-                    }
-                } else {
-                }
-            } else {
-                /* -e option - last in the command line */
-                gchar *command_joined;
-                /* the xterm -e command takes all extra arguments */
-                command_joined = g_strjoinv(" ", option_xterm_args);
-                if (!g_shell_parse_argv(command_joined, &command_argc, &command_argv, &gerror)) {
-                    switch (gerror->code) {
-                        case G_SHELL_ERROR_EMPTY_STRING:
-                            termomix_error("Empty exec string");
-                            exit(1);
-                            break;
-                        case G_SHELL_ERROR_BAD_QUOTING: 
-                            termomix_error("Cannot parse command line arguments: mangled quoting");
-                            exit(1);
-                        case G_SHELL_ERROR_FAILED:
-                            termomix_error("Error in exec option command line arguments");
-                            exit(1);
-                    }
-                }
-                g_free(command_joined);
-            }
 
-            /* Check if the command is valid */
-            path=g_find_program_in_path(command_argv[0]);
-            if (path) {
-                vte_terminal_fork_command_full(VTE_TERMINAL(termomix.term->vte),
-                        VTE_PTY_DEFAULT, NULL, command_argv, NULL,
-                        G_SPAWN_SEARCH_PATH, NULL, NULL, &termomix.term->pid,
-                        NULL);
-            } else {
-                termomix_error("%s binary not found", command_argv[0]);
-                exit(1);
+/* Run a remote control command on term, appending its output to out.
+ * Returns NULL, or what went wrong */
+static gchar *termomix_control_run(struct terminal *term, const gchar *cwd,
+        gchar **argv, GString *out) {
+    VteTerminal *vte = VTE_TERMINAL(term->vte);
+    GtkAdjustment *adjustment;
+    GdkColor color;
+    GList *l;
+    const gchar *cmd = argv[0];
+    gchar *text, *path, *value;
+    glong lower, upper, start, end;
+    gint size, step, i;
+    gdouble number;
+
+    adjustment = gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(term->vte));
+    lower = gtk_adjustment_get_lower(adjustment);
+    upper = gtk_adjustment_get_upper(adjustment);
+
+    if (strcmp(cmd, "ls") == 0) {
+        for (l = termomix.terminals; l != NULL; l = l->next) {
+            struct terminal *t = (struct terminal *)l->data;
+            if (g_list_find(termomix.pool, t))
+                continue;
+            g_string_append_printf(out, "%u\t%d\t%ldx%ld\t%s\n", t->id, t->pid,
+                    vte_terminal_get_column_count(VTE_TERMINAL(t->vte)),
+                    vte_terminal_get_row_count(VTE_TERMINAL(t->vte)),
+                    gtk_window_get_title(GTK_WINDOW(t->window)));
+        }
+    } else if (strcmp(cmd, "send-text") == 0) {
+        if (!argv[1])
+            return g_strdup("send-text needs the text");
+        if (!term->reader)
+            return g_strdup("the shell has exited");
+        termomix_pty_write(term, argv[1], strlen(argv[1]));
+    } else if (strcmp(cmd, "get-text") == 0) {
+        /* What the window shows, scrolled back or not */
+        start = gtk_adjustment_get_value(adjustment);
+        text = termomix_snapshot_text(term, start,
+                start + vte_terminal_get_row_count(vte));
+        g_string_append(out, text);
+        g_free(text);
+    } else if (strcmp(cmd, "get-scrollback") == 0) {
+        /* Lines from 0, the oldest kept, to the bottom of the screen.
+         * Negative ones count from the end */
+        start = argv[1] ? strtol(argv[1], NULL, 10) : 0;
+        end = argv[1] && argv[2] ? strtol(argv[2], NULL, 10) : upper - lower;
+        start += start < 0 ? upper : lower;
+        end += end < 0 ? upper : lower;
+        text = termomix_snapshot_text(term, start, end);
+        g_string_append(out, text);
+        g_free(text);
+    } else if (strcmp(cmd, "set-title") == 0) {
+        if (!argv[1])
+            return g_strdup("set-title needs the title");
+        gtk_window_set_title(GTK_WINDOW(term->window), argv[1]);
+    } else if (strcmp(cmd, "set-font-size") == 0) {
+        if (!argv[1])
+            return g_strdup("set-font-size needs a size, or +N or -N");
+        /* Through the Ctrl+/- path, so a burst of them is one change */
+        size = termomix.font_size_pending ? termomix.font_size_pending :
+                pango_font_description_get_size(termomix.font);
+        number = g_ascii_strtod(argv[1], &value);
+        if (value == argv[1] || *value || !isfinite(number) ||
+                fabs(number) > FONT_MAXIMAL_SIZE/PANGO_SCALE) {
+            return g_strdup_printf("bad font size %s", argv[1]);
+        }
+        if (argv[1][0] == '+' || argv[1][0] == '-') {
+            step = number * PANGO_SCALE;
+        } else {
+            step = number * PANGO_SCALE - size;
+        }
+        if (size + step < FONT_MINIMAL_SIZE || size + step > FONT_MAXIMAL_SIZE) {
+            return g_strdup_printf("font size out of range (%d to %d)",
+                    FONT_MINIMAL_SIZE/PANGO_SCALE, FONT_MAXIMAL_SIZE/PANGO_SCALE);
+        }
+        termomix.term = term;
+        termomix_font_step(step);
+    } else if (strcmp(cmd, "set-colors") == 0) {
+        /* Only for this window, the configured colors stay */
+        for (i = 1; argv[i]; i++) {
+            value = strchr(argv[i], '=');
+            if (!value || !gdk_color_parse(value + 1, &color)) {
+                return g_strdup_printf("bad color %s", argv[i]);
             }
-            free(path);
-            g_strfreev(command_argv); g_strfreev(option_xterm_args);
-        } else { /* No execute option */
-            if (option_hold==TRUE) {
-                termomix_error("Hold option given without any command");
-                option_hold=FALSE;
+            if (g_str_has_prefix(argv[i], "fg=")) {
+                vte_terminal_set_color_foreground(vte, &color);
+            } else if (g_str_has_prefix(argv[i], "bg=")) {
+                vte_terminal_set_color_background(vte, &color);
+            } else if (g_str_has_prefix(argv[i], "cursor=")) {
+                vte_terminal_set_color_cursor(vte, &color);
+            } else {
+                return g_strdup_printf("unknown color %s, use fg, bg or cursor",
+                        argv[i]);
             }
-            vte_terminal_fork_command_full(VTE_TERMINAL(termomix.term->vte),
-                    VTE_PTY_DEFAULT, cwd, termomix.argv, NULL,
-                    G_SPAWN_SEARCH_PATH|G_SPAWN_FILE_AND_ARGV_ZERO, NULL, NULL,
-                    &termomix.term->pid, NULL);
         }
-    /* Not the first tab */
+    } else if (strcmp(cmd, "get-pid") == 0) {
+        g_string_append_printf(out, "%d\n", term->pid);
+    } else if (strcmp(cmd, "get-cwd") == 0) {
+        path = g_strdup_printf("/proc/%d/cwd", term->pid);
+        text = g_file_read_link(path, NULL);
+        g_free(path);
+        if (!text)
+            return g_strdup("cannot read the shell cwd");
+        g_string_append_printf(out, "%s\n", text);
+        g_free(text);
+    } else if (strcmp(cmd, "export") == 0) {
+        if (!argv[1])
+            return g_strdup("export needs a file");
+        path = g_path_is_absolute(argv[1]) ? g_strdup(argv[1]) :
+                g_build_filename(cwd, argv[1], NULL);
+        termomix_export_start(term, path,
+                argv[2] && strcmp(argv[2], "--ansi") == 0);
+        g_free(path);
+    } else if (strcmp(cmd, "search") == 0) {
+        return termomix_control_search(term, argv + 1, out);
+    } else {
+        return g_strdup_printf("unknown command %s", cmd);
+    }
 
-    free(cwd);
+    return NULL;
+}
 
-    /* Configuration for the newly created terminal */
-    GdkColor white={0, 255, 255, 255};
-    vte_terminal_set_color_background(VTE_TERMINAL (termomix.term->vte), &white);
-    vte_terminal_set_backspace_binding(VTE_TERMINAL(termomix.term->vte),
-            VTE_ERASE_ASCII_DELETE);
-    vte_terminal_set_colors(VTE_TERMINAL(termomix.term->vte), &termomix.forecolor,
-            &termomix.backcolor, termomix.palette, PALETTE_SIZE);
-    if (termomix.has_rgba) {
-        vte_terminal_set_opacity(VTE_TERMINAL (termomix.term->vte),
-                (termomix.opacity_level*65535)/99); /* 0-99 value */
+
+/* search [--regex] [--scan] TEXT: the newest match, like typing TEXT in the
+ * search bar, and how long it took. --scan reads every block, as without
+ * the index. Prints the line (0 is the oldest kept) and column of the match,
+ * or -1 and -1, the microseconds, the blocks read from VTE out of all of
+ * them, and the history lines the index can take but hasn't got to yet */
+static gchar *termomix_control_search(struct terminal *term, gchar **argv,
+        GString *out) {
+    GtkAdjustment *adjustment;
+    struct search_match found;
+    GRegex *regex;
+    GArray *bits;
+    glong lower, upper, pending;
+    gint64 took;
+    guint read = 0, blocks;
+    bool regex_mode = false, scan = false, hit;
+
+    for (; *argv && g_str_has_prefix(*argv, "--"); argv++) {
+        if (strcmp(*argv, "--regex") == 0) {
+            regex_mode = true;
+        } else if (strcmp(*argv, "--scan") == 0) {
+            scan = true;
+        } else {
+            return g_strdup_printf("unknown option %s", *argv);
+        }
+    }
+    if (!*argv)
+        return g_strdup("search needs the text");
+
+    regex = termomix_search_compile(*argv, regex_mode, &bits);
+    if (!regex)
+        return g_strdup("bad search");
+    if (!term->search) {
+        term->search = termomix_search_new(term);
     }
 
-    if (termomix.background) {
-        termomix_set_bgimage(termomix.background);
+    took = g_get_monotonic_time();
+    hit = termomix_search_find(term, regex, scan ? NULL : bits, true, NULL,
+            &found, &read);
+    took = g_get_monotonic_time() - took;
+
+    adjustment = gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(term->vte));
+    lower = gtk_adjustment_get_lower(adjustment);
+    upper = gtk_adjustment_get_upper(adjustment);
+    g_mutex_lock(&term->search->lock);
+    blocks = (upper - term->search->first + SEARCH_BLOCK_ROWS - 1)/
+            SEARCH_BLOCK_ROWS;
+    /* The last rows of history wait for the lines they may wrap into */
+    pending = upper - vte_terminal_get_row_count(VTE_TERMINAL(term->vte)) -
+            (2*SEARCH_BLOCK_ROWS - 1) - (term->search->first +
+            (glong)term->search->blooms->len*SEARCH_BLOCK_ROWS);
+    g_mutex_unlock(&term->search->lock);
+
+    g_string_append_printf(out, "%ld\t%ld\t%" G_GINT64_FORMAT "\t%u\t%u\t%ld\n",
+            hit ? found.row - lower : -1, hit ? found.column : -1, took,
+            read, blocks, MAX(pending, 0));
+
+    g_regex_unref(regex);
+    if (bits) {
+        g_array_free(bits, TRUE);
     }
+    return NULL;
+}
 
-    if (termomix.word_chars) {
-        vte_terminal_set_word_chars( VTE_TERMINAL (termomix.term->vte),
-                termomix.word_chars );
+
+static void termomix_snapshot_changed(VteTerminal *vte, gpointer data) {
+    ((struct terminal *)data)->contents_version++;
+}
+
+
+/* Text of a row, with a newline unless it wraps into the next one */
+static gchar *termomix_snapshot_row(VteTerminal *vte, glong row) {
+    return vte_terminal_get_text_range(vte, row, 0, row,
+            vte_terminal_get_column_count(vte)-1, termomix_export_all,
+            NULL, NULL);
+}
+
+
+/* Text of the buffer rows from start to end. History rows come from the
+ * cache, and only the ones never asked for before are read from VTE */
+static gchar *termomix_snapshot_text(struct terminal *term, glong start,
+        glong end) {
+    VteTerminal *vte = VTE_TERMINAL(term->vte);
+    GtkAdjustment *adjustment;
+    struct snapshot *snapshot = term->snapshot;
+    GString *out;
+    glong lower, upper, top, columns, row;
+
+    adjustment = gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(term->vte));
+    lower = gtk_adjustment_get_lower(adjustment);
+    upper = gtk_adjustment_get_upper(adjustment);
+    columns = vte_terminal_get_column_count(vte);
+    top = upper - vte_terminal_get_row_count(vte);
+    start = MAX(start, lower);
+    end = MIN(end, upper);
+
+    if (!snapshot) {
+        snapshot = term->snapshot = g_new0(struct snapshot, 1);
+        snapshot->rows = g_ptr_array_new_with_free_func(g_free);
+        snapshot->screen = g_ptr_array_new_with_free_func(g_free);
     }
 
-    /* Change cursor */    
-    vte_terminal_set_cursor_shape (VTE_TERMINAL(termomix.term->vte),
-            termomix.cursor_type);
+    /* Another width, a cleared history or the alternate screen */
+    if (columns != snapshot->columns || snapshot->first > lower ||
+            snapshot->first + (glong)snapshot->rows->len > top ||
+            (term->reader && term->reader->history_resets != snapshot->resets)) {
+        g_ptr_array_set_size(snapshot->rows, 0);
+        snapshot->first = lower;
+        snapshot->columns = columns;
+        snapshot->version = term->contents_version - 1;
+        if (term->reader) {
+            snapshot->resets = term->reader->history_resets;
+        }
+    }
+    /* Rows that fell off the top of the history */
+    if (snapshot->first < lower) {
+        g_ptr_array_remove_range(snapshot->rows, 0,
+                MIN(lower - snapshot->first, (glong)snapshot->rows->len));
+        snapshot->first = lower;
+    }
+
+    for (row = snapshot->first + snapshot->rows->len; row < MIN(end, top); row++) {
+        g_ptr_array_add(snapshot->rows, termomix_snapshot_row(vte, row));
+    }
+    if (end > top && (snapshot->version != term->contents_version ||
+                snapshot->screen_top != top)) {
+        g_ptr_array_set_size(snapshot->screen, 0);
+        for (row = top; row < upper; row++) {
+            g_ptr_array_add(snapshot->screen, termomix_snapshot_row(vte, row));
+        }
+        snapshot->screen_top = top;
+        snapshot->version = term->contents_version;
+    }
+
+    out = g_string_new(NULL);
+    for (row = start; row < end; row++) {
+        g_string_append(out, row < top ?
+                g_ptr_array_index(snapshot->rows, row - snapshot->first) :
+                g_ptr_array_index(snapshot->screen, row - top));
+    }
+    return g_string_free(out, FALSE);
+}
+
+
+static void termomix_snapshot_free(struct terminal *term) {
+    if (!term->snapshot)
+        return;
 
-    gtk_widget_grab_focus(termomix.term->vte);
+    g_ptr_array_free(term->snapshot->rows, TRUE);
+    g_ptr_array_free(term->snapshot->screen, TRUE);
+    g_free(term->snapshot);
+    term->snapshot = NULL;
 }
 
-static void termomix_set_bgimage(char *infile) {
-    GError *gerror=NULL;
-    GdkPixbuf *pixbuf=NULL;
 
-    /* Check file existence and type */
-    if (g_file_test(infile, G_FILE_TEST_IS_REGULAR)) {
+/* termomix @ [--to SOCKET] [--window ID] COMMAND [ARGS...] */
+static int termomix_control_client(int argc, char **argv) {
+    GSocketAddress *address;
+    GSocketClient *client;
+    GSocketConnection *connection;
+    GDataInputStream *in;
+    GString *request, *text;
+    const gchar *socket = g_getenv(CONTROL_SOCKET_ENV);
+    const gchar *window = g_getenv(CONTROL_WINDOW_ENV);
+    gchar *cwd, *reply, buf[4096];
+    gssize n;
+    int i = 0;
+
+    for (; i+1 < argc && argv[i][0] == '-'; i += 2) {
+        if (strcmp(argv[i], "--to") == 0) {
+            socket = argv[i+1];
+        } else if (strcmp(argv[i], "--window") == 0) {
+            window = argv[i+1];
+        } else {
+            break;
+        }
+    }
+    if (i >= argc || argv[i][0] == '-') {
+        fprintf(stderr, "Usage: termomix @ [--to SOCKET] [--window ID] COMMAND [ARGS]\n"
+                "Commands: ls, send-text TEXT|-, get-text, get-scrollback [START [END]],\n"
+                "  set-title TITLE, set-font-size [+|-]SIZE,\n"
+                "  set-colors [fg=COLOR] [bg=COLOR] [cursor=COLOR], get-pid, get-cwd,\n"
+                "  export FILE [--ansi], search [--regex] [--scan] TEXT\n");
+        return EXIT_FAILURE;
+    }
+    if (!socket) {
+        fprintf(stderr, "termomix @: not inside a termomix window, use --to SOCKET\n");
+        return EXIT_FAILURE;
+    }
 
-        pixbuf = gdk_pixbuf_new_from_file (infile, &gerror);
-        if (!pixbuf) {
-            termomix_error("Error loading image file: %s\n", gerror->message);
+    cwd = g_get_current_dir();
+    request = g_string_new(NULL);
+    g_string_append_len(request, cwd, strlen(cwd)+1);
+    g_string_append_len(request, window ? window : "", window ? strlen(window)+1 : 1);
+    g_free(cwd);
+    for (; i < argc; i++) {
+        /* send-text - sends stdin */
+        if (i > 0 && strcmp(argv[i], "-") == 0 &&
+                strcmp(argv[i-1], "send-text") == 0) {
+            text = g_string_new(NULL);
+            while ((n = read(STDIN_FILENO, buf, sizeof(buf))) > 0) {
+                g_string_append_len(text, buf, n);
+            }
+            g_string_append_len(request, text->str, strlen(text->str)+1);
+            g_string_free(text, TRUE);
         } else {
-            vte_terminal_set_background_image(VTE_TERMINAL(termomix.term->vte), pixbuf);
-            vte_terminal_set_background_saturation(VTE_TERMINAL(termomix.term->vte), TRUE);
-            vte_terminal_set_background_transparent(VTE_TERMINAL(termomix.term->vte),FALSE);
+            g_string_append_len(request, argv[i], strlen(argv[i])+1);
+        }
+    }
+
+    address = g_unix_socket_address_new(socket);
+    client = g_socket_client_new();
+    connection = g_socket_client_connect(client, G_SOCKET_CONNECTABLE(address),
+            NULL, NULL);
+    g_object_unref(client);
+    g_object_unref(address);
+    if (!connection) {
+        fprintf(stderr, "termomix @: cannot connect to %s\n", socket);
+        g_string_free(request, TRUE);
+        return EXIT_FAILURE;
+    }
+
+    g_output_stream_write_all(g_io_stream_get_output_stream(
+            G_IO_STREAM(connection)), request->str, request->len, NULL, NULL,
+            NULL);
+    g_string_free(request, TRUE);
+    g_socket_shutdown(g_socket_connection_get_socket(connection), FALSE, TRUE,
+            NULL);
+
+    in = g_data_input_stream_new(g_io_stream_get_input_stream(
+            G_IO_STREAM(connection)));
+    reply = g_data_input_stream_read_line(in, NULL, NULL, NULL);
+    if (!reply || strcmp(reply, "ok") != 0) {
+        fprintf(stderr, "termomix @: %s\n", reply ? reply :
+                "termomix closed the connection");
+        g_free(reply);
+        g_object_unref(in);
+        g_object_unref(connection);
+        return EXIT_FAILURE;
+    }
+    while ((n = g_input_stream_read(G_INPUT_STREAM(in), buf, sizeof(buf),
+                    NULL, NULL)) > 0) {
+        fwrite(buf, 1, n, stdout);
+    }
+    g_free(reply);
+    g_object_unref(in);
+    g_object_unref(connection);
 
-            termomix_set_config_string("background", infile);
+    return EXIT_SUCCESS;
+}
+
+
+/* Rewrites argv to include a -- after the -e argument this is required to make
+ * sure GOption doesn't grab any arguments meant for the command being called */
+static gchar **termomix_rewrite_args(int argc, char **argv, int *nargc) {
+    gchar **nargv;
+    int i, n;
+
+    /* Initialize nargv */
+    nargv = g_new0(gchar *, argc+2);
+    n=0; *nargc=argc;
+
+    for(i=0; i<argc; i++) {
+        if(g_strcmp0(argv[i],"-e") == 0)
+        {
+            nargv[n]=g_strdup("-e");
+            n++;
+            nargv[n]=g_strdup("--");
+            *nargc = argc+1;
+        } else {
+            nargv[n]=g_strdup(argv[i]);
         }
+        n++;
     }
+
+    return nargv;
 }
 
 
-static void termomix_set_config_key(const gchar *key, guint value) {
-    char *valname;
+/* Forget the options of the previous daemon request */
+static void termomix_reset_options() {
+    g_free((gchar *)option_execute); option_execute=NULL;
+    g_free((gchar *)option_title); option_title=NULL;
+    g_free((gchar *)option_geometry); option_geometry=NULL;
+    g_strfreev(option_xterm_args); option_xterm_args=NULL;
+    option_xterm_execute=FALSE;
+    option_login=FALSE;
+    option_rows=0; option_columns=0;
+    option_hold=FALSE;
+}
 
-    valname=gdk_keyval_name(value);
-    g_key_file_set_string(termomix.cfg, cfg_group, key, valname);
-    termomix.config_modified=TRUE;
-    //FIXME: free() valname?
-} 
 
+static gchar *termomix_daemon_socket_path() {
+    return g_build_filename(g_get_user_runtime_dir(), "termomix",
+            DAEMON_SOCKET, NULL);
+}
 
-static guint termomix_get_config_key(const gchar *key) {
-    gchar *value;
-    guint retval=GDK_KEY_VoidSymbol;
 
-    value=g_key_file_get_string(termomix.cfg, cfg_group, key, NULL);
-    if (value!=NULL){
-        retval=gdk_keyval_from_name(value);
-        g_free(value);
+/* Tell the client waiting on term how its request ended */
+static void termomix_daemon_reply(struct terminal *term, const gchar *reply) {
+    GOutputStream *out;
+    gchar *line;
+
+    if (!term->client)
+        return;
+
+    out = g_io_stream_get_output_stream(G_IO_STREAM(term->client));
+    line = g_strdup_printf("%s\n", reply);
+    g_output_stream_write_all(out, line, strlen(line), NULL, NULL, NULL);
+    g_free(line);
+
+    g_io_stream_close(G_IO_STREAM(term->client), NULL, NULL);
+    g_object_unref(term->client);
+    term->client=NULL;
+}
+
+
+/* A client asks for a new window. The request is the client cwd followed by
+ * its command line, every field terminated by a NUL byte */
+static gboolean termomix_daemon_incoming(GSocketService *service,
+        GSocketConnection *connection, GObject *source, gpointer data) {
+    GInputStream *in;
+    GOptionContext *context;
+    GError *gerror=NULL;
+    gchar *request, *p, *end;
+    gchar **args, **nargv;
+    GPtrArray *fields;
+    gsize len=0;
+    int nargc;
+
+    /* The main loop is blocked while we read, don't let a stuck client
+     * freeze every window */
+    g_socket_set_timeout(g_socket_connection_get_socket(connection), 2);
+
+    in = g_io_stream_get_input_stream(G_IO_STREAM(connection));
+    request = g_malloc(DAEMON_REQUEST_MAX);
+    if (!g_input_stream_read_all(in, request, DAEMON_REQUEST_MAX, &len, NULL,
+            &gerror)) {
+        fprintf(stderr, "Daemon request failed: %s\n", gerror->message);
+        g_error_free(gerror);
+        g_free(request);
+        return FALSE;
     }
 
-    /* For backwards compatibility with integer values */
-    /* If gdk_keyval_from_name fail, it seems to be integer value*/
-    if ((retval==GDK_KEY_VoidSymbol)||(retval==0)) {
-        retval=g_key_file_get_integer(termomix.cfg, cfg_group, key, NULL);
+    fields = g_ptr_array_new();
+    for (p = request, end = request+len; p < end; p += strlen(p)+1) {
+        if (!memchr(p, '\0', end-p))
+            break;
+        g_ptr_array_add(fields, p);
+    }
+    g_ptr_array_add(fields, NULL);
+
+    if (len == DAEMON_REQUEST_MAX || fields->len < 3) {
+        /* At least a cwd and argv[0], and nothing cut off at the end */
+        const gchar *reply = len == DAEMON_REQUEST_MAX ?
+                "error: request too long\n" : "error: bad request\n";
+        g_output_stream_write_all(g_io_stream_get_output_stream(
+                G_IO_STREAM(connection)), reply, strlen(reply), NULL, NULL,
+                NULL);
+        g_ptr_array_free(fields, TRUE);
+        g_free(request);
+        return FALSE;
     }
 
-    return retval;
+    args = (gchar **)fields->pdata;
+    termomix_reset_options();
+    nargv = termomix_rewrite_args(fields->len-2, args+1, &nargc);
+
+    context = g_option_context_new(NULL);
+    g_option_context_add_main_entries(context, entries, GETTEXT_PACKAGE);
+    g_option_context_set_help_enabled(context, FALSE);
+    if (!g_option_context_parse(context, &nargc, &nargv, &gerror)) {
+        gchar *reply = g_strdup_printf("error: %s\n", gerror->message);
+        g_output_stream_write_all(g_io_stream_get_output_stream(
+                G_IO_STREAM(connection)), reply, strlen(reply), NULL, NULL, NULL);
+        g_free(reply);
+        g_error_free(gerror);
+    } else if (!termomix_init_terminal(args[0])) {
+        g_output_stream_write_all(g_io_stream_get_output_stream(
+                G_IO_STREAM(connection)), "error: cannot open terminal\n", 28,
+                NULL, NULL, NULL);
+    } else {
+        /* Answered by termomix_map_event() */
+        termomix.term->client = g_object_ref(connection);
+    }
+
+    g_option_context_free(context);
+    g_strfreev(nargv);
+    g_ptr_array_free(fields, TRUE);
+    g_free(request);
+
+    return FALSE;
 }
 
 
-static void termomix_error(const char *format, ...) {
-    GtkWidget *dialog;
-    va_list args;
-    char* buff;
+/* Listen for termomix clients. Returns false if another daemon is running or
+ * the socket can't be created */
+static bool termomix_daemon_init() {
+    GSocketAddress *address;
+    GSocketClient *probe;
+    GSocketConnection *connection;
+    GError *gerror=NULL;
+    gchar *socketdir;
 
-    va_start(args, format);
-    buff = malloc(sizeof(char)*ERROR_BUFFER_LENGTH);
-    vsnprintf(buff, sizeof(char)*ERROR_BUFFER_LENGTH, format, args);
-    va_end(args);
+    termomix.daemon_socket = termomix_daemon_socket_path();
+    socketdir = g_path_get_dirname(termomix.daemon_socket);
+    g_mkdir_with_parents(socketdir, 0700);
+    g_free(socketdir);
 
-    dialog = gtk_message_dialog_new(GTK_WINDOW(termomix.main_window),
-            GTK_DIALOG_DESTROY_WITH_PARENT, GTK_MESSAGE_ERROR,
-            GTK_BUTTONS_CLOSE, "%s", buff);
-    gtk_window_set_title(GTK_WINDOW(dialog), gettext("Error message"));
-    gtk_dialog_run (GTK_DIALOG (dialog));
-    gtk_widget_destroy (dialog);
-    free(buff);
+    address = g_unix_socket_address_new(termomix.daemon_socket);
+
+    /* Only remove the socket if nobody is listening there */
+    probe = g_socket_client_new();
+    connection = g_socket_client_connect(probe, G_SOCKET_CONNECTABLE(address),
+            NULL, NULL);
+    g_object_unref(probe);
+    if (connection) {
+        fprintf(stderr, "A termomix daemon is already running\n");
+        g_object_unref(connection);
+        g_object_unref(address);
+        return false;
+    }
+    g_unlink(termomix.daemon_socket);
+
+    termomix.daemon_service = g_socket_service_new();
+    if (!g_socket_listener_add_address(
+            G_SOCKET_LISTENER(termomix.daemon_service), address,
+            G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_DEFAULT, NULL, NULL,
+            &gerror)) {
+        fprintf(stderr, "Cannot listen on %s: %s\n", termomix.daemon_socket,
+                gerror->message);
+        g_error_free(gerror);
+        g_object_unref(address);
+        g_object_unref(termomix.daemon_service);
+        termomix.daemon_service=NULL;
+        return false;
+    }
+    g_object_unref(address);
+
+    g_signal_connect(G_OBJECT(termomix.daemon_service), "incoming",
+            G_CALLBACK(termomix_daemon_incoming), NULL);
+    g_socket_service_start(termomix.daemon_service);
+
+    termomix_pool_schedule_refill();
+
+    return true;
+}
+
+
+/* Ask a running daemon to open our window. Returns false if there's no
+ * daemon, so the caller goes on and opens the window itself */
+static bool termomix_daemon_client(int argc, char **argv) {
+    GSocketAddress *address;
+    GSocketClient *client;
+    GSocketConnection *connection;
+    GDataInputStream *in;
+    GString *request;
+    gchar *path, *cwd, *reply;
+    int i;
+
+    path = termomix_daemon_socket_path();
+    address = g_unix_socket_address_new(path);
+    g_free(path);
+
+    client = g_socket_client_new();
+    connection = g_socket_client_connect(client, G_SOCKET_CONNECTABLE(address),
+            NULL, NULL);
+    g_object_unref(client);
+    g_object_unref(address);
+    if (!connection)
+        return false;
+
+    cwd = g_get_current_dir();
+    request = g_string_new(NULL);
+    g_string_append_len(request, cwd, strlen(cwd)+1);
+    for (i=0; i<argc; i++) {
+        g_string_append_len(request, argv[i], strlen(argv[i])+1);
+    }
+    g_free(cwd);
+
+    g_output_stream_write_all(g_io_stream_get_output_stream(
+            G_IO_STREAM(connection)), request->str, request->len, NULL, NULL,
+            NULL);
+    g_string_free(request, TRUE);
+    g_socket_shutdown(g_socket_connection_get_socket(connection), FALSE, TRUE,
+            NULL);
+
+    in = g_data_input_stream_new(g_io_stream_get_input_stream(
+            G_IO_STREAM(connection)));
+    reply = g_data_input_stream_read_line(in, NULL, NULL, NULL);
+    g_object_unref(in);
+    g_object_unref(connection);
+
+    if (!reply) {
+        fprintf(stderr, "termomix daemon closed the connection\n");
+        exit(EXIT_FAILURE);
+    }
+    if (strcmp(reply, "ok")!=0) {
+        fprintf(stderr, "%s\n", reply);
+        exit(EXIT_FAILURE);
+    }
+    g_free(reply);
+
+    return true;
 }
 
 
@@ -1225,44 +6766,32 @@ int main(int argc, char **argv) {
     gchar *localedir;
     GError *error=NULL;
     GOptionContext *context;
-    int i;
-    int n;
     char **nargv;
     int nargc;
 
     /* Localization */
+    termomix_profile_begin(PROFILE_LOCALE);
     setlocale(LC_ALL, "");
     localedir=g_strdup_printf("%s/locale", DATADIR);
     textdomain(GETTEXT_PACKAGE);
     bindtextdomain(GETTEXT_PACKAGE, localedir);
     bind_textdomain_codeset (GETTEXT_PACKAGE, "UTF-8");
     g_free(localedir);
+    termomix_profile_end(PROFILE_LOCALE);
 
-    /* Rewrites argv to include a -- after the -e argument this is required to make
-     * sure GOption doesn't grab any arguments meant for the command being called */
-
-    /* Initialize nargv */
-    nargv = (char**)calloc((argc+1), sizeof(char*));
-       n=0; nargc=argc;
-
-    for(i=0; i<argc; i++) {
-        if(g_strcmp0(argv[i],"-e") == 0)
-        {
-            nargv[n]="-e";
-            n++;
-            nargv[n]="--";
-            nargc = argc+1;
-        } else {
-            nargv[n]=g_strdup(argv[i]);
-        }
-        n++;
+    /* termomix @ COMMAND talks to a running termomix and exits */
+    if (argc > 1 && strcmp(argv[1], "@") == 0) {
+        return termomix_control_client(argc-2, argv+2);
     }
 
-    /* Options parsing */
+    termomix_profile_begin(PROFILE_OPTIONS);
+    nargv = termomix_rewrite_args(argc, argv, &nargc);
+
+    /* Options parsing. Don't open the display yet, a client never needs it */
     context = g_option_context_new (gettext("- vte-based terminal emulator"));
     g_option_context_add_main_entries (context, entries, GETTEXT_PACKAGE);
-    g_option_group_set_translation_domain(gtk_get_option_group(TRUE), GETTEXT_PACKAGE);
-    g_option_context_add_group (context, gtk_get_option_group(TRUE));
+    g_option_group_set_translation_domain(gtk_get_option_group(FALSE), GETTEXT_PACKAGE);
+    g_option_context_add_group (context, gtk_get_option_group(FALSE));
     g_option_context_parse (context, &nargc, &nargv, &error);
 
     if (option_version) {
@@ -1271,15 +6800,46 @@ int main(int argc, char **argv) {
     }
 
     g_option_context_free(context);
+    termomix_profile_end(PROFILE_OPTIONS);
+
+    if (option_profile_startup > 1) {
+        exit(termomix_profile_repeat(argc, argv));
+    }
+
+    /* The font and config file are shared by every daemon window, so asking
+     * for different ones means running on our own */
+    if (!option_daemon && !option_standalone && !option_font &&
+            !option_config_file && !option_profile_startup &&
+            !option_latency_trace && !option_log && !option_record &&
+            !option_replay) {
+        if (termomix_daemon_client(argc, argv)) {
+            g_strfreev(nargv);
+            return 0;
+        }
+    }
 
+    /* Overlap the config read and the command lookup with gtk_init() */
+    termomix_prefetch_config();
+    if (!option_daemon) {
+        termomix_prefetch_command();
+    }
+
+    termomix_profile_begin(PROFILE_GTK_INIT);
     gtk_init(&nargc, &nargv);
+    termomix_profile_end(PROFILE_GTK_INIT);
 
     g_strfreev(nargv);
 
     termomix_init();
-    termomix_init_terminal();
-    
-    vte_terminal_im_append_menuitems(VTE_TERMINAL(termomix.term->vte), GTK_MENU_SHELL(termomix.im_menu));
+    termomix_latency_init();
+
+    if (option_daemon) {
+        if (!termomix_daemon_init()) {
+            exit(EXIT_FAILURE);
+        }
+    } else if (!termomix_init_terminal(NULL)) {
+        exit(EXIT_FAILURE);
+    }
 
     gtk_main();
 